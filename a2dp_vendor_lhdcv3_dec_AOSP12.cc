@@ -1,5 +1,5 @@
 /******************************************************************************
- */////
+ *
  *  Copyright 2002-2012 Broadcom Corporation
  *
  *  Licensed under the Apache License, Version 2.0 (the "License");
@@ -28,15 +28,47 @@
 #include "bt_target.h"
 
 #include "a2dp_vendor_lhdcv3_dec.h"
-
+#include "a2dp_vendor_lhdcv3_sink.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include <base/logging.h>
 #include "a2dp_vendor.h"
 #include "a2dp_vendor_lhdcv3_decoder.h"
 #include "bt_utils.h"
+#include "osi/include/allocator.h"
 #include "osi/include/log.h"
 #include "osi/include/osi.h"
+#include "osi/include/properties.h"
+#include "osi/include/semaphore.h"
+#include "osi/include/time.h"
 
 
 // data type for the LHDC Codec Information Element */
@@ -60,8 +92,11 @@ typedef struct {
   bool hasFeatureLHDCV4;
 } tA2DP_LHDCV3_SINK_CIE;
 
+// Raw LHDC Codec Information Element, beginning from the LOSC octet
+typedef std::array<uint8_t, A2DP_LHDCV3_CODEC_LEN + 1> tA2DP_LHDCV3_SINK_INFO_BLOB;
+
 /* LHDC Sink codec capabilities */
-static const tA2DP_LHDCV3_SINK_CIE a2dp_lhdcv3_sink_caps = {
+static constexpr tA2DP_LHDCV3_SINK_CIE a2dp_lhdcv3_sink_caps = {
     A2DP_LHDC_VENDOR_ID,  // vendorId
     A2DP_LHDCV3_CODEC_ID,   // codecId
     // sampleRate
@@ -70,8 +105,7 @@ static const tA2DP_LHDCV3_SINK_CIE a2dp_lhdcv3_sink_caps = {
     // bits_per_sample
     (BTAV_A2DP_CODEC_BITS_PER_SAMPLE_16 | BTAV_A2DP_CODEC_BITS_PER_SAMPLE_24),
     //Channel Separation
-    //A2DP_LHDC_CH_SPLIT_NONE | A2DP_LHDC_CH_SPLIT_TWS,
-	A2DP_LHDC_CH_SPLIT_NONE,
+    A2DP_LHDC_CH_SPLIT_NONE,
     //Version number
     A2DP_LHDC_VER3,
     //Target bit Rate
@@ -111,8 +145,21 @@ static const tA2DP_LHDCV3_SINK_CIE a2dp_lhdcv3_sink_caps = {
     true,
 };
 
+// Returns |caps| with the TWS channel split added, in which each earbud of a
+// pair is sent one channel. The decoder library still decodes both channels,
+// so an earbud saves on PCM handling and output, not on decode CPU time.
+static constexpr tA2DP_LHDCV3_SINK_CIE A2DP_EarbudCapsLhdcV3Sink(
+    tA2DP_LHDCV3_SINK_CIE caps) {
+  caps.channelSplitMode |= A2DP_LHDC_CH_SPLIT_TWS;
+  return caps;
+}
+
+/* LHDC Sink codec capabilities of one earbud of a TWS pair */
+static constexpr tA2DP_LHDCV3_SINK_CIE a2dp_lhdcv3_sink_earbud_caps =
+    A2DP_EarbudCapsLhdcV3Sink(a2dp_lhdcv3_sink_caps);
+
 /* Default LHDC codec configuration */
-static const tA2DP_LHDCV3_SINK_CIE a2dp_lhdcv3_sink_default_config = {
+static constexpr tA2DP_LHDCV3_SINK_CIE a2dp_lhdcv3_sink_default_config = {
     A2DP_LHDC_VENDOR_ID,                // vendorId
     A2DP_LHDCV3_CODEC_ID,                 // codecId
     A2DP_LHDC_SAMPLING_FREQ_96000,      // sampleRate
@@ -144,216 +191,533 @@ static const tA2DP_LHDCV3_SINK_CIE a2dp_lhdcv3_sink_default_config = {
     true,
 };
 
-static const tA2DP_DECODER_INTERFACE a2dp_decoder_interface_lhdcv3 = {
-    a2dp_vendor_lhdcv3_decoder_init,
-    a2dp_vendor_lhdcv3_decoder_cleanup,
-    a2dp_vendor_lhdcv3_decoder_decode_packet,
-    a2dp_vendor_lhdcv3_decoder_start,
-    a2dp_vendor_lhdcv3_decoder_suspend,
-    a2dp_vendor_lhdcv3_decoder_configure,
-};
+// The decoder library sits behind the decode pipeline below.
+static const tA2DP_DECODER_INTERFACE* a2dp_lhdcv3_sink_decoder_interface(void);
+static void a2dp_lhdcv3_sink_append_stats(std::stringstream* p_res,
+                                          const uint8_t* p_codec_info);
 
 static tA2DP_STATUS A2DP_CodecInfoMatchesCapabilityLhdcV3Sink(
     const tA2DP_LHDCV3_SINK_CIE* p_cap, const uint8_t* p_codec_info,
     bool is_capability);
 
+/*******************************************************************************
+ *
+ *  Trace spans
+ *
+ *  Builds with A2DP_LHDCV3_SINK_SPANS defined time the receive, enqueue,
+ *  decode and PCM hand-off of every packet, along with the decoder interface
+ *  and configuration entry points. Each thread writes its spans to a ring of
+ *  its own, with no lock and no allocation after its first span.
+ *  A2DP_VendorExportSpansLhdcV3Sink() writes all rings out in the Chrome
+ *  trace event format, for chrome://tracing or Perfetto on the host. It may
+ *  run while the threads keep recording: each ring slot is a seqlock, so a
+ *  span overwritten while it was copied is dropped rather than torn.
+ *
+ *  Without the define A2DP_LHDCV3_SINK_SPAN() expands to nothing, so its
+ *  arguments must not have side effects.
+ *
+ ******************************************************************************/
 
-// Builds the LHDC Media Codec Capabilities byte sequence beginning from the
-// LOSC octet. |media_type| is the media type |AVDT_MEDIA_TYPE_*|.
-// |p_ie| is a pointer to the LHDC Codec Information Element information.
-// The result is stored in |p_result|. Returns A2DP_SUCCESS on success,
-// otherwise the corresponding A2DP error status code.
-static tA2DP_STATUS A2DP_BuildInfoLhdcV3Sink(uint8_t media_type,
-                                       const tA2DP_LHDCV3_SINK_CIE* p_ie,
-                                       uint8_t* p_result) {
+#if defined(A2DP_LHDCV3_SINK_SPANS)
 
-  const uint8_t* tmpInfo = p_result;
-  if (p_ie == NULL || p_result == NULL) {
-    return A2DP_INVALID_PARAMS;
+#define A2DP_LHDCV3_SINK_SPAN_RING_SIZE 8192  // Spans kept per thread
+
+typedef struct {
+  const char* name;  // String literal
+  uint64_t begin_us;
+  uint32_t dur_us;
+  pid_t tid;  // Rings outlive their threads and are handed on
+  uint32_t arg;
+} tA2DP_LHDCV3_SINK_SPAN_RECORD;
+
+// One span of a ring. |seq| is 2 * (n + 1) once span n of the ring is in
+// place, and odd while it is being written. The fields are relaxed atomics so
+// that the export can copy them while the owner writes.
+typedef struct {
+  std::atomic<uint64_t> seq;
+  std::atomic<const char*> name;
+  std::atomic<uint64_t> begin_us;
+  std::atomic<uint32_t> dur_us;
+  std::atomic<pid_t> tid;
+  std::atomic<uint32_t> arg;
+} tA2DP_LHDCV3_SINK_SPAN_SLOT;
+
+typedef struct {
+  std::atomic<uint64_t> head;  // Spans ever written
+  std::atomic<bool> in_use;
+  tA2DP_LHDCV3_SINK_SPAN_SLOT slots[A2DP_LHDCV3_SINK_SPAN_RING_SIZE];
+} tA2DP_LHDCV3_SINK_SPAN_RING;
+
+static std::mutex a2dp_lhdcv3_sink_span_mutex;  // Guards the ring list
+static std::vector<tA2DP_LHDCV3_SINK_SPAN_RING*> a2dp_lhdcv3_sink_span_rings;
+
+// Hands the ring of a thread on once the thread exits
+struct A2dpLhdcV3SinkSpanThread {
+  tA2DP_LHDCV3_SINK_SPAN_RING* p_ring = NULL;
+  pid_t tid = 0;
+  ~A2dpLhdcV3SinkSpanThread() {
+    if (p_ring != NULL) p_ring->in_use.store(false, std::memory_order_release);
+  }
+};
+static thread_local A2dpLhdcV3SinkSpanThread a2dp_lhdcv3_sink_span_thread;
+
+static void a2dp_lhdcv3_sink_span_record(const char* name, uint64_t begin_us,
+                                         uint32_t arg) {
+  uint64_t end_us = time_get_os_boottime_us();
+  A2dpLhdcV3SinkSpanThread* p_thread = &a2dp_lhdcv3_sink_span_thread;
+  if (p_thread->p_ring == NULL) {
+    std::lock_guard<std::mutex> lock(a2dp_lhdcv3_sink_span_mutex);
+    for (tA2DP_LHDCV3_SINK_SPAN_RING* p_ring : a2dp_lhdcv3_sink_span_rings) {
+      bool in_use = false;
+      if (p_ring->in_use.compare_exchange_strong(in_use, true)) {
+        p_thread->p_ring = p_ring;
+        break;
+      }
+    }
+    if (p_thread->p_ring == NULL) {
+      p_thread->p_ring = new tA2DP_LHDCV3_SINK_SPAN_RING();
+      p_thread->p_ring->in_use.store(true);
+      a2dp_lhdcv3_sink_span_rings.push_back(p_thread->p_ring);
+    }
+    p_thread->tid = gettid();
   }
 
-  *p_result++ = A2DP_LHDCV3_CODEC_LEN;    //0
-  *p_result++ = (media_type << 4);      //1
-  *p_result++ = A2DP_MEDIA_CT_NON_A2DP; //2
+  tA2DP_LHDCV3_SINK_SPAN_RING* p_ring = p_thread->p_ring;
+  uint64_t head = p_ring->head.load(std::memory_order_relaxed);
+  tA2DP_LHDCV3_SINK_SPAN_SLOT* p_slot =
+      &p_ring->slots[head % A2DP_LHDCV3_SINK_SPAN_RING_SIZE];
+  p_slot->seq.store(2 * head + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  p_slot->name.store(name, std::memory_order_relaxed);
+  p_slot->begin_us.store(begin_us, std::memory_order_relaxed);
+  p_slot->dur_us.store((uint32_t)(end_us - begin_us),
+                       std::memory_order_relaxed);
+  p_slot->tid.store(p_thread->tid, std::memory_order_relaxed);
+  p_slot->arg.store(arg, std::memory_order_relaxed);
+  p_slot->seq.store(2 * (head + 1), std::memory_order_release);
+  p_ring->head.store(head + 1, std::memory_order_release);
+}
+
+// Copies span |n| of |p_ring| into |p_record|. Returns false if the slot no
+// longer, or not yet, holds that span in full.
+static bool a2dp_lhdcv3_sink_span_read(
+    const tA2DP_LHDCV3_SINK_SPAN_RING* p_ring, uint64_t n,
+    tA2DP_LHDCV3_SINK_SPAN_RECORD* p_record) {
+  const tA2DP_LHDCV3_SINK_SPAN_SLOT* p_slot =
+      &p_ring->slots[n % A2DP_LHDCV3_SINK_SPAN_RING_SIZE];
+  uint64_t seq = p_slot->seq.load(std::memory_order_acquire);
+  if (seq != 2 * (n + 1)) return false;
+  p_record->name = p_slot->name.load(std::memory_order_relaxed);
+  p_record->begin_us = p_slot->begin_us.load(std::memory_order_relaxed);
+  p_record->dur_us = p_slot->dur_us.load(std::memory_order_relaxed);
+  p_record->tid = p_slot->tid.load(std::memory_order_relaxed);
+  p_record->arg = p_slot->arg.load(std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return p_slot->seq.load(std::memory_order_relaxed) == seq;
+}
+
+// Records the lifetime of the enclosing scope
+class A2dpLhdcV3SinkSpan {
+ public:
+  explicit A2dpLhdcV3SinkSpan(const char* name, uint32_t arg = 0)
+      : name_(name), arg_(arg), begin_us_(time_get_os_boottime_us()) {}
+  ~A2dpLhdcV3SinkSpan() {
+    a2dp_lhdcv3_sink_span_record(name_, begin_us_, arg_);
+  }
+
+ private:
+  const char* name_;
+  uint32_t arg_;
+  uint64_t begin_us_;
+};
+
+#define A2DP_LHDCV3_SINK_SPAN_VAR2(line) a2dp_lhdcv3_sink_span_##line
+#define A2DP_LHDCV3_SINK_SPAN_VAR(line) A2DP_LHDCV3_SINK_SPAN_VAR2(line)
+// A2DP_LHDCV3_SINK_SPAN(name [, arg]) spans the rest of the enclosing scope
+#define A2DP_LHDCV3_SINK_SPAN(...) \
+  A2dpLhdcV3SinkSpan A2DP_LHDCV3_SINK_SPAN_VAR(__LINE__)(__VA_ARGS__)
+
+#else
+
+#define A2DP_LHDCV3_SINK_SPAN(...)
+
+#endif
+
+
+// Encodes the LHDC Media Codec Capabilities byte sequence beginning from the
+// LOSC octet. |media_type| is the media type |AVDT_MEDIA_TYPE_*|.
+// |ie| is the LHDC Codec Information Element information.
+// This is usable in constant expressions, so the static tables above are
+// turned into codec info blobs at compile time.
+static constexpr tA2DP_LHDCV3_SINK_INFO_BLOB A2DP_EncodeInfoLhdcV3Sink(
+    uint8_t media_type, const tA2DP_LHDCV3_SINK_CIE& ie) {
+  tA2DP_LHDCV3_SINK_INFO_BLOB result = {};
+
+  result[0] = A2DP_LHDCV3_CODEC_LEN;
+  result[1] = (uint8_t)(media_type << 4);
+  result[2] = A2DP_MEDIA_CT_NON_A2DP;
 
   // Vendor ID and Codec ID
-  *p_result++ = (uint8_t)(p_ie->vendorId & 0x000000FF); //3
-  *p_result++ = (uint8_t)((p_ie->vendorId & 0x0000FF00) >> 8);  //4
-  *p_result++ = (uint8_t)((p_ie->vendorId & 0x00FF0000) >> 16); //5
-  *p_result++ = (uint8_t)((p_ie->vendorId & 0xFF000000) >> 24); //6
-  *p_result++ = (uint8_t)(p_ie->codecId & 0x00FF);  //7
-  *p_result++ = (uint8_t)((p_ie->codecId & 0xFF00) >> 8);   //8
+  result[3] = (uint8_t)(ie.vendorId & 0x000000FF);
+  result[4] = (uint8_t)((ie.vendorId & 0x0000FF00) >> 8);
+  result[5] = (uint8_t)((ie.vendorId & 0x00FF0000) >> 16);
+  result[6] = (uint8_t)((ie.vendorId & 0xFF000000) >> 24);
+  result[7] = (uint8_t)(ie.codecId & 0x00FF);
+  result[8] = (uint8_t)((ie.codecId & 0xFF00) >> 8);
 
   // Sampling Frequency & Bits per sample
   uint8_t para = 0;
 
   // sample rate bit0 ~ bit2
-  para = (uint8_t)(p_ie->sampleRate & A2DP_LHDC_SAMPLING_FREQ_MASK);
+  para = (uint8_t)(ie.sampleRate & A2DP_LHDC_SAMPLING_FREQ_MASK);
 
-  if (p_ie->bits_per_sample == (BTAV_A2DP_CODEC_BITS_PER_SAMPLE_24 | BTAV_A2DP_CODEC_BITS_PER_SAMPLE_16)) {
+  if (ie.bits_per_sample == (BTAV_A2DP_CODEC_BITS_PER_SAMPLE_24 | BTAV_A2DP_CODEC_BITS_PER_SAMPLE_16)) {
       para = para | (A2DP_LHDC_BIT_FMT_24 | A2DP_LHDC_BIT_FMT_16);
-  }else if(p_ie->bits_per_sample == BTAV_A2DP_CODEC_BITS_PER_SAMPLE_24){
+  }else if(ie.bits_per_sample == BTAV_A2DP_CODEC_BITS_PER_SAMPLE_24){
       para = para | A2DP_LHDC_BIT_FMT_24;
-  }else if(p_ie->bits_per_sample == BTAV_A2DP_CODEC_BITS_PER_SAMPLE_16){
+  }else if(ie.bits_per_sample == BTAV_A2DP_CODEC_BITS_PER_SAMPLE_16){
       para = para | A2DP_LHDC_BIT_FMT_16;
   }
 
-  if (p_ie->hasFeatureJAS)
-  {
-    para |= A2DP_LHDC_FEATURE_JAS;
-  }
-
-  if (p_ie->hasFeatureAR)
-  {
-    para |= A2DP_LHDC_FEATURE_AR;
-  }
+  if (ie.hasFeatureJAS) para |= A2DP_LHDC_FEATURE_JAS;
+  if (ie.hasFeatureAR) para |= A2DP_LHDC_FEATURE_AR;
 
   // Save octet 9
-  *p_result++ = para;   //9
+  result[9] = para;
 
-  para = p_ie->version;
-
-  para |= p_ie->maxTargetBitrate;
-
-  para |= p_ie->isLLSupported ? A2DP_LHDC_LL_SUPPORTED : A2DP_LHDC_LL_NONE;
-
-  if (p_ie->hasFeatureLLAC)
-  {
-    para |= A2DP_LHDC_FEATURE_LLAC;
-  }
+  para = ie.version;
+  para |= ie.maxTargetBitrate;
+  para |= ie.isLLSupported ? A2DP_LHDC_LL_SUPPORTED : A2DP_LHDC_LL_NONE;
+  if (ie.hasFeatureLLAC) para |= A2DP_LHDC_FEATURE_LLAC;
 
   // Save octet 10
-  *p_result++ = para;   //a
+  result[10] = para;
 
   //Save octet 11
-  para = p_ie->channelSplitMode;
-
-  if (p_ie->hasFeatureMETA)
-  {
-    para |= A2DP_LHDC_FEATURE_META;
-  }
-
-  if (p_ie->hasFeatureMinBitrate)
-  {
-    para |= A2DP_LHDC_FEATURE_MIN_BR;
-  }
-
-  if (p_ie->hasFeatureLARC)
-  {
-    para |= A2DP_LHDC_FEATURE_LARC;
-  }
-
-  if (p_ie->hasFeatureLHDCV4)
-  {
-    para |= A2DP_LHDC_FEATURE_LHDCV4;
-  }
+  para = ie.channelSplitMode;
+  if (ie.hasFeatureMETA) para |= A2DP_LHDC_FEATURE_META;
+  if (ie.hasFeatureMinBitrate) para |= A2DP_LHDC_FEATURE_MIN_BR;
+  if (ie.hasFeatureLARC) para |= A2DP_LHDC_FEATURE_LARC;
+  if (ie.hasFeatureLHDCV4) para |= A2DP_LHDC_FEATURE_LHDCV4;
 
-  *p_result++ = para;   //b
+  result[11] = para;
 
   //Save octet 12
-  //para = p_ie->supportedBitrate;
-  //*p_result++ = para;   //c
+  //para = ie.supportedBitrate;
+  //result[12] = para;
 
-  LOG_DEBUG("%s: Info build result = [0]:0x%x, [1]:0x%x, [2]:0x%x, [3]:0x%x, "
-                     "[4]:0x%x, [5]:0x%x, [6]:0x%x, [7]:0x%x, [8]:0x%x, [9]:0x%x, [10]:0x%x, [11]:0x%x",
-     __func__, tmpInfo[0], tmpInfo[1], tmpInfo[2], tmpInfo[3],
-                    tmpInfo[4], tmpInfo[5], tmpInfo[6], tmpInfo[7], tmpInfo[8], tmpInfo[9], tmpInfo[10], tmpInfo[11]);
-  return A2DP_SUCCESS;
+  return result;
 }
 
-// Parses the LHDC Media Codec Capabilities byte sequence beginning from the
-// LOSC octet. The result is stored in |p_ie|. The byte sequence to parse is
+// Decodes the LHDC Media Codec Capabilities byte sequence beginning from the
+// LOSC octet. The result is stored in |p_ie|. The byte sequence to decode is
 // |p_codec_info|. If |is_capability| is true, the byte sequence is
 // codec capabilities, otherwise is codec configuration.
+// This is the side-effect free core of A2DP_ParseInfoLhdcV3Sink() and is
+// usable in constant expressions.
 // Returns A2DP_SUCCESS on success, otherwise the corresponding A2DP error
 // status code.
-static tA2DP_STATUS A2DP_ParseInfoLhdcV3Sink(tA2DP_LHDCV3_SINK_CIE* p_ie,
-                                       const uint8_t* p_codec_info,
-                                       bool is_capability) {
-  uint8_t losc;
-  uint8_t media_type;
-  tA2DP_CODEC_TYPE codec_type;
-  const uint8_t* tmpInfo = p_codec_info;
-  const uint8_t* p_codec_Info_save = p_codec_info;
-
-  //LOG_DEBUG("%s: p_ie = %p, p_codec_info = %p", __func__, p_ie, p_codec_info);
+static constexpr tA2DP_STATUS A2DP_DecodeInfoLhdcV3Sink(
+    tA2DP_LHDCV3_SINK_CIE* p_ie, const uint8_t* p_codec_info,
+    bool is_capability) {
   if (p_ie == NULL || p_codec_info == NULL) return A2DP_INVALID_PARAMS;
 
   // Check the codec capability length
-  losc = *p_codec_info++;
+  if (p_codec_info[0] != A2DP_LHDCV3_CODEC_LEN) return A2DP_WRONG_CODEC;
 
-  if (losc != A2DP_LHDCV3_CODEC_LEN) return A2DP_WRONG_CODEC;
-
-  media_type = (*p_codec_info++) >> 4;
-  codec_type = *p_codec_info++;
-    //LOG_DEBUG("%s: media_type = %d, codec_type = %d", __func__, media_type, codec_type);
   /* Check the Media Type and Media Codec Type */
-  if (media_type != AVDT_MEDIA_TYPE_AUDIO ||
-      codec_type != A2DP_MEDIA_CT_NON_A2DP) {
+  if ((p_codec_info[1] >> 4) != AVDT_MEDIA_TYPE_AUDIO ||
+      p_codec_info[2] != A2DP_MEDIA_CT_NON_A2DP) {
     return A2DP_WRONG_CODEC;
   }
 
   // Check the Vendor ID and Codec ID */
-  p_ie->vendorId = (*p_codec_info & 0x000000FF) |
-                   (*(p_codec_info + 1) << 8 & 0x0000FF00) |
-                   (*(p_codec_info + 2) << 16 & 0x00FF0000) |
-                   (*(p_codec_info + 3) << 24 & 0xFF000000);
-  p_codec_info += 4;
-  p_ie->codecId =
-      (*p_codec_info & 0x00FF) | (*(p_codec_info + 1) << 8 & 0xFF00);
-  p_codec_info += 2;
-  LOG_DEBUG("%s:Vendor(0x%08x), Codec(0x%04x)", __func__, p_ie->vendorId, p_ie->codecId);
+  p_ie->vendorId = (p_codec_info[3] & 0x000000FF) |
+                   (p_codec_info[4] << 8 & 0x0000FF00) |
+                   (p_codec_info[5] << 16 & 0x00FF0000) |
+                   ((uint32_t)p_codec_info[6] << 24 & 0xFF000000);
+  p_ie->codecId = (p_codec_info[7] & 0x00FF) | (p_codec_info[8] << 8 & 0xFF00);
   if (p_ie->vendorId != A2DP_LHDC_VENDOR_ID ||
       p_ie->codecId != A2DP_LHDCV3_CODEC_ID) {
     return A2DP_WRONG_CODEC;
   }
 
-  p_ie->sampleRate = *p_codec_info & A2DP_LHDC_SAMPLING_FREQ_MASK;
-  if ((*p_codec_info & A2DP_LHDC_BIT_FMT_MASK) == 0) {
+  // Octet 9
+  p_ie->sampleRate = p_codec_info[9] & A2DP_LHDC_SAMPLING_FREQ_MASK;
+  if ((p_codec_info[9] & A2DP_LHDC_BIT_FMT_MASK) == 0) {
     return A2DP_WRONG_CODEC;
   }
 
-  p_ie->bits_per_sample = BTAV_A2DP_CODEC_BITS_PER_SAMPLE_NONE;
-  if (*p_codec_info & A2DP_LHDC_BIT_FMT_24)
-    p_ie->bits_per_sample |= BTAV_A2DP_CODEC_BITS_PER_SAMPLE_24;
-  if (*p_codec_info & A2DP_LHDC_BIT_FMT_16) {
-    p_ie->bits_per_sample |= BTAV_A2DP_CODEC_BITS_PER_SAMPLE_16;
-  }
+  int bits_per_sample = BTAV_A2DP_CODEC_BITS_PER_SAMPLE_NONE;
+  if (p_codec_info[9] & A2DP_LHDC_BIT_FMT_24)
+    bits_per_sample |= BTAV_A2DP_CODEC_BITS_PER_SAMPLE_24;
+  if (p_codec_info[9] & A2DP_LHDC_BIT_FMT_16)
+    bits_per_sample |= BTAV_A2DP_CODEC_BITS_PER_SAMPLE_16;
+  p_ie->bits_per_sample =
+      static_cast<btav_a2dp_codec_bits_per_sample_t>(bits_per_sample);
+
+  p_ie->hasFeatureJAS = (p_codec_info[9] & A2DP_LHDC_FEATURE_JAS) != 0;
+  p_ie->hasFeatureAR = (p_codec_info[9] & A2DP_LHDC_FEATURE_AR) != 0;
+
+  // Octet 10
+  p_ie->version = p_codec_info[10] & A2DP_LHDC_VERSION_MASK;
+  p_ie->maxTargetBitrate = p_codec_info[10] & A2DP_LHDC_MAX_BIT_RATE_MASK;
+  p_ie->isLLSupported = (p_codec_info[10] & A2DP_LHDC_LL_MASK) != 0;
+  p_ie->hasFeatureLLAC = (p_codec_info[10] & A2DP_LHDC_FEATURE_LLAC) != 0;
+
+  // Octet 11
+  p_ie->channelSplitMode = p_codec_info[11] & A2DP_LHDC_CH_SPLIT_MSK;
+  p_ie->hasFeatureMETA = (p_codec_info[11] & A2DP_LHDC_FEATURE_META) != 0;
+  p_ie->hasFeatureMinBitrate =
+      (p_codec_info[11] & A2DP_LHDC_FEATURE_MIN_BR) != 0;
+  p_ie->hasFeatureLARC = (p_codec_info[11] & A2DP_LHDC_FEATURE_LARC) != 0;
+  p_ie->hasFeatureLHDCV4 = (p_codec_info[11] & A2DP_LHDC_FEATURE_LHDCV4) != 0;
+
+  //p_ie->supportedBitrate = p_codec_info[12];
+
+  if (is_capability) return A2DP_SUCCESS;
+
+  // A configuration selects exactly one sampling frequency
+  if (p_ie->sampleRate == 0 || (p_ie->sampleRate & (p_ie->sampleRate - 1)) != 0)
+    return A2DP_BAD_SAMP_FREQ;
+
+  return A2DP_SUCCESS;
+}
 
+// Returns true if every field of |a| and |b| is the same.
+static constexpr bool A2DP_CieEqualsLhdcV3Sink(const tA2DP_LHDCV3_SINK_CIE& a,
+                                               const tA2DP_LHDCV3_SINK_CIE& b) {
+  return a.vendorId == b.vendorId && a.codecId == b.codecId &&
+         a.sampleRate == b.sampleRate &&
+         a.bits_per_sample == b.bits_per_sample &&
+         a.channelSplitMode == b.channelSplitMode && a.version == b.version &&
+         a.maxTargetBitrate == b.maxTargetBitrate &&
+         a.isLLSupported == b.isLLSupported &&
+         a.hasFeatureJAS == b.hasFeatureJAS &&
+         a.hasFeatureAR == b.hasFeatureAR &&
+         a.hasFeatureLLAC == b.hasFeatureLLAC &&
+         a.hasFeatureMETA == b.hasFeatureMETA &&
+         a.hasFeatureMinBitrate == b.hasFeatureMinBitrate &&
+         a.hasFeatureLARC == b.hasFeatureLARC &&
+         a.hasFeatureLHDCV4 == b.hasFeatureLHDCV4;
+}
+
+// Returns true if |blob| decodes back into exactly |ie|.
+static constexpr bool A2DP_InfoRoundTripsLhdcV3Sink(
+    const tA2DP_LHDCV3_SINK_INFO_BLOB& blob, const tA2DP_LHDCV3_SINK_CIE& ie,
+    bool is_capability) {
+  tA2DP_LHDCV3_SINK_CIE decoded = {};
+  return A2DP_DecodeInfoLhdcV3Sink(&decoded, blob.data(), is_capability) ==
+             A2DP_SUCCESS &&
+         A2DP_CieEqualsLhdcV3Sink(decoded, ie);
+}
 
-  p_codec_info += 1;
+/* Precomputed codec info for the sink and earbud capabilities and the
+ * default config */
+static constexpr tA2DP_LHDCV3_SINK_INFO_BLOB a2dp_lhdcv3_sink_caps_info =
+    A2DP_EncodeInfoLhdcV3Sink(AVDT_MEDIA_TYPE_AUDIO, a2dp_lhdcv3_sink_caps);
+static constexpr tA2DP_LHDCV3_SINK_INFO_BLOB a2dp_lhdcv3_sink_earbud_caps_info =
+    A2DP_EncodeInfoLhdcV3Sink(AVDT_MEDIA_TYPE_AUDIO, a2dp_lhdcv3_sink_earbud_caps);
+static constexpr tA2DP_LHDCV3_SINK_INFO_BLOB a2dp_lhdcv3_sink_default_config_info =
+    A2DP_EncodeInfoLhdcV3Sink(AVDT_MEDIA_TYPE_AUDIO,
+                              a2dp_lhdcv3_sink_default_config);
+
+static_assert(A2DP_InfoRoundTripsLhdcV3Sink(a2dp_lhdcv3_sink_caps_info,
+                                            a2dp_lhdcv3_sink_caps, true),
+              "a2dp_lhdcv3_sink_caps_info does not survive a build/parse "
+              "round trip");
+static_assert(A2DP_InfoRoundTripsLhdcV3Sink(a2dp_lhdcv3_sink_earbud_caps_info,
+                                            a2dp_lhdcv3_sink_earbud_caps, true),
+              "a2dp_lhdcv3_sink_earbud_caps_info does not survive a "
+              "build/parse round trip");
+static_assert(A2DP_InfoRoundTripsLhdcV3Sink(a2dp_lhdcv3_sink_default_config_info,
+                                            a2dp_lhdcv3_sink_default_config, false),
+              "a2dp_lhdcv3_sink_default_config_info does not survive a "
+              "build/parse round trip");
+
+// Local budget of codec negotiation, set by the caller or else read from the
+// properties once, at first use, rather than per negotiation.
+static std::mutex a2dp_lhdcv3_sink_budget_mutex;
+static bool a2dp_lhdcv3_sink_budget_valid;
+static tA2DP_LHDCV3_SINK_BUDGET a2dp_lhdcv3_sink_budget;
+
+// Reads the local budget from the persist.bluetooth.lhdcv3_sink properties.
+static tA2DP_LHDCV3_SINK_BUDGET A2DP_ReadBudgetLhdcV3Sink(void) {
+  tA2DP_LHDCV3_SINK_BUDGET budget;
+  budget.max_pcm_bytes_per_sec = 1000 * (uint32_t)osi_property_get_int32(
+      "persist.bluetooth.lhdcv3_sink.max_pcm_kBps", 0);
+  budget.max_bitrate_bps = 1000 * (uint32_t)osi_property_get_int32(
+      "persist.bluetooth.lhdcv3_sink.max_bitrate_kbps", 0);
+  budget.low_latency =
+      osi_property_get_bool("persist.bluetooth.lhdcv3_sink.low_latency", false);
+  budget.tws = osi_property_get_bool("persist.bluetooth.lhdcv3_sink.tws", false);
+  return budget;
+}
 
-  p_ie->version = (*p_codec_info) & A2DP_LHDC_VERSION_MASK;
-  //p_ie->version = 1;
+void A2DP_VendorSetBudgetLhdcV3Sink(const tA2DP_LHDCV3_SINK_BUDGET* p_budget) {
+  std::lock_guard<std::mutex> lock(a2dp_lhdcv3_sink_budget_mutex);
+  a2dp_lhdcv3_sink_budget = *p_budget;
+  a2dp_lhdcv3_sink_budget_valid = true;
+}
 
-  p_ie->maxTargetBitrate = (*p_codec_info) & A2DP_LHDC_MAX_BIT_RATE_MASK;
-  //p_ie->maxTargetBitrate = A2DP_LHDC_MAX_BIT_RATE_900K;
+static tA2DP_LHDCV3_SINK_BUDGET A2DP_GetBudgetLhdcV3Sink(void) {
+  std::lock_guard<std::mutex> lock(a2dp_lhdcv3_sink_budget_mutex);
+  if (!a2dp_lhdcv3_sink_budget_valid) {
+    a2dp_lhdcv3_sink_budget = A2DP_ReadBudgetLhdcV3Sink();
+    a2dp_lhdcv3_sink_budget_valid = true;
+  }
+  return a2dp_lhdcv3_sink_budget;
+}
 
-  p_ie->isLLSupported = ((*p_codec_info & A2DP_LHDC_LL_MASK) != 0)? true : false;
-  //p_ie->isLLSupported = false;
+// Returns true if this device is one earbud of a TWS pair. Only then does it
+// offer, and accept, the TWS channel split.
+static bool A2DP_IsEarbudLhdcV3Sink(void) { return A2DP_GetBudgetLhdcV3Sink().tws; }
 
-  p_codec_info += 1;
+// Returns the local capabilities, with the TWS split if |earbud|.
+static const tA2DP_LHDCV3_SINK_CIE& A2DP_LocalCapsLhdcV3Sink(bool earbud) {
+  return earbud ? a2dp_lhdcv3_sink_earbud_caps : a2dp_lhdcv3_sink_caps;
+}
 
-  p_ie->channelSplitMode = (*p_codec_info) & A2DP_LHDC_CH_SPLIT_MSK;
+// Builds without NDEBUG hex dump every codec info blob that is built or
+// parsed. Parsing runs many times per connection, so release builds leave the
+// dumps and their formatting out; define A2DP_LHDCV3_SINK_INFO_DUMP to keep
+// them.
+#if !defined(NDEBUG) && !defined(A2DP_LHDCV3_SINK_INFO_DUMP)
+#define A2DP_LHDCV3_SINK_INFO_DUMP
+#endif
 
-  //p_codec_info += 1;
+// Builds the LHDC Media Codec Capabilities byte sequence beginning from the
+// LOSC octet. |media_type| is the media type |AVDT_MEDIA_TYPE_*|.
+// |p_ie| is a pointer to the LHDC Codec Information Element information.
+// The result is stored in |p_result|. Returns A2DP_SUCCESS on success,
+// otherwise the corresponding A2DP error status code.
+static tA2DP_STATUS A2DP_BuildInfoLhdcV3Sink(uint8_t media_type,
+                                       const tA2DP_LHDCV3_SINK_CIE* p_ie,
+                                       uint8_t* p_result) {
 
-  //p_ie->supportedBitrate = (*p_codec_info);
+  if (p_ie == NULL || p_result == NULL) {
+    return A2DP_INVALID_PARAMS;
+  }
 
+  const tA2DP_LHDCV3_SINK_INFO_BLOB blob =
+      A2DP_EncodeInfoLhdcV3Sink(media_type, *p_ie);
+  memcpy(p_result, blob.data(), blob.size());
 
+#if defined(A2DP_LHDCV3_SINK_INFO_DUMP)
+  const uint8_t* tmpInfo = p_result;
+  LOG_DEBUG("%s: Info build result = [0]:0x%x, [1]:0x%x, [2]:0x%x, [3]:0x%x, "
+                     "[4]:0x%x, [5]:0x%x, [6]:0x%x, [7]:0x%x, [8]:0x%x, [9]:0x%x, [10]:0x%x, [11]:0x%x",
+     __func__, tmpInfo[0], tmpInfo[1], tmpInfo[2], tmpInfo[3],
+                    tmpInfo[4], tmpInfo[5], tmpInfo[6], tmpInfo[7], tmpInfo[8], tmpInfo[9], tmpInfo[10], tmpInfo[11]);
+#endif
+  return A2DP_SUCCESS;
+}
 
+// Parses the LHDC Media Codec Capabilities byte sequence beginning from the
+// LOSC octet. The result is stored in |p_ie|. The byte sequence to parse is
+// |p_codec_info|. If |is_capability| is true, the byte sequence is
+// codec capabilities, otherwise is codec configuration.
+// Returns A2DP_SUCCESS on success, otherwise the corresponding A2DP error
+// status code.
+static tA2DP_STATUS A2DP_ParseInfoLhdcV3Sink(tA2DP_LHDCV3_SINK_CIE* p_ie,
+                                       const uint8_t* p_codec_info,
+                                       bool is_capability) {
+  tA2DP_STATUS status =
+      A2DP_DecodeInfoLhdcV3Sink(p_ie, p_codec_info, is_capability);
+  if (status != A2DP_SUCCESS) return status;
 
-    LOG_DEBUG("%s: codec info = [0]:0x%x, [1]:0x%x, [2]:0x%x, [3]:0x%x, [4]:0x%x, [5]:0x%x, [6]:0x%x, [7]:0x%x, [8]:0x%x, [9]:0x%x, [10]:0x%x, [11]:0x%x",
+#if defined(A2DP_LHDCV3_SINK_INFO_DUMP)
+  const uint8_t* tmpInfo = p_codec_info;
+  LOG_DEBUG("%s:Vendor(0x%08x), Codec(0x%04x)", __func__, p_ie->vendorId, p_ie->codecId);
+  LOG_DEBUG("%s: codec info = [0]:0x%x, [1]:0x%x, [2]:0x%x, [3]:0x%x, [4]:0x%x, [5]:0x%x, [6]:0x%x, [7]:0x%x, [8]:0x%x, [9]:0x%x, [10]:0x%x, [11]:0x%x",
             __func__, tmpInfo[0], tmpInfo[1], tmpInfo[2], tmpInfo[3], tmpInfo[4], tmpInfo[5], tmpInfo[6],
                         tmpInfo[7], tmpInfo[8], tmpInfo[9], tmpInfo[10], tmpInfo[11]);
+#endif
 
-  if (is_capability) return A2DP_SUCCESS;
+  return A2DP_SUCCESS;
+}
 
-  if (A2DP_BitsSet(p_ie->sampleRate) != A2DP_SET_ONE_BIT)
-    return A2DP_BAD_SAMP_FREQ;
+// Parse-once cache for LHDC V3 codec info.
+// The same few codec info blobs (local capability, peer capability and the
+// negotiated configuration) are queried over and over while a stream is set
+// up or reconfigured. Each blob is parsed once and the decoded result is kept
+// keyed by its raw bytes, so later queries cost a hash probe instead of a full
+// parse.
+struct A2dpLhdcV3SinkInfoKeyHash {
+  size_t operator()(const tA2DP_LHDCV3_SINK_INFO_BLOB& key) const {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (uint8_t byte : key) {
+      hash ^= byte;
+      hash *= 1099511628211ULL;
+    }
+    return static_cast<size_t>(hash);
+  }
+};
+
+typedef struct {
+  tA2DP_STATUS capability_status;  // Result of parsing as codec capability
+  tA2DP_STATUS config_status;      // Result of parsing as codec configuration
+  std::shared_ptr<const tA2DP_LHDCV3_SINK_CIE> cie;
+} tA2DP_LHDCV3_SINK_INFO_ENTRY;
+
+// Peers can present arbitrary blobs, so the cache is bounded. When it is full
+// it is simply emptied; entries already handed out stay alive through their
+// shared_ptr.
+#define A2DP_LHDCV3_SINK_INFO_CACHE_MAX 32
+
+static std::mutex lhdcv3_sink_info_cache_mutex;
+static std::unordered_map<tA2DP_LHDCV3_SINK_INFO_BLOB,
+                          tA2DP_LHDCV3_SINK_INFO_ENTRY,
+                          A2dpLhdcV3SinkInfoKeyHash>
+    lhdcv3_sink_info_cache;
+
+// Looks up the decoded form of |p_codec_info|, parsing it on a cache miss.
+// If |is_capability| is true, the byte sequence is codec capabilities,
+// otherwise is codec configuration. On success |p_ie| is set to the immutable
+// decoded LHDC Codec Information Element.
+// Returns A2DP_SUCCESS on success, otherwise the corresponding A2DP error
+// status code.
+static tA2DP_STATUS A2DP_LookupInfoLhdcV3Sink(
+    const uint8_t* p_codec_info, bool is_capability,
+    std::shared_ptr<const tA2DP_LHDCV3_SINK_CIE>* p_ie) {
+  if (p_ie == NULL || p_codec_info == NULL) return A2DP_INVALID_PARAMS;
+
+  // Only well-sized blobs can be used as a key
+  if (p_codec_info[0] != A2DP_LHDCV3_CODEC_LEN) return A2DP_WRONG_CODEC;
+
+  tA2DP_LHDCV3_SINK_INFO_BLOB key;
+  memcpy(key.data(), p_codec_info, key.size());
+
+  tA2DP_LHDCV3_SINK_INFO_ENTRY entry;
+  {
+    std::lock_guard<std::mutex> lock(lhdcv3_sink_info_cache_mutex);
+    auto iter = lhdcv3_sink_info_cache.find(key);
+    if (iter != lhdcv3_sink_info_cache.end()) entry = iter->second;
+  }
+
+  if (entry.cie == nullptr) {
+    auto cie = std::make_shared<tA2DP_LHDCV3_SINK_CIE>();
+    entry.capability_status = A2DP_ParseInfoLhdcV3Sink(cie.get(), p_codec_info, true);
+    entry.config_status = entry.capability_status;
+    if (entry.config_status == A2DP_SUCCESS &&
+        A2DP_BitsSet(cie->sampleRate) != A2DP_SET_ONE_BIT) {
+      entry.config_status = A2DP_BAD_SAMP_FREQ;
+    }
+    entry.cie = cie;
+
+    std::lock_guard<std::mutex> lock(lhdcv3_sink_info_cache_mutex);
+    if (lhdcv3_sink_info_cache.size() >= A2DP_LHDCV3_SINK_INFO_CACHE_MAX) {
+      lhdcv3_sink_info_cache.clear();
+    }
+    lhdcv3_sink_info_cache.emplace(key, entry);
+  }
 
-  save_codec_info (p_codec_Info_save);
+  tA2DP_STATUS status =
+      is_capability ? entry.capability_status : entry.config_status;
+  if (status != A2DP_SUCCESS) return status;
 
+  *p_ie = entry.cie;
   return A2DP_SUCCESS;
 }
 
@@ -362,41 +726,68 @@ const char* A2DP_VendorCodecNameLhdcV3Sink(UNUSED_ATTR const uint8_t* p_codec_in
 }
 
 bool A2DP_IsVendorSinkCodecValidLhdcV3(const uint8_t* p_codec_info) {
-  tA2DP_LHDCV3_SINK_CIE cfg_cie;
+  std::shared_ptr<const tA2DP_LHDCV3_SINK_CIE> cfg_cie;
 
   /* Use a liberal check when parsing the codec info */
-  return (A2DP_ParseInfoLhdcV3Sink(&cfg_cie, p_codec_info, false) == A2DP_SUCCESS) ||
-         (A2DP_ParseInfoLhdcV3Sink(&cfg_cie, p_codec_info, true) == A2DP_SUCCESS);
+  return (A2DP_LookupInfoLhdcV3Sink(p_codec_info, false, &cfg_cie) == A2DP_SUCCESS) ||
+         (A2DP_LookupInfoLhdcV3Sink(p_codec_info, true, &cfg_cie) == A2DP_SUCCESS);
 }
 
 
 bool A2DP_IsVendorPeerSourceCodecValidLhdcV3(const uint8_t* p_codec_info) {
-  tA2DP_LHDCV3_SINK_CIE cfg_cie;
+  std::shared_ptr<const tA2DP_LHDCV3_SINK_CIE> cfg_cie;
 
   /* Use a liberal check when parsing the codec info */
-  return (A2DP_ParseInfoLhdcV3Sink(&cfg_cie, p_codec_info, false) == A2DP_SUCCESS) ||
-         (A2DP_ParseInfoLhdcV3Sink(&cfg_cie, p_codec_info, true) == A2DP_SUCCESS);
+  return (A2DP_LookupInfoLhdcV3Sink(p_codec_info, false, &cfg_cie) == A2DP_SUCCESS) ||
+         (A2DP_LookupInfoLhdcV3Sink(p_codec_info, true, &cfg_cie) == A2DP_SUCCESS);
 }
 
 
 bool A2DP_IsVendorSinkCodecSupportedLhdcV3(const uint8_t* p_codec_info) {
-  return (A2DP_CodecInfoMatchesCapabilityLhdcV3Sink(&a2dp_lhdcv3_sink_caps, p_codec_info,
-                                             false) == A2DP_SUCCESS);
+  return (A2DP_CodecInfoMatchesCapabilityLhdcV3Sink(
+              &A2DP_LocalCapsLhdcV3Sink(A2DP_IsEarbudLhdcV3Sink()), p_codec_info,
+              false) == A2DP_SUCCESS);
 }
 
 bool A2DP_IsPeerSourceCodecSupportedLhdcV3(const uint8_t* p_codec_info) {
-  return (A2DP_CodecInfoMatchesCapabilityLhdcV3Sink(&a2dp_lhdcv3_sink_caps, p_codec_info,
-                                             true) == A2DP_SUCCESS);
+  return (A2DP_CodecInfoMatchesCapabilityLhdcV3Sink(
+              &A2DP_LocalCapsLhdcV3Sink(A2DP_IsEarbudLhdcV3Sink()), p_codec_info,
+              true) == A2DP_SUCCESS);
 }
 
 void A2DP_InitDefaultCodecLhdcV3Sink(uint8_t* p_codec_info) {
   LOG_DEBUG("%s: enter", __func__);
-  if (A2DP_BuildInfoLhdcV3Sink(AVDT_MEDIA_TYPE_AUDIO, &a2dp_lhdcv3_sink_default_config,
-                        p_codec_info) != A2DP_SUCCESS) {
-    LOG_ERROR("%s: A2DP_BuildInfoSbc failed", __func__);
-  }
+  memcpy(p_codec_info, a2dp_lhdcv3_sink_default_config_info.data(),
+         a2dp_lhdcv3_sink_default_config_info.size());
+}
+
+// Checks whether the decoded LHDC configuration |cfg_ie| fits within the
+// capabilities |cap_ie|. Pure, so it can be evaluated on its own.
+// Returns A2DP_SUCCESS if it does, otherwise the corresponding A2DP error
+// status code.
+static constexpr tA2DP_STATUS A2DP_CieMatchesCapabilityLhdcV3Sink(
+    const tA2DP_LHDCV3_SINK_CIE& cap_ie, const tA2DP_LHDCV3_SINK_CIE& cfg_ie) {
+  /* sampling frequency */
+  if ((cfg_ie.sampleRate & cap_ie.sampleRate) == 0) return A2DP_NS_SAMP_FREQ;
+
+  /* bit per sample */
+  if ((static_cast<int>(cfg_ie.bits_per_sample) &
+       static_cast<int>(cap_ie.bits_per_sample)) == 0)
+    return A2DP_NS_CH_MODE;
+
+  /* channel split mode; sources that leave it empty mean no split */
+  if (cfg_ie.channelSplitMode != 0 &&
+      (cfg_ie.channelSplitMode & cap_ie.channelSplitMode) == 0)
+    return A2DP_NS_CH_MODE;
+
+  return A2DP_SUCCESS;
 }
 
+static_assert(A2DP_CieMatchesCapabilityLhdcV3Sink(
+                  a2dp_lhdcv3_sink_caps, a2dp_lhdcv3_sink_default_config) ==
+                  A2DP_SUCCESS,
+              "LHDC V3 sink default config must fit the sink capabilities");
+
 // Checks whether A2DP SBC codec configuration matches with a device's codec
 // capabilities. |p_cap| is the SBC codec configuration. |p_codec_info| is
 // the device's codec capabilities. |is_capability| is true if
@@ -407,10 +798,10 @@ static tA2DP_STATUS A2DP_CodecInfoMatchesCapabilityLhdcV3Sink(
     const tA2DP_LHDCV3_SINK_CIE* p_cap, const uint8_t* p_codec_info,
     bool is_capability) {
   tA2DP_STATUS status;
-  tA2DP_LHDCV3_SINK_CIE cfg_cie;
+  std::shared_ptr<const tA2DP_LHDCV3_SINK_CIE> cfg_cie;
 
   /* parse configuration */
-  status = A2DP_ParseInfoLhdcV3Sink(&cfg_cie, p_codec_info, is_capability);
+  status = A2DP_LookupInfoLhdcV3Sink(p_codec_info, is_capability, &cfg_cie);
   if (status != A2DP_SUCCESS) {
     LOG_ERROR("%s: parsing failed %d", __func__, status);
     return status;
@@ -419,34 +810,28 @@ static tA2DP_STATUS A2DP_CodecInfoMatchesCapabilityLhdcV3Sink(
   /* verify that each parameter is in range */
 
   LOG_DEBUG("%s: FREQ peer: 0x%x, capability 0x%x", __func__,
-            cfg_cie.sampleRate, p_cap->sampleRate);
+            cfg_cie->sampleRate, p_cap->sampleRate);
 
   LOG_DEBUG("%s: BIT_FMT peer: 0x%x, capability 0x%x", __func__,
-            cfg_cie.bits_per_sample, p_cap->bits_per_sample);
-
-  /* sampling frequency */
-  if ((cfg_cie.sampleRate & p_cap->sampleRate) == 0) return A2DP_NS_SAMP_FREQ;
-
-  /* bit per sample */
-  if ((cfg_cie.bits_per_sample & p_cap->bits_per_sample) == 0) return A2DP_NS_CH_MODE;
+            cfg_cie->bits_per_sample, p_cap->bits_per_sample);
 
-  return A2DP_SUCCESS;
+  return A2DP_CieMatchesCapabilityLhdcV3Sink(*p_cap, *cfg_cie);
 }
 
 bool A2DP_VendorCodecTypeEqualsLhdcV3Sink(const uint8_t* p_codec_info_a,
                                     const uint8_t* p_codec_info_b) {
-  tA2DP_LHDCV3_SINK_CIE lhdc_cie_a;
-  tA2DP_LHDCV3_SINK_CIE lhdc_cie_b;
+  std::shared_ptr<const tA2DP_LHDCV3_SINK_CIE> lhdc_cie_a;
+  std::shared_ptr<const tA2DP_LHDCV3_SINK_CIE> lhdc_cie_b;
 
   // Check whether the codec info contains valid data
   tA2DP_STATUS a2dp_status =
-      A2DP_ParseInfoLhdcV3Sink(&lhdc_cie_a, p_codec_info_a, true);
+      A2DP_LookupInfoLhdcV3Sink(p_codec_info_a, true, &lhdc_cie_a);
   if (a2dp_status != A2DP_SUCCESS) {
     LOG_ERROR("%s: cannot decode codec information: %d", __func__,
               a2dp_status);
     return false;
   }
-  a2dp_status = A2DP_ParseInfoLhdcV3Sink(&lhdc_cie_b, p_codec_info_b, true);
+  a2dp_status = A2DP_LookupInfoLhdcV3Sink(p_codec_info_b, true, &lhdc_cie_b);
   if (a2dp_status != A2DP_SUCCESS) {
     LOG_ERROR("%s: cannot decode codec information: %d", __func__,
               a2dp_status);
@@ -458,43 +843,43 @@ bool A2DP_VendorCodecTypeEqualsLhdcV3Sink(const uint8_t* p_codec_info_a,
 
 bool A2DP_VendorCodecEqualsLhdcV3Sink(const uint8_t* p_codec_info_a,
                                 const uint8_t* p_codec_info_b) {
-  tA2DP_LHDCV3_SINK_CIE lhdc_cie_a;
-  tA2DP_LHDCV3_SINK_CIE lhdc_cie_b;
+  std::shared_ptr<const tA2DP_LHDCV3_SINK_CIE> lhdc_cie_a;
+  std::shared_ptr<const tA2DP_LHDCV3_SINK_CIE> lhdc_cie_b;
 
   // Check whether the codec info contains valid data
   tA2DP_STATUS a2dp_status =
-      A2DP_ParseInfoLhdcV3Sink(&lhdc_cie_a, p_codec_info_a, true);
+      A2DP_LookupInfoLhdcV3Sink(p_codec_info_a, true, &lhdc_cie_a);
   if (a2dp_status != A2DP_SUCCESS) {
     LOG_ERROR("%s: cannot decode codec information: %d", __func__,
               a2dp_status);
     return false;
   }
-  a2dp_status = A2DP_ParseInfoLhdcV3Sink(&lhdc_cie_b, p_codec_info_b, true);
+  a2dp_status = A2DP_LookupInfoLhdcV3Sink(p_codec_info_b, true, &lhdc_cie_b);
   if (a2dp_status != A2DP_SUCCESS) {
     LOG_ERROR("%s: cannot decode codec information: %d", __func__,
               a2dp_status);
     return false;
   }
 
-  return (lhdc_cie_a.sampleRate == lhdc_cie_b.sampleRate) &&
-         (lhdc_cie_a.bits_per_sample == lhdc_cie_b.bits_per_sample) &&
-         /*(lhdc_cie_a.supportedBitrate == lhdc_cie_b.supportedBitrate) &&*/
-         (lhdc_cie_a.isLLSupported == lhdc_cie_b.isLLSupported);
+  return (lhdc_cie_a->sampleRate == lhdc_cie_b->sampleRate) &&
+         (lhdc_cie_a->bits_per_sample == lhdc_cie_b->bits_per_sample) &&
+         /*(lhdc_cie_a->supportedBitrate == lhdc_cie_b->supportedBitrate) &&*/
+         (lhdc_cie_a->isLLSupported == lhdc_cie_b->isLLSupported);
 }
 
 
 int A2DP_VendorGetTrackSampleRateLhdcV3Sink(const uint8_t* p_codec_info) {
-  tA2DP_LHDCV3_SINK_CIE lhdc_cie;
+  std::shared_ptr<const tA2DP_LHDCV3_SINK_CIE> lhdc_cie;
 
   // Check whether the codec info contains valid data
-  tA2DP_STATUS a2dp_status = A2DP_ParseInfoLhdcV3Sink(&lhdc_cie, p_codec_info, false);
+  tA2DP_STATUS a2dp_status = A2DP_LookupInfoLhdcV3Sink(p_codec_info, false, &lhdc_cie);
   if (a2dp_status != A2DP_SUCCESS) {
     LOG_ERROR("%s: cannot decode codec information: %d", __func__,
               a2dp_status);
     return -1;
   }
 
-  switch (lhdc_cie.sampleRate) {
+  switch (lhdc_cie->sampleRate) {
     case A2DP_LHDC_SAMPLING_FREQ_44100:
       return 44100;
     case A2DP_LHDC_SAMPLING_FREQ_48000:
@@ -508,30 +893,73 @@ int A2DP_VendorGetTrackSampleRateLhdcV3Sink(const uint8_t* p_codec_info) {
   return -1;
 }
 
+// Output container size requested by the device, 16 or 0 to follow the
+// stream. Read when the codec is initialized, not per query.
+static std::atomic<int> a2dp_lhdcv3_sink_output_bits_pref{0};
+
+// Reads the output container size the device asks for. Output devices that
+// only take 16-bit PCM set persist.bluetooth.lhdcv3_sink.output_bits to 16.
+static void a2dp_lhdcv3_sink_read_output_bits(void) {
+  a2dp_lhdcv3_sink_output_bits_pref.store(
+      osi_property_get_int32("persist.bluetooth.lhdcv3_sink.output_bits", 0) == 16
+          ? 16
+          : 0,
+      std::memory_order_relaxed);
+}
+
+// Returns the container size of the PCM handed to the audio track for a
+// stream decoded at |bits_per_sample|.
+static int a2dp_lhdcv3_sink_output_bits(int bits_per_sample) {
+  return a2dp_lhdcv3_sink_output_bits_pref.load(std::memory_order_relaxed) == 16
+             ? 16
+             : bits_per_sample;
+}
+
+int A2DP_VendorGetTrackBitsPerSampleLhdcV3Sink(const uint8_t* p_codec_info) {
+  std::shared_ptr<const tA2DP_LHDCV3_SINK_CIE> lhdc_cie;
+
+  // Check whether the codec info contains valid data
+  tA2DP_STATUS a2dp_status = A2DP_LookupInfoLhdcV3Sink(p_codec_info, false, &lhdc_cie);
+  if (a2dp_status != A2DP_SUCCESS) {
+    LOG_ERROR("%s: cannot decode codec information: %d", __func__,
+              a2dp_status);
+    return -1;
+  }
+
+  return a2dp_lhdcv3_sink_output_bits(
+      (lhdc_cie->bits_per_sample & BTAV_A2DP_CODEC_BITS_PER_SAMPLE_24) ? 24 : 16);
+}
+
 int A2DP_VendorGetSinkTrackChannelTypeLhdcV3(const uint8_t* p_codec_info) {
-  tA2DP_LHDCV3_SINK_CIE lhdc_cie;
+  std::shared_ptr<const tA2DP_LHDCV3_SINK_CIE> lhdc_cie;
 
   // Check whether the codec info contains valid data
-  tA2DP_STATUS a2dp_status = A2DP_ParseInfoLhdcV3Sink(&lhdc_cie, p_codec_info, false);
+  tA2DP_STATUS a2dp_status = A2DP_LookupInfoLhdcV3Sink(p_codec_info, false, &lhdc_cie);
   if (a2dp_status != A2DP_SUCCESS) {
     LOG_ERROR("%s: cannot decode codec information: %d", __func__,
               a2dp_status);
     return -1;
   }
 
+  // In TWS split mode each sink plays a single channel
+  if (lhdc_cie->channelSplitMode & A2DP_LHDC_CH_SPLIT_TWS)
+    return A2DP_LHDC_CHANNEL_MODE_MONO;
   return A2DP_LHDC_CHANNEL_MODE_STEREO;
 }
 
 int A2DP_VendorGetChannelModeCodeLhdcV3Sink(const uint8_t* p_codec_info) {
-  tA2DP_LHDCV3_SINK_CIE lhdc_cie;
+  std::shared_ptr<const tA2DP_LHDCV3_SINK_CIE> lhdc_cie;
 
   // Check whether the codec info contains valid data
-  tA2DP_STATUS a2dp_status = A2DP_ParseInfoLhdcV3Sink(&lhdc_cie, p_codec_info, false);
+  tA2DP_STATUS a2dp_status = A2DP_LookupInfoLhdcV3Sink(p_codec_info, false, &lhdc_cie);
   if (a2dp_status != A2DP_SUCCESS) {
     LOG_ERROR("%s: cannot decode codec information: %d", __func__,
               a2dp_status);
     return -1;
   }
+
+  if (lhdc_cie->channelSplitMode & A2DP_LHDC_CH_SPLIT_TWS)
+    return A2DP_LHDC_CHANNEL_MODE_MONO;
   return A2DP_LHDC_CHANNEL_MODE_STEREO;
 }
 
@@ -539,7 +967,8 @@ bool A2DP_VendorGetPacketTimestampLhdcV3Sink(UNUSED_ATTR const uint8_t* p_codec_
                                        const uint8_t* p_data,
                                        uint32_t* p_timestamp) {
   // TODO: Is this function really codec-specific?
-  *p_timestamp = *(const uint32_t*)p_data;
+  // |p_data| carries no alignment guarantee
+  memcpy(p_timestamp, p_data, sizeof(*p_timestamp));
   return true;
 }
 /*
@@ -560,9 +989,9 @@ std::string A2DP_VendorCodecInfoStringLhdcV3Sink(const uint8_t* p_codec_info) {
   std::stringstream res;
   std::string field;
   tA2DP_STATUS a2dp_status;
-  tA2DP_LHDCV3_SINK_CIE lhdc_cie;
+  std::shared_ptr<const tA2DP_LHDCV3_SINK_CIE> lhdc_cie;
 
-  a2dp_status = A2DP_ParseInfoLhdcV3Sink(&lhdc_cie, p_codec_info, true);
+  a2dp_status = A2DP_LookupInfoLhdcV3Sink(p_codec_info, true, &lhdc_cie);
   if (a2dp_status != A2DP_SUCCESS) {
     res << "A2DP_ParseInfoLhdcV3Sink fail: " << loghex(a2dp_status);
     return res.str();
@@ -572,50 +1001,61 @@ std::string A2DP_VendorCodecInfoStringLhdcV3Sink(const uint8_t* p_codec_info) {
 
   // Sample frequency
   field.clear();
-  AppendField(&field, (lhdc_cie.sampleRate == 0), "NONE");
-  AppendField(&field, (lhdc_cie.sampleRate & A2DP_LHDC_SAMPLING_FREQ_44100),
+  AppendField(&field, (lhdc_cie->sampleRate == 0), "NONE");
+  AppendField(&field, (lhdc_cie->sampleRate & A2DP_LHDC_SAMPLING_FREQ_44100),
               "44100");
-  AppendField(&field, (lhdc_cie.sampleRate & A2DP_LHDC_SAMPLING_FREQ_48000),
+  AppendField(&field, (lhdc_cie->sampleRate & A2DP_LHDC_SAMPLING_FREQ_48000),
               "48000");
-  AppendField(&field, (lhdc_cie.sampleRate & A2DP_LHDC_SAMPLING_FREQ_88200),
+  AppendField(&field, (lhdc_cie->sampleRate & A2DP_LHDC_SAMPLING_FREQ_88200),
               "88200");
-  AppendField(&field, (lhdc_cie.sampleRate & A2DP_LHDC_SAMPLING_FREQ_96000),
+  AppendField(&field, (lhdc_cie->sampleRate & A2DP_LHDC_SAMPLING_FREQ_96000),
               "96000");
-  res << "\tsamp_freq: " << field << " (" << loghex(lhdc_cie.sampleRate)
+  res << "\tsamp_freq: " << field << " (" << loghex(lhdc_cie->sampleRate)
       << ")\n";
 
   // Channel mode
   field.clear();
-  AppendField(&field, 1,
-             "Stereo");
-  res << "\tch_mode: " << field << " (" << "Only support stereo."
-      << ")\n";
+  AppendField(&field, !(lhdc_cie->channelSplitMode & A2DP_LHDC_CH_SPLIT_TWS),
+              "Stereo");
+  AppendField(&field, (lhdc_cie->channelSplitMode & A2DP_LHDC_CH_SPLIT_TWS),
+              "Mono");
+  res << "\tch_mode: " << field << "\n";
+
+  // Channel split mode
+  field.clear();
+  AppendField(&field, (lhdc_cie->channelSplitMode == 0), "NONE");
+  AppendField(&field, (lhdc_cie->channelSplitMode & A2DP_LHDC_CH_SPLIT_NONE),
+              "No split");
+  AppendField(&field, (lhdc_cie->channelSplitMode & A2DP_LHDC_CH_SPLIT_TWS),
+              "TWS");
+  res << "\tch_split: " << field << " ("
+      << loghex(lhdc_cie->channelSplitMode) << ")\n";
 
   // bits per sample
   field.clear();
-  AppendField(&field, (lhdc_cie.bits_per_sample & BTAV_A2DP_CODEC_BITS_PER_SAMPLE_16),
+  AppendField(&field, (lhdc_cie->bits_per_sample & BTAV_A2DP_CODEC_BITS_PER_SAMPLE_16),
               "16");
-  AppendField(&field, (lhdc_cie.bits_per_sample & BTAV_A2DP_CODEC_BITS_PER_SAMPLE_24),
+  AppendField(&field, (lhdc_cie->bits_per_sample & BTAV_A2DP_CODEC_BITS_PER_SAMPLE_24),
               "24");
-  res << "\tbits_depth: " << field << " bits (" << loghex((int)lhdc_cie.bits_per_sample)
+  res << "\tbits_depth: " << field << " bits (" << loghex((int)lhdc_cie->bits_per_sample)
       << ")\n";
 
   // Max data rate...
   field.clear();
-  AppendField(&field, ((lhdc_cie.maxTargetBitrate & A2DP_LHDC_MAX_BIT_RATE_MASK) == A2DP_LHDC_MAX_BIT_RATE_900K),
+  AppendField(&field, ((lhdc_cie->maxTargetBitrate & A2DP_LHDC_MAX_BIT_RATE_MASK) == A2DP_LHDC_MAX_BIT_RATE_900K),
               "900Kbps");
-  AppendField(&field, ((lhdc_cie.maxTargetBitrate & A2DP_LHDC_MAX_BIT_RATE_MASK) == A2DP_LHDC_MAX_BIT_RATE_500K),
+  AppendField(&field, ((lhdc_cie->maxTargetBitrate & A2DP_LHDC_MAX_BIT_RATE_MASK) == A2DP_LHDC_MAX_BIT_RATE_500K),
               "500Kbps");
-  AppendField(&field, ((lhdc_cie.maxTargetBitrate & A2DP_LHDC_MAX_BIT_RATE_MASK) == A2DP_LHDC_MAX_BIT_RATE_400K),
+  AppendField(&field, ((lhdc_cie->maxTargetBitrate & A2DP_LHDC_MAX_BIT_RATE_MASK) == A2DP_LHDC_MAX_BIT_RATE_400K),
               "400Kbps");
-  res << "\tMax target-rate: " << field << " (" << loghex((lhdc_cie.maxTargetBitrate & A2DP_LHDC_MAX_BIT_RATE_MASK))
+  res << "\tMax target-rate: " << field << " (" << loghex((lhdc_cie->maxTargetBitrate & A2DP_LHDC_MAX_BIT_RATE_MASK))
       << ")\n";
 
   // Version
   field.clear();
-  AppendField(&field, (lhdc_cie.version == A2DP_LHDC_VER3),
+  AppendField(&field, (lhdc_cie->version == A2DP_LHDC_VER3),
               "LHDC V3");
-  res << "\tversion: " << field << " (" << loghex(lhdc_cie.version)
+  res << "\tversion: " << field << " (" << loghex(lhdc_cie->version)
       << ")\n";
 
 
@@ -628,9 +1068,10 @@ std::string A2DP_VendorCodecInfoStringLhdcV3Sink(const uint8_t* p_codec_info) {
               "Dual");
   AppendField(&field, 1,
               "Stereo");
-  res << "\tch_mode: " << field << " (" << loghex(lhdc_cie.channelMode)
+  res << "\tch_mode: " << field << " (" << loghex(lhdc_cie->channelMode)
       << ")\n";
 */
+  a2dp_lhdcv3_sink_append_stats(&res, p_codec_info);
   return res.str();
 }
 
@@ -638,14 +1079,14 @@ const tA2DP_DECODER_INTERFACE* A2DP_VendorGetDecoderInterfaceLhdcV3(
     const uint8_t* p_codec_info) {
   if (!A2DP_IsVendorSinkCodecValidLhdcV3(p_codec_info)) return NULL;
 
-  return &a2dp_decoder_interface_lhdcv3;
+  return a2dp_lhdcv3_sink_decoder_interface();
 }
 
 bool A2DP_VendorAdjustCodecLhdcV3Sink(uint8_t* p_codec_info) {
-  tA2DP_LHDCV3_SINK_CIE cfg_cie;
+  std::shared_ptr<const tA2DP_LHDCV3_SINK_CIE> cfg_cie;
 
   // Nothing to do: just verify the codec info is valid
-  if (A2DP_ParseInfoLhdcV3Sink(&cfg_cie, p_codec_info, true) != A2DP_SUCCESS)
+  if (A2DP_LookupInfoLhdcV3Sink(p_codec_info, true, &cfg_cie) != A2DP_SUCCESS)
     return false;
 
   return true;
@@ -660,16 +1101,16 @@ const char* A2DP_VendorCodecIndexStrLhdcV3Sink(void) { return "LHDC V3 SINK"; }
 
 bool A2DP_VendorInitCodecConfigLhdcV3Sink(AvdtpSepConfig* p_cfg) {
   LOG_DEBUG("%s: enter", __func__);
-  if (A2DP_BuildInfoLhdcV3Sink(AVDT_MEDIA_TYPE_AUDIO, &a2dp_lhdcv3_sink_caps,
-                        p_cfg->codec_info) != A2DP_SUCCESS) {
-    return false;
-  }
+  const tA2DP_LHDCV3_SINK_INFO_BLOB& caps_info =
+      A2DP_IsEarbudLhdcV3Sink() ? a2dp_lhdcv3_sink_earbud_caps_info
+                                : a2dp_lhdcv3_sink_caps_info;
+  memcpy(p_cfg->codec_info, caps_info.data(), caps_info.size());
 
   return true;
 }
 
-UNUSED_ATTR static void build_codec_config(const tA2DP_LHDCV3_SINK_CIE& config_cie,
-                                           btav_a2dp_codec_config_t* result) {
+static void build_codec_config(const tA2DP_LHDCV3_SINK_CIE& config_cie,
+                              btav_a2dp_codec_config_t* result) {
   if (config_cie.sampleRate & A2DP_LHDC_SAMPLING_FREQ_44100)
     result->sample_rate |= BTAV_A2DP_CODEC_SAMPLE_RATE_44100;
   if (config_cie.sampleRate & A2DP_LHDC_SAMPLING_FREQ_48000)
@@ -681,67 +1122,3599 @@ UNUSED_ATTR static void build_codec_config(const tA2DP_LHDCV3_SINK_CIE& config_c
 
   result->bits_per_sample = config_cie.bits_per_sample;
 
-  result->channel_mode |= BTAV_A2DP_CODEC_CHANNEL_MODE_STEREO;
+  if (config_cie.channelSplitMode & A2DP_LHDC_CH_SPLIT_TWS) {
+    result->channel_mode |= BTAV_A2DP_CODEC_CHANNEL_MODE_MONO;
+  } else {
+    result->channel_mode |= BTAV_A2DP_CODEC_CHANNEL_MODE_STEREO;
+  }
 }
 
+/******************************************************************************
+ *
+ *  PCM conversion kernels
+ *
+ *  Decoded PCM is interleaved stereo, 16-bit or packed 24-bit little endian.
+ *  Processing stages work on left-justified int32 (Q31) or float samples.
+ *  Each kernel has a scalar version and NEON or SSE4.1/AVX2 versions; the set
+ *  matching the negotiated bits per sample and the CPU is picked once when
+ *  the decoder is configured.
+ *
+ *  requantize16 is the last stage for output devices that take 16-bit PCM
+ *  only, or when a software volume is set: gain, TPDF dither and rounding to
+ *  16 bits in a single pass over the decoded PCM. The dither is the
+ *  difference of two uniform draws from a per-lane LCG, one output LSB wide.
+ *
+ ******************************************************************************/
 
+typedef struct {
+  const char* name;
+  // Container format to/from Q31, |n| samples
+  void (*unpack)(const uint8_t* in, int32_t* out, size_t n);
+  void (*pack)(const int32_t* in, uint8_t* out, size_t n);
+  // Q31 to/from float in [-1, 1), |n| samples
+  void (*to_float)(const int32_t* in, float* out, size_t n);
+  void (*from_float)(const float* in, int32_t* out, size_t n);
+  // Stereo interleaving of |frames| float frames
+  void (*deinterleave)(const float* in, float* left, float* right, size_t frames);
+  void (*interleave)(const float* left, const float* right, float* out, size_t frames);
+  // Container format to 16-bit, |n| samples, times |gain| and dithered.
+  // |p_dither| holds A2DP_LHDCV3_SINK_DITHER_LANES generator states.
+  void (*requantize16)(const uint8_t* in, uint8_t* out, size_t n, float gain,
+                       uint32_t* p_dither);
+} tA2DP_LHDCV3_SINK_PCM_KERNELS;
+
+#define A2DP_LHDCV3_SINK_DITHER_LANES 8
+#define A2DP_LHDCV3_SINK_LCG_MUL 1664525u
+#define A2DP_LHDCV3_SINK_LCG_ADD 1013904223u
+
+// Largest float below 2^31, so that scaling never overflows int32
+#define A2DP_LHDCV3_SINK_Q31_MAX_F 2147483520.0f
+
+static void a2dp_lhdcv3_sink_unpack16_c(const uint8_t* in, int32_t* out, size_t n) {
+  for (size_t i = 0; i < n; i++, in += 2) {
+    out[i] = (int32_t)((uint32_t)in[0] << 16 | (uint32_t)in[1] << 24);
+  }
+}
 
+static void a2dp_lhdcv3_sink_unpack24_c(const uint8_t* in, int32_t* out, size_t n) {
+  for (size_t i = 0; i < n; i++, in += 3) {
+    out[i] = (int32_t)((uint32_t)in[0] << 8 | (uint32_t)in[1] << 16 |
+                       (uint32_t)in[2] << 24);
+  }
+}
 
+static void a2dp_lhdcv3_sink_pack16_c(const int32_t* in, uint8_t* out, size_t n) {
+  for (size_t i = 0; i < n; i++, out += 2) {
+    // Round to nearest, saturating at full scale
+    int64_t v = ((int64_t)in[i] + 0x8000) >> 16;
+    if (v > INT16_MAX) v = INT16_MAX;
+    out[0] = (uint8_t)v;
+    out[1] = (uint8_t)(v >> 8);
+  }
+}
 
-A2dpCodecConfigLhdcV3Sink::A2dpCodecConfigLhdcV3Sink(
-    btav_a2dp_codec_priority_t codec_priority)
-    : A2dpCodecConfigLhdcV3Base(BTAV_A2DP_CODEC_INDEX_SINK_LHDCV3,
-                             A2DP_VendorCodecIndexStrLhdcV3Sink(), codec_priority,
-                             false) {}
+static void a2dp_lhdcv3_sink_pack24_c(const int32_t* in, uint8_t* out, size_t n) {
+  for (size_t i = 0; i < n; i++, out += 3) {
+    int64_t v = ((int64_t)in[i] + 0x80) >> 8;
+    if (v > 0x7FFFFF) v = 0x7FFFFF;
+    out[0] = (uint8_t)v;
+    out[1] = (uint8_t)(v >> 8);
+    out[2] = (uint8_t)(v >> 16);
+  }
+}
 
-A2dpCodecConfigLhdcV3Sink::~A2dpCodecConfigLhdcV3Sink() {}
+static void a2dp_lhdcv3_sink_to_float_c(const int32_t* in, float* out, size_t n) {
+  for (size_t i = 0; i < n; i++) out[i] = in[i] * (1.0f / 2147483648.0f);
+}
 
-bool A2dpCodecConfigLhdcV3Sink::init() {
-  if (!isValid()) return false;
+static void a2dp_lhdcv3_sink_from_float_c(const float* in, int32_t* out, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    float v = in[i] * 2147483648.0f;
+    if (v > A2DP_LHDCV3_SINK_Q31_MAX_F) v = A2DP_LHDCV3_SINK_Q31_MAX_F;
+    if (v < -2147483648.0f) v = -2147483648.0f;
+    out[i] = (int32_t)lrintf(v);
+  }
+}
 
-  // Load the decoder
-  if (!A2DP_VendorLoadDecoderLhdcV3()) {
-    LOG_ERROR("%s: cannot load the decoder", __func__);
-    return false;
+static void a2dp_lhdcv3_sink_deinterleave_c(const float* in, float* left,
+                                            float* right, size_t frames) {
+  for (size_t i = 0; i < frames; i++) {
+    left[i] = in[2 * i];
+    right[i] = in[2 * i + 1];
   }
+}
 
-  return true;
+static void a2dp_lhdcv3_sink_interleave_c(const float* left, const float* right,
+                                          float* out, size_t frames) {
+  for (size_t i = 0; i < frames; i++) {
+    out[2 * i] = left[i];
+    out[2 * i + 1] = right[i];
+  }
 }
 
-bool A2dpCodecConfigLhdcV3Sink::useRtpHeaderMarkerBit() const {
-  // TODO: This method applies only to Source codecs
-  return false;
+// Requantizes Q31 sample |x| to 16 bits at |out|. |scale| is the gain over
+// 2^16. Only lane 0 of |p_dither| is used.
+static inline void a2dp_lhdcv3_sink_requantize_c(int32_t x, float scale,
+                                                 uint32_t* p_dither,
+                                                 uint8_t* out) {
+  uint32_t r1 = *p_dither * A2DP_LHDCV3_SINK_LCG_MUL + A2DP_LHDCV3_SINK_LCG_ADD;
+  uint32_t r2 = r1 * A2DP_LHDCV3_SINK_LCG_MUL + A2DP_LHDCV3_SINK_LCG_ADD;
+  *p_dither = r2;
+  int32_t dither = (int32_t)(r1 >> 16) - (int32_t)(r2 >> 16);
+  long v = lrintf(x * scale + dither * (1.0f / 65536.0f));
+  if (v > INT16_MAX) v = INT16_MAX;
+  if (v < INT16_MIN) v = INT16_MIN;
+  out[0] = (uint8_t)v;
+  out[1] = (uint8_t)(v >> 8);
 }
 
-bool A2dpCodecConfigLhdcV3Sink::updateEncoderUserConfig(
-    UNUSED_ATTR const tA2DP_ENCODER_INIT_PEER_PARAMS* p_peer_params,
-    UNUSED_ATTR bool* p_restart_input, UNUSED_ATTR bool* p_restart_output,
-    UNUSED_ATTR bool* p_config_updated) {
-  // TODO: This method applies only to Source codecs
-  return false;
+static void a2dp_lhdcv3_sink_requantize16_c(const uint8_t* in, uint8_t* out,
+                                            size_t n, float gain,
+                                            uint32_t* p_dither) {
+  const float scale = gain / 65536.0f;
+  for (size_t i = 0; i < n; i++, in += 2, out += 2) {
+    int32_t x = (int32_t)((uint32_t)in[0] << 16 | (uint32_t)in[1] << 24);
+    a2dp_lhdcv3_sink_requantize_c(x, scale, p_dither, out);
+  }
 }
 
-uint64_t A2dpCodecConfigLhdcV3Sink::encoderIntervalMs() const {
-  // TODO: This method applies only to Source codecs
-  return 0;
+static void a2dp_lhdcv3_sink_requantize24_c(const uint8_t* in, uint8_t* out,
+                                            size_t n, float gain,
+                                            uint32_t* p_dither) {
+  const float scale = gain / 65536.0f;
+  for (size_t i = 0; i < n; i++, in += 3, out += 2) {
+    int32_t x = (int32_t)((uint32_t)in[0] << 8 | (uint32_t)in[1] << 16 |
+                          (uint32_t)in[2] << 24);
+    a2dp_lhdcv3_sink_requantize_c(x, scale, p_dither, out);
+  }
 }
 
-int A2dpCodecConfigLhdcV3Sink::getEffectiveMtu() const {
-  // TODO: This method applies only to Source codecs
-  return 0;
+#if !defined(__ARM_NEON)
+static const tA2DP_LHDCV3_SINK_PCM_KERNELS a2dp_lhdcv3_sink_pcm_kernels_c[2] = {
+    {"scalar", a2dp_lhdcv3_sink_unpack16_c, a2dp_lhdcv3_sink_pack16_c,
+     a2dp_lhdcv3_sink_to_float_c, a2dp_lhdcv3_sink_from_float_c,
+     a2dp_lhdcv3_sink_deinterleave_c, a2dp_lhdcv3_sink_interleave_c,
+     a2dp_lhdcv3_sink_requantize16_c},
+    {"scalar", a2dp_lhdcv3_sink_unpack24_c, a2dp_lhdcv3_sink_pack24_c,
+     a2dp_lhdcv3_sink_to_float_c, a2dp_lhdcv3_sink_from_float_c,
+     a2dp_lhdcv3_sink_deinterleave_c, a2dp_lhdcv3_sink_interleave_c,
+     a2dp_lhdcv3_sink_requantize24_c},
+};
+#endif
+
+#if defined(__ARM_NEON)
+
+static void a2dp_lhdcv3_sink_unpack16_neon(const uint8_t* in, int32_t* out, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    int16x8_t v = vld1q_s16((const int16_t*)(in + 2 * i));
+    vst1q_s32(out + i, vshll_n_s16(vget_low_s16(v), 16));
+    vst1q_s32(out + i + 4, vshll_n_s16(vget_high_s16(v), 16));
+  }
+  a2dp_lhdcv3_sink_unpack16_c(in + 2 * i, out + i, n - i);
 }
 
+static void a2dp_lhdcv3_sink_unpack24_neon(const uint8_t* in, int32_t* out, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    // Bytes 0, 1 and 2 of eight samples land in separate vectors
+    uint8x8x3_t v = vld3_u8(in + 3 * i);
+    uint16x8_t lo = vshll_n_u8(v.val[0], 8);
+    uint16x8_t hi = vorrq_u16(vmovl_u8(v.val[1]), vshll_n_u8(v.val[2], 8));
+    uint32x4_t out_lo = vorrq_u32(vmovl_u16(vget_low_u16(lo)),
+                                  vshll_n_u16(vget_low_u16(hi), 16));
+    uint32x4_t out_hi = vorrq_u32(vmovl_u16(vget_high_u16(lo)),
+                                  vshll_n_u16(vget_high_u16(hi), 16));
+    vst1q_s32(out + i, vreinterpretq_s32_u32(out_lo));
+    vst1q_s32(out + i + 4, vreinterpretq_s32_u32(out_hi));
+  }
+  a2dp_lhdcv3_sink_unpack24_c(in + 3 * i, out + i, n - i);
+}
 
-bool A2dpCodecConfigLhdcV3Base::setCodecConfig(const uint8_t* p_peer_codec_info, bool is_capability,
-                      uint8_t* p_result_codec_config) {
-  is_source_ = false;
-  return true;
+static void a2dp_lhdcv3_sink_pack16_neon(const int32_t* in, uint8_t* out, size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    int16x4_t lo = vqrshrn_n_s32(vld1q_s32(in + i), 16);
+    int16x4_t hi = vqrshrn_n_s32(vld1q_s32(in + i + 4), 16);
+    vst1q_s16((int16_t*)(out + 2 * i), vcombine_s16(lo, hi));
+  }
+  a2dp_lhdcv3_sink_pack16_c(in + i, out + 2 * i, n - i);
 }
 
-bool A2dpCodecConfigLhdcV3Base::setPeerCodecCapabilities(
-      const uint8_t* p_peer_codec_capabilities) {
-  is_source_ = false;
-  return true;
+static void a2dp_lhdcv3_sink_pack24_neon(const int32_t* in, uint8_t* out, size_t n) {
+  const int32x4_t max = vdupq_n_s32(0x7FFFFF);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint32x4_t a = vreinterpretq_u32_s32(vminq_s32(vrshrq_n_s32(vld1q_s32(in + i), 8), max));
+    uint32x4_t b = vreinterpretq_u32_s32(vminq_s32(vrshrq_n_s32(vld1q_s32(in + i + 4), 8), max));
+    uint8x8x3_t v;
+    v.val[0] = vmovn_u16(vcombine_u16(vmovn_u32(a), vmovn_u32(b)));
+    v.val[1] = vmovn_u16(vcombine_u16(vmovn_u32(vshrq_n_u32(a, 8)),
+                                      vmovn_u32(vshrq_n_u32(b, 8))));
+    v.val[2] = vmovn_u16(vcombine_u16(vmovn_u32(vshrq_n_u32(a, 16)),
+                                      vmovn_u32(vshrq_n_u32(b, 16))));
+    vst3_u8(out + 3 * i, v);
+  }
+  a2dp_lhdcv3_sink_pack24_c(in + i, out + 3 * i, n - i);
 }
 
+static void a2dp_lhdcv3_sink_to_float_neon(const int32_t* in, float* out, size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    vst1q_f32(out + i, vcvtq_n_f32_s32(vld1q_s32(in + i), 31));
+  }
+  a2dp_lhdcv3_sink_to_float_c(in + i, out + i, n - i);
+}
 
+static void a2dp_lhdcv3_sink_from_float_neon(const float* in, int32_t* out, size_t n) {
+  const float32x4_t scale = vdupq_n_f32(2147483648.0f);
+  const float32x4_t max = vdupq_n_f32(A2DP_LHDCV3_SINK_Q31_MAX_F);
+  const float32x4_t min = vdupq_n_f32(-2147483648.0f);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    float32x4_t v = vminq_f32(vmaxq_f32(vmulq_f32(vld1q_f32(in + i), scale), min), max);
+#if defined(__aarch64__)
+    vst1q_s32(out + i, vcvtnq_s32_f32(v));
+#else
+    // Round half away from zero; ARMv7 has no round-to-nearest conversion
+    float32x4_t half = vbslq_f32(vcltq_f32(v, vdupq_n_f32(0)), vdupq_n_f32(-0.5f),
+                                 vdupq_n_f32(0.5f));
+    vst1q_s32(out + i, vcvtq_s32_f32(vaddq_f32(v, half)));
+#endif
+  }
+  a2dp_lhdcv3_sink_from_float_c(in + i, out + i, n - i);
+}
+
+static void a2dp_lhdcv3_sink_deinterleave_neon(const float* in, float* left,
+                                               float* right, size_t frames) {
+  size_t i = 0;
+  for (; i + 4 <= frames; i += 4) {
+    float32x4x2_t v = vld2q_f32(in + 2 * i);
+    vst1q_f32(left + i, v.val[0]);
+    vst1q_f32(right + i, v.val[1]);
+  }
+  a2dp_lhdcv3_sink_deinterleave_c(in + 2 * i, left + i, right + i, frames - i);
+}
+
+static void a2dp_lhdcv3_sink_interleave_neon(const float* left, const float* right,
+                                             float* out, size_t frames) {
+  size_t i = 0;
+  for (; i + 4 <= frames; i += 4) {
+    float32x4x2_t v = {{vld1q_f32(left + i), vld1q_f32(right + i)}};
+    vst2q_f32(out + 2 * i, v);
+  }
+  a2dp_lhdcv3_sink_interleave_c(left + i, right + i, out + 2 * i, frames - i);
+}
+
+// Requantizes four Q31 samples to 16 bits, advancing the dither lanes
+// |p_state|. |scale| is the gain over 2^16.
+static inline int16x4_t a2dp_lhdcv3_sink_requantize_neon(int32x4_t x,
+                                                         float32x4_t scale,
+                                                         uint32x4_t* p_state) {
+  const uint32x4_t mul = vdupq_n_u32(A2DP_LHDCV3_SINK_LCG_MUL);
+  const uint32x4_t add = vdupq_n_u32(A2DP_LHDCV3_SINK_LCG_ADD);
+  uint32x4_t r1 = vmlaq_u32(add, *p_state, mul);
+  uint32x4_t r2 = vmlaq_u32(add, r1, mul);
+  *p_state = r2;
+  int32x4_t dither = vsubq_s32(vreinterpretq_s32_u32(vshrq_n_u32(r1, 16)),
+                               vreinterpretq_s32_u32(vshrq_n_u32(r2, 16)));
+  float32x4_t v = vmlaq_f32(vmulq_f32(vcvtq_f32_s32(dither), vdupq_n_f32(1.0f / 65536.0f)),
+                            vcvtq_f32_s32(x), scale);
+#if defined(__aarch64__)
+  return vqmovn_s32(vcvtnq_s32_f32(v));
+#else
+  float32x4_t half = vbslq_f32(vcltq_f32(v, vdupq_n_f32(0)), vdupq_n_f32(-0.5f),
+                               vdupq_n_f32(0.5f));
+  return vqmovn_s32(vcvtq_s32_f32(vaddq_f32(v, half)));
+#endif
+}
+
+static void a2dp_lhdcv3_sink_requantize16_neon(const uint8_t* in, uint8_t* out,
+                                               size_t n, float gain,
+                                               uint32_t* p_dither) {
+  const float32x4_t scale = vdupq_n_f32(gain / 65536.0f);
+  uint32x4_t state = vld1q_u32(p_dither);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    int16x8_t v = vld1q_s16((const int16_t*)(in + 2 * i));
+    int16x4_t lo = a2dp_lhdcv3_sink_requantize_neon(
+        vshll_n_s16(vget_low_s16(v), 16), scale, &state);
+    int16x4_t hi = a2dp_lhdcv3_sink_requantize_neon(
+        vshll_n_s16(vget_high_s16(v), 16), scale, &state);
+    vst1q_s16((int16_t*)(out + 2 * i), vcombine_s16(lo, hi));
+  }
+  vst1q_u32(p_dither, state);
+  a2dp_lhdcv3_sink_requantize16_c(in + 2 * i, out + 2 * i, n - i, gain, p_dither);
+}
+
+static void a2dp_lhdcv3_sink_requantize24_neon(const uint8_t* in, uint8_t* out,
+                                               size_t n, float gain,
+                                               uint32_t* p_dither) {
+  const float32x4_t scale = vdupq_n_f32(gain / 65536.0f);
+  uint32x4_t state = vld1q_u32(p_dither);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint8x8x3_t v = vld3_u8(in + 3 * i);
+    uint16x8_t lo = vshll_n_u8(v.val[0], 8);
+    uint16x8_t hi = vorrq_u16(vmovl_u8(v.val[1]), vshll_n_u8(v.val[2], 8));
+    uint32x4_t x_lo = vorrq_u32(vmovl_u16(vget_low_u16(lo)),
+                                vshll_n_u16(vget_low_u16(hi), 16));
+    uint32x4_t x_hi = vorrq_u32(vmovl_u16(vget_high_u16(lo)),
+                                vshll_n_u16(vget_high_u16(hi), 16));
+    int16x4_t out_lo = a2dp_lhdcv3_sink_requantize_neon(
+        vreinterpretq_s32_u32(x_lo), scale, &state);
+    int16x4_t out_hi = a2dp_lhdcv3_sink_requantize_neon(
+        vreinterpretq_s32_u32(x_hi), scale, &state);
+    vst1q_s16((int16_t*)(out + 2 * i), vcombine_s16(out_lo, out_hi));
+  }
+  vst1q_u32(p_dither, state);
+  a2dp_lhdcv3_sink_requantize24_c(in + 3 * i, out + 2 * i, n - i, gain, p_dither);
+}
+
+static const tA2DP_LHDCV3_SINK_PCM_KERNELS a2dp_lhdcv3_sink_pcm_kernels_neon[2] = {
+    {"neon", a2dp_lhdcv3_sink_unpack16_neon, a2dp_lhdcv3_sink_pack16_neon,
+     a2dp_lhdcv3_sink_to_float_neon, a2dp_lhdcv3_sink_from_float_neon,
+     a2dp_lhdcv3_sink_deinterleave_neon, a2dp_lhdcv3_sink_interleave_neon,
+     a2dp_lhdcv3_sink_requantize16_neon},
+    {"neon", a2dp_lhdcv3_sink_unpack24_neon, a2dp_lhdcv3_sink_pack24_neon,
+     a2dp_lhdcv3_sink_to_float_neon, a2dp_lhdcv3_sink_from_float_neon,
+     a2dp_lhdcv3_sink_deinterleave_neon, a2dp_lhdcv3_sink_interleave_neon,
+     a2dp_lhdcv3_sink_requantize24_neon},
+};
+
+#elif defined(__x86_64__) || defined(__i386__)
+
+#define A2DP_LHDCV3_SINK_SSE41 __attribute__((target("sse4.1")))
+#define A2DP_LHDCV3_SINK_AVX2 __attribute__((target("avx2")))
+
+A2DP_LHDCV3_SINK_SSE41 static void a2dp_lhdcv3_sink_unpack16_sse41(
+    const uint8_t* in, int32_t* out, size_t n) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(in + 2 * i));
+    _mm_storeu_si128((__m128i*)(out + i), _mm_unpacklo_epi16(zero, v));
+    _mm_storeu_si128((__m128i*)(out + i + 4), _mm_unpackhi_epi16(zero, v));
+  }
+  a2dp_lhdcv3_sink_unpack16_c(in + 2 * i, out + i, n - i);
+}
+
+A2DP_LHDCV3_SINK_SSE41 static void a2dp_lhdcv3_sink_unpack24_sse41(
+    const uint8_t* in, int32_t* out, size_t n) {
+  // Moves the three bytes of each sample to the top of its 32-bit lane
+  const __m128i shuffle = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5,
+                                        -1, 6, 7, 8, -1, 9, 10, 11);
+  size_t i = 0;
+  // Each step reads 16 bytes for 4 samples; stop early to stay in bounds
+  for (; i + 6 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(in + 3 * i));
+    _mm_storeu_si128((__m128i*)(out + i), _mm_shuffle_epi8(v, shuffle));
+  }
+  a2dp_lhdcv3_sink_unpack24_c(in + 3 * i, out + i, n - i);
+}
+
+A2DP_LHDCV3_SINK_AVX2 static void a2dp_lhdcv3_sink_unpack24_avx2(
+    const uint8_t* in, int32_t* out, size_t n) {
+  const __m256i shuffle = _mm256_setr_epi8(
+      -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+      -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+  size_t i = 0;
+  for (; i + 10 <= n; i += 8) {
+    __m128i lo = _mm_loadu_si128((const __m128i*)(in + 3 * i));
+    __m128i hi = _mm_loadu_si128((const __m128i*)(in + 3 * i + 12));
+    __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+    _mm256_storeu_si256((__m256i*)(out + i), _mm256_shuffle_epi8(v, shuffle));
+  }
+  a2dp_lhdcv3_sink_unpack24_sse41(in + 3 * i, out + i, n - i);
+}
+
+A2DP_LHDCV3_SINK_SSE41 static void a2dp_lhdcv3_sink_pack16_sse41(
+    const int32_t* in, uint8_t* out, size_t n) {
+  const __m128i one = _mm_set1_epi32(1);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(in + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(in + i + 4));
+    // Round to nearest: add back the highest discarded bit
+    a = _mm_add_epi32(_mm_srai_epi32(a, 16), _mm_and_si128(_mm_srli_epi32(a, 15), one));
+    b = _mm_add_epi32(_mm_srai_epi32(b, 16), _mm_and_si128(_mm_srli_epi32(b, 15), one));
+    _mm_storeu_si128((__m128i*)(out + 2 * i), _mm_packs_epi32(a, b));
+  }
+  a2dp_lhdcv3_sink_pack16_c(in + i, out + 2 * i, n - i);
+}
+
+A2DP_LHDCV3_SINK_SSE41 static void a2dp_lhdcv3_sink_pack24_sse41(
+    const int32_t* in, uint8_t* out, size_t n) {
+  const __m128i one = _mm_set1_epi32(1);
+  const __m128i max = _mm_set1_epi32(0x7FFFFF);
+  const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9,
+                                        10, 12, 13, 14, -1, -1, -1, -1);
+  size_t i = 0;
+  // Each step writes 16 bytes for 4 samples; stop early to stay in bounds
+  for (; i + 6 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(in + i));
+    v = _mm_add_epi32(_mm_srai_epi32(v, 8), _mm_and_si128(_mm_srli_epi32(v, 7), one));
+    v = _mm_min_epi32(v, max);
+    _mm_storeu_si128((__m128i*)(out + 3 * i), _mm_shuffle_epi8(v, shuffle));
+  }
+  a2dp_lhdcv3_sink_pack24_c(in + i, out + 3 * i, n - i);
+}
+
+A2DP_LHDCV3_SINK_SSE41 static void a2dp_lhdcv3_sink_to_float_sse41(
+    const int32_t* in, float* out, size_t n) {
+  const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128 v = _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(in + i)));
+    _mm_storeu_ps(out + i, _mm_mul_ps(v, scale));
+  }
+  a2dp_lhdcv3_sink_to_float_c(in + i, out + i, n - i);
+}
+
+A2DP_LHDCV3_SINK_AVX2 static void a2dp_lhdcv3_sink_to_float_avx2(
+    const int32_t* in, float* out, size_t n) {
+  const __m256 scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 v = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i*)(in + i)));
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(v, scale));
+  }
+  a2dp_lhdcv3_sink_to_float_c(in + i, out + i, n - i);
+}
+
+A2DP_LHDCV3_SINK_SSE41 static void a2dp_lhdcv3_sink_from_float_sse41(
+    const float* in, int32_t* out, size_t n) {
+  const __m128 scale = _mm_set1_ps(2147483648.0f);
+  const __m128 max = _mm_set1_ps(A2DP_LHDCV3_SINK_Q31_MAX_F);
+  const __m128 min = _mm_set1_ps(-2147483648.0f);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128 v = _mm_mul_ps(_mm_loadu_ps(in + i), scale);
+    v = _mm_min_ps(_mm_max_ps(v, min), max);
+    _mm_storeu_si128((__m128i*)(out + i), _mm_cvtps_epi32(v));
+  }
+  a2dp_lhdcv3_sink_from_float_c(in + i, out + i, n - i);
+}
+
+A2DP_LHDCV3_SINK_AVX2 static void a2dp_lhdcv3_sink_from_float_avx2(
+    const float* in, int32_t* out, size_t n) {
+  const __m256 scale = _mm256_set1_ps(2147483648.0f);
+  const __m256 max = _mm256_set1_ps(A2DP_LHDCV3_SINK_Q31_MAX_F);
+  const __m256 min = _mm256_set1_ps(-2147483648.0f);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 v = _mm256_mul_ps(_mm256_loadu_ps(in + i), scale);
+    v = _mm256_min_ps(_mm256_max_ps(v, min), max);
+    _mm256_storeu_si256((__m256i*)(out + i), _mm256_cvtps_epi32(v));
+  }
+  a2dp_lhdcv3_sink_from_float_c(in + i, out + i, n - i);
+}
+
+A2DP_LHDCV3_SINK_SSE41 static void a2dp_lhdcv3_sink_deinterleave_sse41(
+    const float* in, float* left, float* right, size_t frames) {
+  size_t i = 0;
+  for (; i + 4 <= frames; i += 4) {
+    __m128 a = _mm_loadu_ps(in + 2 * i);
+    __m128 b = _mm_loadu_ps(in + 2 * i + 4);
+    _mm_storeu_ps(left + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+    _mm_storeu_ps(right + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+  }
+  a2dp_lhdcv3_sink_deinterleave_c(in + 2 * i, left + i, right + i, frames - i);
+}
+
+A2DP_LHDCV3_SINK_SSE41 static void a2dp_lhdcv3_sink_interleave_sse41(
+    const float* left, const float* right, float* out, size_t frames) {
+  size_t i = 0;
+  for (; i + 4 <= frames; i += 4) {
+    __m128 l = _mm_loadu_ps(left + i);
+    __m128 r = _mm_loadu_ps(right + i);
+    _mm_storeu_ps(out + 2 * i, _mm_unpacklo_ps(l, r));
+    _mm_storeu_ps(out + 2 * i + 4, _mm_unpackhi_ps(l, r));
+  }
+  a2dp_lhdcv3_sink_interleave_c(left + i, right + i, out + 2 * i, frames - i);
+}
+
+// Requantizes four Q31 samples to rounded int32 in the 16-bit scale,
+// advancing the dither lanes |p_state|. |scale| is the gain over 2^16.
+A2DP_LHDCV3_SINK_SSE41 static inline __m128i a2dp_lhdcv3_sink_requantize_sse41(
+    __m128i x, __m128 scale, __m128i* p_state) {
+  const __m128i mul = _mm_set1_epi32((int)A2DP_LHDCV3_SINK_LCG_MUL);
+  const __m128i add = _mm_set1_epi32((int)A2DP_LHDCV3_SINK_LCG_ADD);
+  __m128i r1 = _mm_add_epi32(_mm_mullo_epi32(*p_state, mul), add);
+  __m128i r2 = _mm_add_epi32(_mm_mullo_epi32(r1, mul), add);
+  *p_state = r2;
+  __m128i dither = _mm_sub_epi32(_mm_srli_epi32(r1, 16), _mm_srli_epi32(r2, 16));
+  __m128 v = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(x), scale),
+                        _mm_mul_ps(_mm_cvtepi32_ps(dither), _mm_set1_ps(1.0f / 65536.0f)));
+  return _mm_cvtps_epi32(v);
+}
+
+A2DP_LHDCV3_SINK_SSE41 static void a2dp_lhdcv3_sink_requantize16_sse41(
+    const uint8_t* in, uint8_t* out, size_t n, float gain, uint32_t* p_dither) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128 scale = _mm_set1_ps(gain / 65536.0f);
+  __m128i state = _mm_loadu_si128((const __m128i*)p_dither);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(in + 2 * i));
+    __m128i lo = a2dp_lhdcv3_sink_requantize_sse41(_mm_unpacklo_epi16(zero, v), scale, &state);
+    __m128i hi = a2dp_lhdcv3_sink_requantize_sse41(_mm_unpackhi_epi16(zero, v), scale, &state);
+    _mm_storeu_si128((__m128i*)(out + 2 * i), _mm_packs_epi32(lo, hi));
+  }
+  _mm_storeu_si128((__m128i*)p_dither, state);
+  a2dp_lhdcv3_sink_requantize16_c(in + 2 * i, out + 2 * i, n - i, gain, p_dither);
+}
+
+A2DP_LHDCV3_SINK_SSE41 static void a2dp_lhdcv3_sink_requantize24_sse41(
+    const uint8_t* in, uint8_t* out, size_t n, float gain, uint32_t* p_dither) {
+  const __m128i shuffle = _mm_setr_epi8(-1, 0, 1, 2, -1, 3, 4, 5,
+                                        -1, 6, 7, 8, -1, 9, 10, 11);
+  const __m128 scale = _mm_set1_ps(gain / 65536.0f);
+  __m128i state = _mm_loadu_si128((const __m128i*)p_dither);
+  size_t i = 0;
+  // Each step reads 28 bytes for 8 samples; stop early to stay in bounds
+  for (; i + 10 <= n; i += 8) {
+    __m128i lo = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + 3 * i)), shuffle);
+    __m128i hi = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(in + 3 * i + 12)), shuffle);
+    lo = a2dp_lhdcv3_sink_requantize_sse41(lo, scale, &state);
+    hi = a2dp_lhdcv3_sink_requantize_sse41(hi, scale, &state);
+    _mm_storeu_si128((__m128i*)(out + 2 * i), _mm_packs_epi32(lo, hi));
+  }
+  _mm_storeu_si128((__m128i*)p_dither, state);
+  a2dp_lhdcv3_sink_requantize24_c(in + 3 * i, out + 2 * i, n - i, gain, p_dither);
+}
+
+// Eight-lane version of a2dp_lhdcv3_sink_requantize_sse41()
+A2DP_LHDCV3_SINK_AVX2 static inline __m256i a2dp_lhdcv3_sink_requantize_avx2(
+    __m256i x, __m256 scale, __m256i* p_state) {
+  const __m256i mul = _mm256_set1_epi32((int)A2DP_LHDCV3_SINK_LCG_MUL);
+  const __m256i add = _mm256_set1_epi32((int)A2DP_LHDCV3_SINK_LCG_ADD);
+  __m256i r1 = _mm256_add_epi32(_mm256_mullo_epi32(*p_state, mul), add);
+  __m256i r2 = _mm256_add_epi32(_mm256_mullo_epi32(r1, mul), add);
+  *p_state = r2;
+  __m256i dither = _mm256_sub_epi32(_mm256_srli_epi32(r1, 16), _mm256_srli_epi32(r2, 16));
+  __m256 v = _mm256_add_ps(
+      _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale),
+      _mm256_mul_ps(_mm256_cvtepi32_ps(dither), _mm256_set1_ps(1.0f / 65536.0f)));
+  return _mm256_cvtps_epi32(v);
+}
+
+// Packs eight rounded samples to int16 with saturation, in order
+A2DP_LHDCV3_SINK_AVX2 static inline __m128i a2dp_lhdcv3_sink_packs_avx2(__m256i v) {
+  return _mm_packs_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+}
+
+A2DP_LHDCV3_SINK_AVX2 static void a2dp_lhdcv3_sink_requantize16_avx2(
+    const uint8_t* in, uint8_t* out, size_t n, float gain, uint32_t* p_dither) {
+  const __m256 scale = _mm256_set1_ps(gain / 65536.0f);
+  __m256i state = _mm256_loadu_si256((const __m256i*)p_dither);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i x = _mm256_slli_epi32(
+        _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(in + 2 * i))), 16);
+    __m256i v = a2dp_lhdcv3_sink_requantize_avx2(x, scale, &state);
+    _mm_storeu_si128((__m128i*)(out + 2 * i), a2dp_lhdcv3_sink_packs_avx2(v));
+  }
+  _mm256_storeu_si256((__m256i*)p_dither, state);
+  a2dp_lhdcv3_sink_requantize16_c(in + 2 * i, out + 2 * i, n - i, gain, p_dither);
+}
+
+A2DP_LHDCV3_SINK_AVX2 static void a2dp_lhdcv3_sink_requantize24_avx2(
+    const uint8_t* in, uint8_t* out, size_t n, float gain, uint32_t* p_dither) {
+  const __m256i shuffle = _mm256_setr_epi8(
+      -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+      -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+  const __m256 scale = _mm256_set1_ps(gain / 65536.0f);
+  __m256i state = _mm256_loadu_si256((const __m256i*)p_dither);
+  size_t i = 0;
+  for (; i + 10 <= n; i += 8) {
+    __m128i lo = _mm_loadu_si128((const __m128i*)(in + 3 * i));
+    __m128i hi = _mm_loadu_si128((const __m128i*)(in + 3 * i + 12));
+    __m256i x = _mm256_shuffle_epi8(
+        _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), shuffle);
+    __m256i v = a2dp_lhdcv3_sink_requantize_avx2(x, scale, &state);
+    _mm_storeu_si128((__m128i*)(out + 2 * i), a2dp_lhdcv3_sink_packs_avx2(v));
+  }
+  _mm256_storeu_si256((__m256i*)p_dither, state);
+  a2dp_lhdcv3_sink_requantize24_c(in + 3 * i, out + 2 * i, n - i, gain, p_dither);
+}
+
+static const tA2DP_LHDCV3_SINK_PCM_KERNELS a2dp_lhdcv3_sink_pcm_kernels_sse41[2] = {
+    {"sse4.1", a2dp_lhdcv3_sink_unpack16_sse41, a2dp_lhdcv3_sink_pack16_sse41,
+     a2dp_lhdcv3_sink_to_float_sse41, a2dp_lhdcv3_sink_from_float_sse41,
+     a2dp_lhdcv3_sink_deinterleave_sse41, a2dp_lhdcv3_sink_interleave_sse41,
+     a2dp_lhdcv3_sink_requantize16_sse41},
+    {"sse4.1", a2dp_lhdcv3_sink_unpack24_sse41, a2dp_lhdcv3_sink_pack24_sse41,
+     a2dp_lhdcv3_sink_to_float_sse41, a2dp_lhdcv3_sink_from_float_sse41,
+     a2dp_lhdcv3_sink_deinterleave_sse41, a2dp_lhdcv3_sink_interleave_sse41,
+     a2dp_lhdcv3_sink_requantize24_sse41},
+};
+
+static const tA2DP_LHDCV3_SINK_PCM_KERNELS a2dp_lhdcv3_sink_pcm_kernels_avx2[2] = {
+    {"avx2", a2dp_lhdcv3_sink_unpack16_sse41, a2dp_lhdcv3_sink_pack16_sse41,
+     a2dp_lhdcv3_sink_to_float_avx2, a2dp_lhdcv3_sink_from_float_avx2,
+     a2dp_lhdcv3_sink_deinterleave_sse41, a2dp_lhdcv3_sink_interleave_sse41,
+     a2dp_lhdcv3_sink_requantize16_avx2},
+    {"avx2", a2dp_lhdcv3_sink_unpack24_avx2, a2dp_lhdcv3_sink_pack24_sse41,
+     a2dp_lhdcv3_sink_to_float_avx2, a2dp_lhdcv3_sink_from_float_avx2,
+     a2dp_lhdcv3_sink_deinterleave_sse41, a2dp_lhdcv3_sink_interleave_sse41,
+     a2dp_lhdcv3_sink_requantize24_avx2},
+};
+
+#endif
+
+// Returns the fastest kernels for |bits_per_sample| (16 or 24) on this CPU.
+static const tA2DP_LHDCV3_SINK_PCM_KERNELS* a2dp_lhdcv3_sink_select_pcm_kernels(
+    int bits_per_sample) {
+  int index = (bits_per_sample == 24) ? 1 : 0;
+#if defined(__ARM_NEON)
+  return &a2dp_lhdcv3_sink_pcm_kernels_neon[index];
+#elif defined(__x86_64__) || defined(__i386__)
+  if (__builtin_cpu_supports("avx2")) return &a2dp_lhdcv3_sink_pcm_kernels_avx2[index];
+  if (__builtin_cpu_supports("sse4.1")) return &a2dp_lhdcv3_sink_pcm_kernels_sse41[index];
+  return &a2dp_lhdcv3_sink_pcm_kernels_c[index];
+#else
+  return &a2dp_lhdcv3_sink_pcm_kernels_c[index];
+#endif
+}
+
+/******************************************************************************
+ *
+ *  LHDC V3 sink decode pipeline
+ *
+ *  Media packets handed to decode_packet() are copied into a single-producer/
+ *  single-consumer lock-free ring and decoded on a dedicated thread, so the
+ *  receive path only pays for an enqueue. Control calls (start, suspend and
+ *  configure) travel through the same ring to keep them ordered with the
+ *  packets around them.
+ *
+ *  The decoded PCM goes the other way through a second ring, and is handed
+ *  to the decoded data callback on the next call into the decoder interface
+ *  (normally the next media timer tick of the stack), never on the decode
+ *  thread. That adds up to one tick to the output latency, but the callback
+ *  always runs in order with the stack's own audio track handling. If the
+ *  stack falls behind, the decode thread waits for it rather than drop PCM,
+ *  and packets back up in the media ring. Control
+ *  commands have entries of the media ring to themselves, so they are only
+ *  refused if the decode thread is stuck.
+ *
+ *  The decoder library holds one process-wide state, so there is a single
+ *  stream context and decode thread, and only that thread calls the library
+ *  while it runs.
+ *
+ *  The ring is not a jitter buffer that keeps a depth; it does an adaptive
+ *  prefill. After start and after an underrun, the first packet is held
+ *  until it has aged by a target delay sized from the measured inter-arrival
+ *  jitter, and a low latency (LL) configuration uses a much tighter target.
+ *  Whatever arrived meanwhile is then decoded in one go and handed to the
+ *  audio track, which keeps that backlog as its own buffer. Later packets
+ *  are released as soon as they are queued. The target therefore sets how
+ *  much audio the track starts with, not a depth the sink maintains. Arrival
+ *  times are those of the enqueue, and the btif media timer hands packets
+ *  over in ticks of 20 ms, so the measured jitter includes that batching and
+ *  an LL target below one tick is not held in practice. The depth actually
+ *  held in the sink, packets in the ring plus PCM not yet handed on, is
+ *  sampled as each packet is released.
+ *
+ *  Arrival times against media time feed a clock drift estimator, and the
+ *  decoded PCM can be passed through an asynchronous sample-rate converter
+ *  that follows it, so source/sink crystal mismatch does not slowly drain or
+ *  overfill the output. Media time comes from the RTP timestamps when the
+ *  header is still in front of the payload. The AOSP receive path strips it,
+ *  so there media time is the audio the packets decoded to, with lost
+ *  packets counted at the frames per packet. The converter adds group delay
+ *  and CPU time, so persist.bluetooth.lhdcv3_sink.asrc turns it on.
+ *
+ *  The same packets are counted for losses, late arrivals and underruns, so
+ *  the quality of the link can be read back from the stream.
+ *
+ *  Packets lost on the way show up as gaps in the AVDTP sequence numbers,
+ *  which the receive path leaves in |layer_specific|. Each lost packet stands
+ *  for as many frames as the RTP timestamps advance per packet when the RTP
+ *  header is still there, or else as the packets before it decoded to. A
+ *  packet loss concealment (PLC) stage fills each gap, up to a limit, by repeating
+ *  the most recent decoded audio while fading it out, and fades the next
+ *  decoded audio back in. The gap is not counted as an underrun, so it does
+ *  not start another prefill.
+ *
+ *  For offline analysis, a stream can be captured to a memory-mapped trace
+ *  file: the codec configuration plus every inbound packet with its arrival
+ *  time. A2DP_VendorReplayTraceLhdcV3Sink() feeds such a trace back through
+ *  the pipeline and reports throughput and decode latency.
+ *
+ *  A receive path that gathers several packets can hand them over together
+ *  with A2DP_VendorDecodePacketsLhdcV3Sink(), which wakes the decode thread
+ *  once per batch rather than once per packet. Independently, the decoded
+ *  PCM can be handed on in whole periods of the audio HAL buffer instead of
+ *  per packet; see A2DP_VendorSetOutputPeriodLhdcV3Sink().
+ *
+ *  The presentation delay reported to the source is measured rather than
+ *  fixed: after each decoded packet, the audio queued in the sink, packets
+ *  in the ring plus PCM decoded but not yet handed back, is sampled and
+ *  smoothed. The resampler group delay and the output latency of the audio
+ *  HAL, which covers the PCM already handed on but not yet played, are
+ *  added to it. The estimate can be read with A2DP_VendorGetDelayLhdcV3Sink()
+ *  and is sent through the delay report callback about once a second while
+ *  it moves. Like the decoded data callback, the report is made on the
+ *  stack thread, at its next call into the decoder interface.
+ *
+ *  Each stream keeps counters and log-linear histograms of its decode time,
+ *  arrival jitter and ring depth. Every field has a single writer, so
+ *  updating one is a relaxed load and store. They are appended to the codec
+ *  info string of the stream's configuration and can be read with
+ *  A2DP_VendorGetStreamStatsLhdcV3Sink().
+ *
+ ******************************************************************************/
+
+// Single-producer/single-consumer lock-free ring. |N| must be a power of two.
+template <typename T, size_t N>
+class A2dpLhdcV3SpscRing {
+  static_assert(N != 0 && (N & (N - 1)) == 0, "ring size must be a power of two");
+
+ public:
+  // Called from the producer only. Returns false if the ring is full.
+  bool Push(const T& item) {
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == N) return false;
+    items_[head & (N - 1)] = item;
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Called from the consumer only. Returns false if the ring is empty.
+  bool Pop(T* p_item) {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) return false;
+    *p_item = items_[tail & (N - 1)];
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Called from the consumer only. Returns the oldest entry without removing
+  // it, or NULL if the ring is empty.
+  const T* Peek() const {
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail == head_.load(std::memory_order_acquire)) return NULL;
+    return &items_[tail & (N - 1)];
+  }
+
+  size_t Size() const {
+    return head_.load(std::memory_order_acquire) -
+           tail_.load(std::memory_order_acquire);
+  }
+
+ private:
+  // Producer and consumer indexes live on separate cache lines.
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+  T items_[N];
+};
+
+#define A2DP_LHDCV3_SINK_RING_SIZE 128
+// Ring entries only control commands may take, so that start, suspend and
+// configure are not refused when packets fill the ring
+#define A2DP_LHDCV3_SINK_CMD_HEADROOM 8
+#define A2DP_LHDCV3_SINK_PACKET_ENTRIES \
+  (A2DP_LHDCV3_SINK_RING_SIZE - A2DP_LHDCV3_SINK_CMD_HEADROOM)
+
+typedef enum {
+  A2DP_LHDCV3_SINK_CMD_PACKET,
+  A2DP_LHDCV3_SINK_CMD_START,
+  A2DP_LHDCV3_SINK_CMD_SUSPEND,
+  A2DP_LHDCV3_SINK_CMD_CONFIGURE,
+} tA2DP_LHDCV3_SINK_CMD;
+
+// Immutable snapshot of a stream configuration. configure() publishes a new
+// snapshot by swapping the active pointer and hands the one it replaced to
+// the decode thread, which frees it once it no longer reads it. A freed
+// snapshot's address can come back for a later one, so snapshots are told
+// apart by |generation|, never by address.
+typedef struct {
+  uint32_t generation;  // Unique per configure() call, never 0
+  uint8_t codec_info[AVDT_CODEC_SIZE];
+  tA2DP_STATUS status;        // Result of parsing |codec_info|
+  tA2DP_LHDCV3_SINK_CIE cie;  // Decoded |codec_info|, if |status| is A2DP_SUCCESS
+  int out_bits;  // Container size handed to the audio track, 16 or 24
+} tA2DP_LHDCV3_SINK_CONFIG;
+
+// Descriptor carried by the media ring
+typedef struct {
+  tA2DP_LHDCV3_SINK_CMD cmd;
+  BT_HDR* p_buf;        // Packet copy, owned by the pipeline
+  uint64_t enqueue_us;  // Boot time the entry was queued at
+  const tA2DP_LHDCV3_SINK_CONFIG* p_retired;  // Replaced snapshot, for CMD_CONFIGURE
+  uint32_t batch;  // On the first entry of a batch: entries posted with it
+} tA2DP_LHDCV3_SINK_DESC;
+
+// A media packet never exceeds the L2CAP MTU, so packet slots are sized for
+// it, plus headroom for a header offset in front of the payload.
+#define A2DP_LHDCV3_SINK_PACKET_HEADROOM 64
+// One slot per ring entry packets may take, plus the packet being decoded
+#define A2DP_LHDCV3_SINK_POOL_SLOTS (A2DP_LHDCV3_SINK_PACKET_ENTRIES + 1)
+
+// Packet copies are carved out of a single arena reserved when the decoder is
+// initialized, so the receive path does not allocate while streaming. A
+// packet that still does not fit a slot falls back to the heap; those are
+// counted in the stream statistics.
+typedef struct {
+  uint8_t* arena;    // A2DP_LHDCV3_SINK_POOL_SLOTS slots of |slot_size| bytes
+  size_t slot_size;  // Bytes per slot, BT_HDR included
+  // Indexes of the free slots. Taken by the receive path, given back by the
+  // decode thread.
+  A2dpLhdcV3SpscRing<uint16_t, 2 * A2DP_LHDCV3_SINK_RING_SIZE> free_slots;
+  std::atomic<uint64_t> slot_allocs;  // Packets copied into a slot
+  std::atomic<uint64_t> pcm_allocs;   // Growths of the PCM scratch buffers
+} tA2DP_LHDCV3_SINK_POOL;
+
+// Prefill target delay bounds, in microseconds
+#define A2DP_LHDCV3_SINK_PREFILL_MIN_US 60000
+#define A2DP_LHDCV3_SINK_PREFILL_MAX_US 300000
+#define A2DP_LHDCV3_SINK_PREFILL_LL_MIN_US 10000
+#define A2DP_LHDCV3_SINK_PREFILL_LL_MAX_US 60000
+
+// Adaptive prefill state, decode thread only
+typedef struct {
+  bool low_latency;          // Negotiated configuration has LL set
+  bool buffering;            // Holding the next packet until it reaches the target
+  uint64_t last_arrival_us;  // Arrival time of the previous packet
+  uint64_t last_release_us;  // When the previous packet was released
+  int64_t interval_us;       // Smoothed inter-arrival interval
+  int64_t jitter_us;         // Smoothed deviation from |interval_us|
+  uint32_t target_us;        // Current target delay
+} tA2DP_LHDCV3_SINK_PREFILL;
+
+// Clock drift estimator windows and limits. Without the RTP header, the
+// offsets are only as fine as the media timer ticks, so the windows are longer.
+#define A2DP_LHDCV3_SINK_DRIFT_WINDOW_US 2000000
+#define A2DP_LHDCV3_SINK_DRIFT_TICK_WINDOW_US 10000000
+#define A2DP_LHDCV3_SINK_DRIFT_RESYNC_US 500000
+#define A2DP_LHDCV3_SINK_DRIFT_MAX_PPM 1000.0
+
+// Clock drift estimator state, decode thread only
+typedef struct {
+  uint32_t sample_rate;     // Media timestamp clock, in Hz
+  bool have_anchor;
+  bool rtp;                 // Media timestamps are RTP timestamps
+  uint32_t decoded_frames;  // Media time without RTP: frames decoded so far
+  uint64_t anchor_us;       // Arrival time of the first packet
+  uint32_t last_timestamp;  // Media timestamp of the previous packet
+  int64_t media_samples;    // Media time since the anchor, in samples
+  uint64_t window_start_us;
+  int64_t window_min_us;    // Lowest arrival/media offset in this window
+  int64_t window_sum_us;    // Sum of the offsets in this window
+  uint32_t window_count;    // Packets in this window
+  int64_t last_level_us;    // Offset level of the previous window
+  bool have_last_level;
+  double drift_ppm;         // Source clock rate relative to the sink
+} tA2DP_LHDCV3_SINK_DRIFT;
+
+// Link statistics state, decode thread only
+typedef struct {
+  uint64_t last_arrival_us;
+} tA2DP_LHDCV3_SINK_LINK;
+
+// Packet loss concealment limits, in milliseconds
+#define A2DP_LHDCV3_SINK_PLC_HISTORY_MS 10  // Decoded audio kept for repetition
+#define A2DP_LHDCV3_SINK_PLC_FADE_MS 40     // Concealment fades to silence over this
+#define A2DP_LHDCV3_SINK_PLC_MAX_MS 120     // Longest gap that is concealed
+#define A2DP_LHDCV3_SINK_PLC_RAMP_MS 5      // Fade-in of the audio after a gap
+#define A2DP_LHDCV3_SINK_PLC_CHUNK_FRAMES 256
+// A sequence number gap this large is a discontinuity, not a loss
+#define A2DP_LHDCV3_SINK_PLC_MAX_SEQ_GAP 100
+// Unity gain, Q15
+#define A2DP_LHDCV3_SINK_PLC_UNITY 32768
+
+// Packet loss concealment state, decode thread only
+typedef struct {
+  bool have_seq;
+  uint16_t last_seq;             // AVDTP sequence number of the previous packet
+  bool have_timestamp;
+  uint32_t last_timestamp;       // RTP timestamp of the previous packet
+  bool timestamp_steps;          // |packet_frames| follows the RTP timestamps
+  uint32_t packet_frames;        // Smoothed frames per packet
+  uint32_t decoded_frames;       // Frames decoded from the current packet
+  std::vector<uint8_t> history;  // Latest decoded frames, circular
+  size_t history_size;           // Capacity of |history|, in frames
+  size_t history_frames;         // Valid frames in |history|
+  size_t history_pos;            // Next frame of |history| to write
+  int32_t gain;                  // Gain the last concealment ended at, Q15
+  size_t ramp_frames;            // Frames of decoded audio left to fade in
+  std::vector<int32_t> q31;      // Conversion scratch
+  std::vector<uint8_t> out;      // Concealment output
+} tA2DP_LHDCV3_SINK_PLC;
+
+#define A2DP_LHDCV3_SINK_CHANNELS 2
+#define A2DP_LHDCV3_SINK_ASRC_TAPS 16
+#define A2DP_LHDCV3_SINK_ASRC_PHASES 64
+#define A2DP_LHDCV3_SINK_OUTPUT_CHUNK_MS 20
+
+// Asynchronous sample-rate converter state, decode thread only
+typedef struct {
+  bool enabled;
+  std::vector<float> work[A2DP_LHDCV3_SINK_CHANNELS];  // History + new input
+  size_t work_frames;        // Valid frames in |work|
+  double position;           // Read position in |work|, in frames
+  std::vector<float> planar[A2DP_LHDCV3_SINK_CHANNELS];  // Resampled output
+  std::vector<int32_t> q31;          // Conversion scratch
+  std::vector<float> interleaved;    // Conversion scratch
+  std::vector<uint8_t> out;  // Resampled interleaved PCM
+} tA2DP_LHDCV3_SINK_ASRC;
+
+// Output period aggregation, decode thread only
+typedef struct {
+  uint32_t frames;           // Period |bytes| was derived from
+  size_t bytes;              // Period size, 0 to hand PCM on as decoded
+  size_t fill;               // Bytes waiting in |buf|
+  std::vector<uint8_t> buf;  // Partial period
+} tA2DP_LHDCV3_SINK_PERIOD;
+
+// Room for the decoded PCM awaiting hand-back: about half a second of the
+// largest output format, and as many chunks as the ring holds packets twice.
+#define A2DP_LHDCV3_SINK_HANDBACK_BYTES (256 * 1024)
+#define A2DP_LHDCV3_SINK_HANDBACK_CHUNKS (2 * A2DP_LHDCV3_SINK_RING_SIZE)
+
+// One piece of decoded PCM awaiting hand-back
+typedef struct {
+  uint64_t begin;       // Arena position of the first byte, unwrapped
+  uint32_t len;
+  uint32_t generation;  // Configuration the PCM was decoded under
+} tA2DP_LHDCV3_SINK_PCM_CHUNK;
+
+// The decode thread copies its output PCM into |arena|, and the thread that
+// drives the decoder interface hands it to the decoded data callback on its
+// next call. The callback thus always runs on the stack thread, in order
+// with the stack tearing down or reconfiguring its audio track. When the
+// arena is full the decode thread waits for the stack to take PCM, and the
+// media ring in front of it fills up instead.
+typedef struct {
+  std::vector<uint8_t> arena;  // A2DP_LHDCV3_SINK_HANDBACK_BYTES
+  uint64_t head;               // Next free arena byte, unwrapped, decode thread only
+  std::atomic<uint64_t> tail;  // First arena byte still in use, unwrapped
+  A2dpLhdcV3SpscRing<tA2DP_LHDCV3_SINK_PCM_CHUNK, A2DP_LHDCV3_SINK_HANDBACK_CHUNKS>
+      chunks;
+  std::atomic<bool> waiting;  // The decode thread waits for room
+  semaphore_t* room_sem;      // Posted when room was made for a waiting decode thread
+} tA2DP_LHDCV3_SINK_HANDBACK;
+
+// Conversion to the output format, decode thread only
+typedef struct {
+  int out_bits;  // Output container size, 16 or 24
+  uint32_t dither[A2DP_LHDCV3_SINK_DITHER_LANES];  // TPDF generator lanes
+  std::vector<uint8_t> out;    // 16-bit output
+  std::vector<int32_t> q31;    // Gain scratch at 24-bit output
+} tA2DP_LHDCV3_SINK_REQUANT;
+
+// Interval between delay reports, and the change that warrants one, in
+// microseconds
+#define A2DP_LHDCV3_SINK_DELAY_REPORT_US 1000000
+#define A2DP_LHDCV3_SINK_DELAY_STEP_US 1000
+
+// Presentation delay estimator, decode thread only but for |delay_us|
+typedef struct {
+  bool have_estimate;
+  uint32_t depth_us;        // Smoothed audio queued in the sink
+  uint64_t last_report_us;  // When the last report was sent, or the start
+  uint32_t reported_us;     // Last reported delay, 0 for none since the start
+  std::atomic<uint32_t> delay_us;  // Latest estimate, 0 for none yet
+  std::atomic<int32_t> report;     // Report for the stack thread, 1/10 ms, or -1
+} tA2DP_LHDCV3_SINK_DELAY;
+
+struct tA2DP_LHDCV3_SINK_CB;
+
+typedef void (*tA2DP_LHDCV3_SINK_OUTPUT)(tA2DP_LHDCV3_SINK_CB* p_cb, uint8_t* buf,
+                                         uint32_t len);
+
+// Trace file layout: a header, then records each followed by |len| bytes.
+// All fields are little endian.
+#define A2DP_LHDCV3_SINK_TRACE_MAGIC "LHDCTRC1"
+#ifndef A2DP_LHDCV3_SINK_TRACE_DIR
+#define A2DP_LHDCV3_SINK_TRACE_DIR "/data/misc/bluetooth/logs"
+#endif
+
+typedef struct __attribute__((packed)) {
+  char magic[8];                        // A2DP_LHDCV3_SINK_TRACE_MAGIC
+  uint8_t codec_info[AVDT_CODEC_SIZE];  // Configuration at capture start
+} tA2DP_LHDCV3_SINK_TRACE_HEADER;
+
+typedef enum : uint16_t {
+  A2DP_LHDCV3_SINK_TRACE_PACKET,  // BT_HDR data: |offset| bytes, then the payload
+  A2DP_LHDCV3_SINK_TRACE_CONFIG,  // New codec info, AVDT_CODEC_SIZE bytes
+} tA2DP_LHDCV3_SINK_TRACE_TYPE;
+
+typedef struct __attribute__((packed)) {
+  uint32_t delta_us;  // Arrival time after the previous record
+  uint16_t type;      // tA2DP_LHDCV3_SINK_TRACE_TYPE
+  uint16_t offset;    // BT_HDR offset, for packets
+  uint16_t len;       // Bytes that follow the record
+  uint16_t layer_specific;
+} tA2DP_LHDCV3_SINK_TRACE_RECORD;
+
+static_assert(sizeof(tA2DP_LHDCV3_SINK_TRACE_RECORD) == 12,
+              "trace records must stay compact");
+
+// Trace capture of a stream. The file is sized up front and mapped, so that
+// recording a packet is a copy. Packets and configurations are both recorded
+// on the stack thread, which also opens and closes the capture, so the trace
+// has a single writer and takes no lock. A full trace stays mapped until the
+// capture is closed.
+typedef struct {
+  bool active;       // Capturing, false again once the trace is full
+  int fd;
+  uint8_t* map;
+  size_t size;       // Mapped bytes
+  size_t used;       // Bytes written
+  uint64_t last_us;  // Arrival time of the previous record
+} tA2DP_LHDCV3_SINK_TRACE;
+
+// Collects decode latencies while a trace is replayed
+typedef struct {
+  std::vector<uint32_t> latency_us;  // Enqueue to decoded, per packet
+  std::atomic<size_t> count;         // Filled entries of |latency_us|
+} tA2DP_LHDCV3_SINK_REPLAY;
+
+// Log-linear histogram: a bucket per value below 16, then 8 buckets per power
+// of two, which bounds the error of a percentile to 12.5%.
+#define A2DP_LHDCV3_SINK_HIST_BUCKETS (16 + 28 * 8)
+
+typedef struct {
+  std::atomic<uint32_t> buckets[A2DP_LHDCV3_SINK_HIST_BUCKETS];
+  std::atomic<uint32_t> max;
+} tA2DP_LHDCV3_SINK_HIST;
+
+// Per-stream instrumentation. Each field is written by one thread only and
+// may be read from any.
+typedef struct {
+  std::atomic<uint32_t> config_hash;  // Of the applied codec info, 0 if none
+  // Receive path
+  std::atomic<uint32_t> packets_received;
+  std::atomic<uint32_t> packets_dropped;  // Ring was full
+  std::atomic<uint32_t> heap_fallbacks;   // Packets copied outside the arena
+  // Decode thread
+  std::atomic<uint32_t> packets_decoded;
+  std::atomic<uint32_t> decode_errors;
+  std::atomic<uint32_t> packets_lost;     // Gaps in the AVDTP sequence numbers
+  std::atomic<uint32_t> packets_late;
+  std::atomic<uint32_t> underruns;
+  std::atomic<uint32_t> concealed_frames;
+  std::atomic<uint32_t> handback_waits;  // Decode thread waited for the stack
+  std::atomic<uint32_t> first_pcm_cold_us;  // Latest start to first PCM
+  std::atomic<uint32_t> first_pcm_warm_us;
+  std::atomic<uint32_t> wakeups;        // Times the decode thread was woken
+  std::atomic<uint32_t> pcm_callbacks;  // Calls to the decoded data callback
+  std::atomic<uint32_t> decode_cpu_us;  // Decode thread CPU time, once it exits
+  tA2DP_LHDCV3_SINK_HIST decode_us;  // Decoder library time per packet
+  tA2DP_LHDCV3_SINK_HIST jitter_us;  // Inter-arrival deviation
+  tA2DP_LHDCV3_SINK_HIST depth;      // Queued packets when one is released
+  tA2DP_LHDCV3_SINK_HIST held_us;    // Audio held in the sink at that point
+} tA2DP_LHDCV3_SINK_STATS;
+
+// Decoder context of the sink stream
+typedef struct tA2DP_LHDCV3_SINK_CB {
+  A2dpLhdcV3SpscRing<tA2DP_LHDCV3_SINK_DESC, A2DP_LHDCV3_SINK_RING_SIZE> ring;
+  semaphore_t* ring_sem;  // Posted once per pushed batch of descriptors
+  std::thread decode_thread;
+  std::atomic<bool> exiting;  // Tells the decode thread to stop
+  tA2DP_LHDCV3_SINK_POOL pool;
+  // Latest configuration, published by configure() without locks
+  std::atomic<const tA2DP_LHDCV3_SINK_CONFIG*> active_config;
+  const tA2DP_LHDCV3_SINK_CONFIG* config;  // Applied snapshot, decode thread only
+  uint32_t config_generation;  // Generation of |config|, 0 for none
+  decoded_data_callback_t decode_callback;  // Output of the pipeline
+  tA2DP_LHDCV3_SINK_HANDBACK handback;      // PCM on its way to |decode_callback|
+  // Replaced snapshots the decode thread was not told about, freed once it
+  // has stopped. Stack thread only.
+  std::vector<const tA2DP_LHDCV3_SINK_CONFIG*> retired;
+  int sample_rate;      // Negotiated configuration, in Hz
+  int bits_per_sample;  // Negotiated container size, 16 or 24
+  int channels;         // Output channels, 1 in TWS split mode
+  int tws_channel;      // Channel kept in TWS split mode, 0 left or 1 right
+  const tA2DP_LHDCV3_SINK_PCM_KERNELS* pcm_kernels;
+  tA2DP_LHDCV3_SINK_OUTPUT output;  // Bound post-decode output path
+  tA2DP_LHDCV3_SINK_PREFILL prefill;
+  tA2DP_LHDCV3_SINK_DRIFT drift;
+  tA2DP_LHDCV3_SINK_LINK link;
+  tA2DP_LHDCV3_SINK_PLC plc;
+  tA2DP_LHDCV3_SINK_ASRC asrc;
+  std::atomic<float> gain{1.0f};  // Software volume, linear from 0 to 1
+  tA2DP_LHDCV3_SINK_REQUANT requant;
+  std::atomic<uint32_t> period_frames;  // Requested output period, 0 for none
+  tA2DP_LHDCV3_SINK_PERIOD period;
+  std::atomic<uint32_t> output_latency_us;  // Audio HAL latency past the callback
+  tA2DP_LHDCV3_SINK_DELAY delay;
+  tA2DP_LHDCV3_SINK_TRACE trace;
+  tA2DP_LHDCV3_SINK_REPLAY* replay;  // Set while a trace is replayed
+  // Warm resume, decode thread only
+  bool warm_resume;  // Keep the library state across suspend and start
+  uint32_t warm_generation;  // Applied when suspend kept it warm, 0 for none
+  uint64_t start_us;         // When the last start was queued
+  bool first_pcm_pending;    // No PCM decoded since that start
+  bool warm_start;           // That start kept the library state
+  tA2DP_LHDCV3_SINK_STATS stats;
+} tA2DP_LHDCV3_SINK_CB;
+
+// The decoder library keeps a single process-wide state and configuration,
+// so the sink decodes one stream at a time, in this context. The library is
+// only called from its decode thread, or from the stack thread while that
+// thread is not running.
+static tA2DP_LHDCV3_SINK_CB a2dp_lhdcv3_sink_cb;
+
+// The decoder library is loaded on a background thread as soon as a sink
+// codec is created, ahead of the first init().
+static std::mutex a2dp_lhdcv3_sink_library_load_mutex;
+static std::shared_future<bool> a2dp_lhdcv3_sink_library_loaded;
+
+static std::atomic<tA2DP_LHDCV3_SINK_DELAY_CBACK> a2dp_lhdcv3_sink_delay_cback;
+
+// Adds |n| to |p_counter|. Counters have a single writer, so a relaxed load
+// and store is enough and avoids a locked read-modify-write.
+static inline void a2dp_lhdcv3_sink_count(std::atomic<uint32_t>* p_counter,
+                                          uint32_t n) {
+  p_counter->store(p_counter->load(std::memory_order_relaxed) + n,
+                   std::memory_order_relaxed);
+}
+
+static inline size_t a2dp_lhdcv3_sink_hist_bucket(uint32_t value) {
+  if (value < 16) return value;
+  int msb = 31 - __builtin_clz(value);
+  return 16 + (msb - 4) * 8 + ((value >> (msb - 3)) & 7);
+}
+
+// Returns the lowest value that falls in |bucket|.
+static uint32_t a2dp_lhdcv3_sink_hist_value(size_t bucket) {
+  if (bucket < 16) return (uint32_t)bucket;
+  int msb = (int)(bucket - 16) / 8 + 4;
+  return (uint32_t)(8 + (bucket - 16) % 8) << (msb - 3);
+}
+
+// Records |value| in |p_hist|. Single writer, like the counters.
+static inline void a2dp_lhdcv3_sink_hist_add(tA2DP_LHDCV3_SINK_HIST* p_hist,
+                                             uint32_t value) {
+  size_t bucket = a2dp_lhdcv3_sink_hist_bucket(value);
+  a2dp_lhdcv3_sink_count(&p_hist->buckets[bucket], 1);
+  if (value > p_hist->max.load(std::memory_order_relaxed))
+    p_hist->max.store(value, std::memory_order_relaxed);
+}
+
+// Returns the |permille| percentile of |p_hist|, to bucket resolution.
+static uint32_t a2dp_lhdcv3_sink_hist_percentile(
+    const tA2DP_LHDCV3_SINK_HIST* p_hist, uint32_t permille) {
+  uint32_t counts[A2DP_LHDCV3_SINK_HIST_BUCKETS];
+  uint64_t total = 0;
+  for (size_t i = 0; i < A2DP_LHDCV3_SINK_HIST_BUCKETS; i++) {
+    counts[i] = p_hist->buckets[i].load(std::memory_order_relaxed);
+    total += counts[i];
+  }
+  if (total == 0) return 0;
+
+  uint64_t rank = (total * permille + 999) / 1000;
+  uint64_t seen = 0;
+  for (size_t i = 0; i < A2DP_LHDCV3_SINK_HIST_BUCKETS; i++) {
+    seen += counts[i];
+    if (seen >= rank) return a2dp_lhdcv3_sink_hist_value(i);
+  }
+  return p_hist->max.load(std::memory_order_relaxed);
+}
+
+static void a2dp_lhdcv3_sink_hist_reset(tA2DP_LHDCV3_SINK_HIST* p_hist) {
+  for (auto& bucket : p_hist->buckets) {
+    bucket.store(0, std::memory_order_relaxed);
+  }
+  p_hist->max.store(0, std::memory_order_relaxed);
+}
+
+static void a2dp_lhdcv3_sink_stats_reset(tA2DP_LHDCV3_SINK_CB* p_cb) {
+  tA2DP_LHDCV3_SINK_STATS* p_stats = &p_cb->stats;
+  for (std::atomic<uint32_t>* p_counter :
+       {&p_stats->config_hash, &p_stats->packets_received,
+        &p_stats->packets_dropped, &p_stats->heap_fallbacks,
+        &p_stats->packets_decoded,
+        &p_stats->decode_errors, &p_stats->packets_lost, &p_stats->packets_late,
+        &p_stats->underruns, &p_stats->concealed_frames, &p_stats->handback_waits,
+        &p_stats->first_pcm_cold_us, &p_stats->first_pcm_warm_us,
+        &p_stats->wakeups, &p_stats->pcm_callbacks, &p_stats->decode_cpu_us}) {
+    p_counter->store(0, std::memory_order_relaxed);
+  }
+  a2dp_lhdcv3_sink_hist_reset(&p_stats->decode_us);
+  a2dp_lhdcv3_sink_hist_reset(&p_stats->jitter_us);
+  a2dp_lhdcv3_sink_hist_reset(&p_stats->depth);
+  a2dp_lhdcv3_sink_hist_reset(&p_stats->held_us);
+}
+
+// FNV-1a, for short keys such as codec info blobs
+static uint32_t a2dp_lhdcv3_sink_hash(const uint8_t* p_data, size_t len) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= p_data[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static bool a2dp_lhdcv3_sink_push(tA2DP_LHDCV3_SINK_CB* p_cb,
+                                  const tA2DP_LHDCV3_SINK_DESC& desc) {
+  if (!p_cb->ring.Push(desc)) return false;
+  semaphore_post(p_cb->ring_sem);
+  return true;
+}
+
+// Packets leave A2DP_LHDCV3_SINK_CMD_HEADROOM entries to control commands,
+// so a command only finds the ring full if the decode thread stopped taking
+// entries. Returns false in that case.
+static bool a2dp_lhdcv3_sink_push_cmd(
+    tA2DP_LHDCV3_SINK_CB* p_cb, tA2DP_LHDCV3_SINK_CMD cmd,
+    const tA2DP_LHDCV3_SINK_CONFIG* p_retired) {
+  tA2DP_LHDCV3_SINK_DESC desc = {};
+  desc.cmd = cmd;
+  desc.enqueue_us = time_get_os_boottime_us();
+  desc.p_retired = p_retired;
+  desc.batch = 1;
+  if (a2dp_lhdcv3_sink_push(p_cb, desc)) return true;
+
+  LOG_ERROR("%s: media ring full, command %d refused", __func__, cmd);
+  return false;
+}
+
+// Returns the maximum target bitrate of |max_target_bitrate|, in bits/s.
+static uint32_t a2dp_lhdcv3_sink_max_bitrate_bps(uint8_t max_target_bitrate) {
+  switch (max_target_bitrate & A2DP_LHDC_MAX_BIT_RATE_MASK) {
+    case A2DP_LHDC_MAX_BIT_RATE_400K:
+      return 400000;
+    case A2DP_LHDC_MAX_BIT_RATE_500K:
+      return 500000;
+    case A2DP_LHDC_MAX_BIT_RATE_900K:
+    default:
+      return 900000;
+  }
+}
+
+// Sizes the packet arena for packets up to the L2CAP MTU. An arena that is
+// already large enough is kept; it cannot be replaced while the decode thread
+// may still hold slots.
+static void a2dp_lhdcv3_sink_pool_reserve(tA2DP_LHDCV3_SINK_CB* p_cb) {
+  tA2DP_LHDCV3_SINK_POOL* p_pool = &p_cb->pool;
+
+  // Keep slots cache line aligned
+  size_t slot_size =
+      (BT_HDR_SIZE + A2DP_LHDCV3_SINK_PACKET_HEADROOM + L2CAP_MTU_SIZE + 63) & ~(size_t)63;
+  if (p_pool->arena != NULL && p_pool->slot_size >= slot_size) return;
+  if (p_cb->decode_thread.joinable()) {
+    LOG_WARN("%s: decoder running, keeping %zu byte packet slots", __func__,
+             p_pool->slot_size);
+    return;
+  }
+
+  osi_free(p_pool->arena);
+  p_pool->arena = (uint8_t*)osi_malloc(slot_size * A2DP_LHDCV3_SINK_POOL_SLOTS);
+  p_pool->slot_size = slot_size;
+  // Slot indexes stay valid across arenas, so they are only queued once
+  if (p_pool->free_slots.Size() == 0) {
+    for (uint16_t i = 0; i < A2DP_LHDCV3_SINK_POOL_SLOTS; i++) {
+      p_pool->free_slots.Push(i);
+    }
+  }
+  LOG_INFO("%s: %d packet slots of %zu bytes", __func__,
+           A2DP_LHDCV3_SINK_POOL_SLOTS, slot_size);
+}
+
+// Runs on the receive path. Returns a buffer of at least |size| bytes.
+static BT_HDR* a2dp_lhdcv3_sink_pool_alloc(tA2DP_LHDCV3_SINK_CB* p_cb, size_t size) {
+  tA2DP_LHDCV3_SINK_POOL* p_pool = &p_cb->pool;
+  uint16_t slot;
+
+  if (p_pool->arena != NULL && size <= p_pool->slot_size &&
+      p_pool->free_slots.Pop(&slot)) {
+    p_pool->slot_allocs.fetch_add(1, std::memory_order_relaxed);
+    return (BT_HDR*)(p_pool->arena + slot * p_pool->slot_size);
+  }
+  uint32_t fallbacks = p_cb->stats.heap_fallbacks.load(std::memory_order_relaxed);
+  a2dp_lhdcv3_sink_count(&p_cb->stats.heap_fallbacks, 1);
+  if ((fallbacks % 100) == 0) {
+    LOG_WARN("%s: %zu byte packet does not fit the %zu byte slots, %u heap "
+             "fallbacks",
+             __func__, size, p_pool->slot_size, fallbacks + 1);
+  }
+  return (BT_HDR*)osi_malloc(size);
+}
+
+// Gives |p_buf| back to the arena it came from, or to the heap.
+static void a2dp_lhdcv3_sink_pool_free(tA2DP_LHDCV3_SINK_CB* p_cb, BT_HDR* p_buf) {
+  tA2DP_LHDCV3_SINK_POOL* p_pool = &p_cb->pool;
+  uint8_t* p = (uint8_t*)p_buf;
+
+  if (p_pool->arena != NULL && p >= p_pool->arena &&
+      p < p_pool->arena + p_pool->slot_size * A2DP_LHDCV3_SINK_POOL_SLOTS) {
+    p_pool->free_slots.Push((uint16_t)((p - p_pool->arena) / p_pool->slot_size));
+    return;
+  }
+  osi_free(p_buf);
+}
+
+static void a2dp_lhdcv3_sink_pool_release(tA2DP_LHDCV3_SINK_CB* p_cb) {
+  tA2DP_LHDCV3_SINK_POOL* p_pool = &p_cb->pool;
+
+  LOG_INFO("%s: %" PRIu64 " packets pooled, %" PRIu64
+           " heap fallbacks, %" PRIu64 " PCM buffer allocations",
+           __func__, p_pool->slot_allocs.load(),
+           (uint64_t)p_cb->stats.heap_fallbacks.load(),
+           p_pool->pcm_allocs.load());
+  osi_free(p_pool->arena);
+  p_pool->arena = NULL;
+  p_pool->slot_size = 0;
+}
+
+// Resizes PCM scratch |p_vec| to |size| elements, counting real allocations.
+template <typename T>
+static void a2dp_lhdcv3_sink_pcm_resize(tA2DP_LHDCV3_SINK_CB* p_cb,
+                                        std::vector<T>* p_vec, size_t size) {
+  if (size > p_vec->capacity()) {
+    p_cb->pool.pcm_allocs.fetch_add(1, std::memory_order_relaxed);
+  }
+  p_vec->resize(size);
+}
+
+static void a2dp_lhdcv3_sink_prefill_reset(tA2DP_LHDCV3_SINK_CB* p_cb,
+                                           bool low_latency) {
+  tA2DP_LHDCV3_SINK_PREFILL* p_prefill = &p_cb->prefill;
+
+  *p_prefill = {};
+  p_prefill->low_latency = low_latency;
+  p_prefill->buffering = true;
+  p_prefill->target_us = low_latency ? A2DP_LHDCV3_SINK_PREFILL_LL_MIN_US
+                                     : A2DP_LHDCV3_SINK_PREFILL_MIN_US;
+}
+
+// Updates the inter-arrival statistics with a packet that arrived at
+// |arrival_us| and resizes the target delay. |packets| is the number of
+// packet intervals since the previous arrival, more than one after a loss.
+static void a2dp_lhdcv3_sink_prefill_on_arrival(tA2DP_LHDCV3_SINK_CB* p_cb,
+                                                uint64_t arrival_us,
+                                                uint32_t packets) {
+  tA2DP_LHDCV3_SINK_PREFILL* p_prefill = &p_cb->prefill;
+
+  if (p_prefill->last_arrival_us != 0) {
+    int64_t interval_us =
+        (int64_t)(arrival_us - p_prefill->last_arrival_us) / packets;
+    if (p_prefill->interval_us == 0) p_prefill->interval_us = interval_us;
+    int64_t deviation_us = interval_us - p_prefill->interval_us;
+    if (deviation_us < 0) deviation_us = -deviation_us;
+
+    // Same 1/16 smoothing as the RTP interarrival jitter (RFC 3550)
+    p_prefill->interval_us += (interval_us - p_prefill->interval_us) / 16;
+    p_prefill->jitter_us += (deviation_us - p_prefill->jitter_us) / 16;
+    a2dp_lhdcv3_sink_hist_add(&p_cb->stats.jitter_us,
+                              (uint32_t)std::min<int64_t>(deviation_us, UINT32_MAX));
+  }
+  p_prefill->last_arrival_us = arrival_us;
+
+  int64_t min_us, max_us, target_us;
+  if (p_prefill->low_latency) {
+    min_us = A2DP_LHDCV3_SINK_PREFILL_LL_MIN_US;
+    max_us = A2DP_LHDCV3_SINK_PREFILL_LL_MAX_US;
+    target_us = 2 * p_prefill->jitter_us;
+  } else {
+    min_us = A2DP_LHDCV3_SINK_PREFILL_MIN_US;
+    max_us = A2DP_LHDCV3_SINK_PREFILL_MAX_US;
+    target_us = 4 * p_prefill->jitter_us;
+  }
+  if (target_us < min_us) target_us = min_us;
+  if (target_us > max_us) target_us = max_us;
+  p_prefill->target_us = (uint32_t)target_us;
+}
+
+// Blocks the decode thread until the packet that arrived at |arrival_us| may
+// be released to the decoder. Only the first packet after start or after an
+// underrun is held, until it has aged by the target; later ones pass straight
+// through. |concealed_us| of audio will be synthesized ahead of it. Returns
+// true if the output had underrun.
+static bool a2dp_lhdcv3_sink_prefill_wait(tA2DP_LHDCV3_SINK_CB* p_cb,
+                                          uint64_t arrival_us,
+                                          uint64_t concealed_us) {
+  A2DP_LHDCV3_SINK_SPAN("prefill_wait");
+  tA2DP_LHDCV3_SINK_PREFILL* p_prefill = &p_cb->prefill;
+  uint64_t now_us = time_get_os_boottime_us();
+  bool underrun = false;
+
+  // Nothing was released for a packet interval beyond the target delay, and
+  // concealment does not cover the gap: the output has most likely drained,
+  // so prefill it again.
+  if (!p_prefill->buffering && p_prefill->last_release_us != 0 &&
+      now_us - p_prefill->last_release_us >
+          p_prefill->target_us + (uint64_t)p_prefill->interval_us + concealed_us) {
+    LOG_DEBUG("%s: underrun, prefilling %u us again", __func__,
+              p_prefill->target_us);
+    p_prefill->buffering = true;
+    underrun = true;
+  }
+
+  if (p_prefill->buffering) {
+    uint64_t release_us = arrival_us + p_prefill->target_us;
+    if (now_us < release_us) {
+      std::this_thread::sleep_for(std::chrono::microseconds(release_us - now_us));
+      now_us = time_get_os_boottime_us();
+    }
+    p_prefill->buffering = false;
+  }
+
+  p_prefill->last_release_us = now_us;
+  return underrun;
+}
+
+// Reads the RTP timestamp of |p_buf| into |p_timestamp|. Returns false unless
+// the RTP header is still in the offset in front of the payload: a version 2
+// header without CSRCs or extension whose sequence number is the one AVDTP
+// left in |layer_specific|.
+static bool a2dp_lhdcv3_sink_rtp_timestamp(const BT_HDR* p_buf,
+                                           uint32_t* p_timestamp) {
+  if (p_buf->offset < AVDT_MEDIA_HDR_SIZE) return false;
+  const uint8_t* p =
+      (const uint8_t*)(p_buf + 1) + p_buf->offset - AVDT_MEDIA_HDR_SIZE;
+  // V=2, P any, X=0, CC=0
+  if ((p[0] & 0xDF) != 0x80) return false;
+  if ((uint16_t)((p[2] << 8) | p[3]) != p_buf->layer_specific) return false;
+  *p_timestamp = ((uint32_t)p[4] << 24) | ((uint32_t)p[5] << 16) |
+                 ((uint32_t)p[6] << 8) | p[7];
+  return true;
+}
+
+// Updates the clock drift estimate with packet |p_buf|, which arrived at
+// |arrival_us| after |lost| packets went missing.
+// The offset between arrival time and media time is jittery, but its lower
+// envelope moves only with the clock mismatch. The slope of the per-window
+// minimum therefore gives the source clock rate as seen by the sink. Without
+// the RTP header, arrival times are media timer ticks: the offset is then
+// quantized to a tick rather than delayed by the link, so the per-window mean
+// is used instead.
+static void a2dp_lhdcv3_sink_drift_on_packet(tA2DP_LHDCV3_SINK_CB* p_cb,
+                                             const BT_HDR* p_buf, uint32_t lost,
+                                             uint64_t arrival_us) {
+  tA2DP_LHDCV3_SINK_DRIFT* p_drift = &p_cb->drift;
+  if (p_drift->sample_rate == 0) return;
+
+  // Without the RTP header, the packet starts where the audio decoded from
+  // the ones before it ends, plus what the lost ones would have held.
+  uint32_t timestamp;
+  bool rtp = a2dp_lhdcv3_sink_rtp_timestamp(p_buf, &timestamp);
+  if (!rtp) {
+    p_drift->decoded_frames += lost * p_cb->plc.packet_frames;
+    timestamp = p_drift->decoded_frames;
+  }
+  if (rtp != p_drift->rtp) p_drift->have_anchor = false;
+  p_drift->rtp = rtp;
+
+  if (!p_drift->have_anchor) {
+    p_drift->have_anchor = true;
+    p_drift->anchor_us = arrival_us;
+    p_drift->last_timestamp = timestamp;
+    p_drift->media_samples = 0;
+    p_drift->window_start_us = arrival_us;
+    p_drift->window_min_us = INT64_MAX;
+    p_drift->window_sum_us = 0;
+    p_drift->window_count = 0;
+    p_drift->have_last_level = false;
+    return;
+  }
+
+  // Unsigned difference handles the 32-bit timestamp wrap
+  p_drift->media_samples += (uint32_t)(timestamp - p_drift->last_timestamp);
+  p_drift->last_timestamp = timestamp;
+
+  int64_t media_us = p_drift->media_samples * 1000000 / p_drift->sample_rate;
+  int64_t offset_us = (int64_t)(arrival_us - p_drift->anchor_us) - media_us;
+
+  // A jump this large is a timestamp discontinuity, not drift
+  if (p_drift->have_last_level &&
+      llabs(offset_us - p_drift->last_level_us) > A2DP_LHDCV3_SINK_DRIFT_RESYNC_US) {
+    LOG_WARN("%s: timestamp discontinuity, resyncing", __func__);
+    p_drift->have_anchor = false;
+    return;
+  }
+
+  if (offset_us < p_drift->window_min_us) p_drift->window_min_us = offset_us;
+  p_drift->window_sum_us += offset_us;
+  p_drift->window_count++;
+  uint64_t window_us = p_drift->rtp ? A2DP_LHDCV3_SINK_DRIFT_WINDOW_US
+                                    : A2DP_LHDCV3_SINK_DRIFT_TICK_WINDOW_US;
+  if (arrival_us - p_drift->window_start_us < window_us) return;
+
+  int64_t level_us = p_drift->rtp
+                         ? p_drift->window_min_us
+                         : p_drift->window_sum_us / (int64_t)p_drift->window_count;
+  if (p_drift->have_last_level) {
+    double slope = (double)(level_us - p_drift->last_level_us) /
+                   (double)(arrival_us - p_drift->window_start_us);
+    // Arrivals falling behind media time mean the source clock runs slow.
+    double ppm = -slope * 1e6;
+    p_drift->drift_ppm += (ppm - p_drift->drift_ppm) / 4;
+    if (p_drift->drift_ppm > A2DP_LHDCV3_SINK_DRIFT_MAX_PPM)
+      p_drift->drift_ppm = A2DP_LHDCV3_SINK_DRIFT_MAX_PPM;
+    if (p_drift->drift_ppm < -A2DP_LHDCV3_SINK_DRIFT_MAX_PPM)
+      p_drift->drift_ppm = -A2DP_LHDCV3_SINK_DRIFT_MAX_PPM;
+  }
+  p_drift->last_level_us = level_us;
+  p_drift->have_last_level = true;
+  p_drift->window_min_us = INT64_MAX;
+  p_drift->window_sum_us = 0;
+  p_drift->window_count = 0;
+  p_drift->window_start_us = arrival_us;
+}
+
+// Forgets the previous packet, as after a gap in the stream.
+static void a2dp_lhdcv3_sink_link_reset(tA2DP_LHDCV3_SINK_CB* p_cb) {
+  p_cb->link.last_arrival_us = 0;
+}
+
+// Counts a packet that arrived at |arrival_us|, |lost| packets after the
+// previous one, in the link statistics. |underrun| is set if the output ran
+// dry waiting for it.
+static void a2dp_lhdcv3_sink_link_on_packet(tA2DP_LHDCV3_SINK_CB* p_cb,
+                                            uint32_t lost, uint64_t arrival_us,
+                                            bool underrun) {
+  tA2DP_LHDCV3_SINK_LINK* p_link = &p_cb->link;
+
+  a2dp_lhdcv3_sink_count(&p_cb->stats.packets_lost, lost);
+  if (underrun) a2dp_lhdcv3_sink_count(&p_cb->stats.underruns, 1);
+
+  // A packet is late when it trails the previous one by more than twice the
+  // usual interval.
+  int64_t interval_us = p_cb->prefill.interval_us;
+  if (p_link->last_arrival_us != 0 && interval_us > 0 &&
+      arrival_us - p_link->last_arrival_us > 2 * (uint64_t)interval_us) {
+    a2dp_lhdcv3_sink_count(&p_cb->stats.packets_late, 1);
+  }
+  p_link->last_arrival_us = arrival_us;
+}
+
+// Sizes the concealment buffers for |sample_rate| and |bits_per_sample|.
+static void a2dp_lhdcv3_sink_plc_resize(tA2DP_LHDCV3_SINK_CB* p_cb,
+                                        int sample_rate, int bits_per_sample) {
+  tA2DP_LHDCV3_SINK_PLC* p_plc = &p_cb->plc;
+  size_t frame_bytes = A2DP_LHDCV3_SINK_CHANNELS * (bits_per_sample / 8);
+
+  p_plc->history_size = sample_rate * A2DP_LHDCV3_SINK_PLC_HISTORY_MS / 1000;
+  a2dp_lhdcv3_sink_pcm_resize(p_cb, &p_plc->history,
+                              p_plc->history_size * frame_bytes);
+  a2dp_lhdcv3_sink_pcm_resize(
+      p_cb, &p_plc->q31,
+      A2DP_LHDCV3_SINK_CHANNELS * A2DP_LHDCV3_SINK_PLC_CHUNK_FRAMES);
+  a2dp_lhdcv3_sink_pcm_resize(p_cb, &p_plc->out,
+                              A2DP_LHDCV3_SINK_PLC_CHUNK_FRAMES * frame_bytes);
+}
+
+static void a2dp_lhdcv3_sink_plc_reset(tA2DP_LHDCV3_SINK_CB* p_cb) {
+  tA2DP_LHDCV3_SINK_PLC* p_plc = &p_cb->plc;
+
+  p_plc->have_seq = false;
+  p_plc->have_timestamp = false;
+  p_plc->timestamp_steps = false;
+  p_plc->packet_frames = 0;
+  p_plc->decoded_frames = 0;
+  p_plc->history_frames = 0;
+  p_plc->history_pos = 0;
+  p_plc->gain = A2DP_LHDCV3_SINK_PLC_UNITY;
+  p_plc->ramp_frames = 0;
+}
+
+// Moves the smoothed frames per packet towards |frames|.
+static void a2dp_lhdcv3_sink_plc_packet_frames(tA2DP_LHDCV3_SINK_PLC* p_plc,
+                                               uint32_t frames) {
+  if (p_plc->packet_frames == 0) {
+    p_plc->packet_frames = frames;
+  } else {
+    p_plc->packet_frames += ((int32_t)frames - (int32_t)p_plc->packet_frames) / 8;
+  }
+}
+
+// Tracks the sequence numbers of the stream. Returns the number of packets
+// missing before |p_buf|. Duplicates and packets arriving out of order count
+// as no loss, and a gap of A2DP_LHDCV3_SINK_PLC_MAX_SEQ_GAP packets or more
+// is a discontinuity instead.
+static uint32_t a2dp_lhdcv3_sink_plc_on_packet(tA2DP_LHDCV3_SINK_CB* p_cb,
+                                               const BT_HDR* p_buf) {
+  tA2DP_LHDCV3_SINK_PLC* p_plc = &p_cb->plc;
+  uint16_t seq = p_buf->layer_specific;
+  uint16_t delta = seq - p_plc->last_seq;
+  if (p_plc->have_seq && (delta == 0 || delta >= 0x8000)) return 0;
+
+  uint32_t lost = 0;
+  if (p_plc->have_seq && delta < A2DP_LHDCV3_SINK_PLC_MAX_SEQ_GAP) lost = delta - 1;
+  p_plc->last_seq = seq;
+  p_plc->have_seq = true;
+
+  // The RTP timestamps, when there, say how many frames the gap held
+  uint32_t timestamp;
+  if (!a2dp_lhdcv3_sink_rtp_timestamp(p_buf, &timestamp)) {
+    p_plc->have_timestamp = false;
+    return lost;
+  }
+  if (p_plc->have_timestamp && delta < A2DP_LHDCV3_SINK_PLC_MAX_SEQ_GAP) {
+    uint32_t step = (timestamp - p_plc->last_timestamp) / delta;
+    if (step != 0 && p_cb->sample_rate > 0 && step < (uint32_t)p_cb->sample_rate / 2) {
+      if (!p_plc->timestamp_steps) p_plc->packet_frames = 0;
+      p_plc->timestamp_steps = true;
+      a2dp_lhdcv3_sink_plc_packet_frames(p_plc, step);
+    }
+  }
+  p_plc->last_timestamp = timestamp;
+  p_plc->have_timestamp = true;
+  return lost;
+}
+
+// Takes the frames the packet just decoded produced as the size of a packet,
+// unless the RTP timestamps give it.
+static void a2dp_lhdcv3_sink_plc_on_packet_decoded(tA2DP_LHDCV3_SINK_CB* p_cb) {
+  tA2DP_LHDCV3_SINK_PLC* p_plc = &p_cb->plc;
+  if (!p_plc->timestamp_steps && p_plc->decoded_frames != 0) {
+    a2dp_lhdcv3_sink_plc_packet_frames(p_plc, p_plc->decoded_frames);
+  }
+  p_plc->decoded_frames = 0;
+}
+
+// Returns how many frames the concealment of |lost| packets synthesizes.
+static uint32_t a2dp_lhdcv3_sink_plc_frames(const tA2DP_LHDCV3_SINK_CB* p_cb,
+                                            uint32_t lost) {
+  if (p_cb->sample_rate <= 0) return 0;
+  uint32_t max_frames = p_cb->sample_rate * A2DP_LHDCV3_SINK_PLC_MAX_MS / 1000;
+  return std::min(lost * p_cb->plc.packet_frames, max_frames);
+}
+
+// Scales the |frames| stereo frames of |buf| in place, from gain |gain| by
+// |step| per frame. Returns the gain reached.
+static int32_t a2dp_lhdcv3_sink_plc_apply_gain(tA2DP_LHDCV3_SINK_CB* p_cb,
+                                               uint8_t* buf, size_t frames,
+                                               int32_t gain, int32_t step) {
+  int32_t* q31 = p_cb->plc.q31.data();
+  size_t samples = A2DP_LHDCV3_SINK_CHANNELS * frames;
+
+  p_cb->pcm_kernels->unpack(buf, q31, samples);
+  for (size_t i = 0; i < samples; i += A2DP_LHDCV3_SINK_CHANNELS) {
+    for (size_t ch = 0; ch < A2DP_LHDCV3_SINK_CHANNELS; ch++) {
+      q31[i + ch] = (int32_t)(((int64_t)q31[i + ch] * gain) >> 15);
+    }
+    gain += step;
+    if (gain < 0) gain = 0;
+    if (gain > A2DP_LHDCV3_SINK_PLC_UNITY) gain = A2DP_LHDCV3_SINK_PLC_UNITY;
+  }
+  p_cb->pcm_kernels->pack(q31, buf, samples);
+  return gain;
+}
+
+// Keeps the tail of the decoded PCM in |buf| for concealment, after fading it
+// in if it follows a concealed gap.
+static void a2dp_lhdcv3_sink_plc_on_decoded(tA2DP_LHDCV3_SINK_CB* p_cb,
+                                            uint8_t* buf, uint32_t len) {
+  tA2DP_LHDCV3_SINK_PLC* p_plc = &p_cb->plc;
+  size_t frame_bytes = A2DP_LHDCV3_SINK_CHANNELS * (p_cb->bits_per_sample / 8);
+  size_t frames = len / frame_bytes;
+  p_plc->decoded_frames += frames;
+  if (p_plc->history_size == 0) return;
+
+  uint8_t* p = buf;
+  size_t left = frames;
+  while (p_plc->ramp_frames > 0 && left > 0) {
+    size_t chunk = std::min({left, p_plc->ramp_frames,
+                             (size_t)A2DP_LHDCV3_SINK_PLC_CHUNK_FRAMES});
+    int32_t step = (A2DP_LHDCV3_SINK_PLC_UNITY - p_plc->gain) /
+                       (int32_t)p_plc->ramp_frames + 1;
+    p_plc->gain = a2dp_lhdcv3_sink_plc_apply_gain(p_cb, p, chunk, p_plc->gain, step);
+    p_plc->ramp_frames -= chunk;
+    p += chunk * frame_bytes;
+    left -= chunk;
+  }
+  if (p_plc->ramp_frames == 0) p_plc->gain = A2DP_LHDCV3_SINK_PLC_UNITY;
+
+  // Only the newest frames can matter
+  if (frames > p_plc->history_size) {
+    buf += (frames - p_plc->history_size) * frame_bytes;
+    frames = p_plc->history_size;
+  }
+  while (frames > 0) {
+    size_t chunk = std::min(frames, p_plc->history_size - p_plc->history_pos);
+    memcpy(p_plc->history.data() + p_plc->history_pos * frame_bytes, buf,
+           chunk * frame_bytes);
+    p_plc->history_pos = (p_plc->history_pos + chunk) % p_plc->history_size;
+    p_plc->history_frames =
+        std::min(p_plc->history_frames + chunk, p_plc->history_size);
+    buf += chunk * frame_bytes;
+    frames -= chunk;
+  }
+}
+
+// Synthesizes |frames| frames in place of lost packets and hands them to the
+// output path: the kept history is repeated while fading to silence.
+static void a2dp_lhdcv3_sink_plc_conceal(tA2DP_LHDCV3_SINK_CB* p_cb,
+                                         uint32_t frames) {
+  A2DP_LHDCV3_SINK_SPAN("conceal", frames);
+  tA2DP_LHDCV3_SINK_PLC* p_plc = &p_cb->plc;
+  size_t frame_bytes = A2DP_LHDCV3_SINK_CHANNELS * (p_cb->bits_per_sample / 8);
+  int32_t step = -(A2DP_LHDCV3_SINK_PLC_UNITY /
+                   (p_cb->sample_rate * A2DP_LHDCV3_SINK_PLC_FADE_MS / 1000)) - 1;
+  // Oldest kept frame, where the repetition starts
+  size_t pos = 0;
+  if (p_plc->history_size != 0) {
+    pos = (p_plc->history_pos + p_plc->history_size - p_plc->history_frames) %
+          p_plc->history_size;
+  }
+  size_t first = pos;
+  int32_t gain = p_plc->gain;
+
+  LOG_DEBUG("%s: concealing %u frames", __func__, frames);
+  a2dp_lhdcv3_sink_count(&p_cb->stats.concealed_frames, frames);
+  while (frames > 0) {
+    size_t chunk = std::min(frames, (uint32_t)A2DP_LHDCV3_SINK_PLC_CHUNK_FRAMES);
+    uint8_t* out = p_plc->out.data();
+    if (p_plc->history_frames == 0 || gain == 0) {
+      memset(out, 0, chunk * frame_bytes);
+    } else {
+      for (size_t i = 0; i < chunk; i++) {
+        memcpy(out + i * frame_bytes,
+               p_plc->history.data() + pos * frame_bytes, frame_bytes);
+        pos = (pos + 1) % p_plc->history_size;
+        if (pos == p_plc->history_pos) pos = first;
+      }
+      gain = a2dp_lhdcv3_sink_plc_apply_gain(p_cb, out, chunk, gain, step);
+    }
+    p_cb->output(p_cb, out, chunk * frame_bytes);
+    frames -= chunk;
+  }
+
+  p_plc->gain = gain;
+  p_plc->ramp_frames = p_cb->sample_rate * A2DP_LHDCV3_SINK_PLC_RAMP_MS / 1000;
+}
+
+// Polyphase filter bank shared by all streams: PHASES + 1 rows so that the
+// row after the last phase can be used for interpolation.
+alignas(16) static float a2dp_lhdcv3_sink_asrc_coefs
+    [A2DP_LHDCV3_SINK_ASRC_PHASES + 1][A2DP_LHDCV3_SINK_ASRC_TAPS];
+static std::once_flag a2dp_lhdcv3_sink_asrc_coefs_once;
+
+// Blackman-windowed sinc, cut off slightly below Nyquist. Each phase is
+// normalized to unity DC gain.
+static void a2dp_lhdcv3_sink_asrc_build_coefs(void) {
+  const int taps = A2DP_LHDCV3_SINK_ASRC_TAPS;
+  const double cutoff = 0.9;
+  for (int p = 0; p <= A2DP_LHDCV3_SINK_ASRC_PHASES; p++) {
+    double mu = (double)p / A2DP_LHDCV3_SINK_ASRC_PHASES;
+    double sum = 0;
+    for (int k = 0; k < taps; k++) {
+      double x = (k - (taps / 2 - 1)) - mu;
+      double arg = M_PI * cutoff * x;
+      double sinc = (x == 0) ? 1.0 : sin(arg) / arg;
+      double n = (x + taps / 2) / taps;  // 0..1 across the filter span
+      double window = 0.42 - 0.5 * cos(2 * M_PI * n) + 0.08 * cos(4 * M_PI * n);
+      a2dp_lhdcv3_sink_asrc_coefs[p][k] = (float)(sinc * window);
+      sum += sinc * window;
+    }
+    for (int k = 0; k < taps; k++) a2dp_lhdcv3_sink_asrc_coefs[p][k] /= sum;
+  }
+}
+
+// Dot product of A2DP_LHDCV3_SINK_ASRC_TAPS samples with a filter phase.
+static inline float a2dp_lhdcv3_sink_asrc_dot(const float* x, const float* h) {
+  static_assert(A2DP_LHDCV3_SINK_ASRC_TAPS % 4 == 0, "taps must be a multiple of 4");
+#if defined(__ARM_NEON)
+  float32x4_t acc = vdupq_n_f32(0);
+  for (int k = 0; k < A2DP_LHDCV3_SINK_ASRC_TAPS; k += 4) {
+    acc = vmlaq_f32(acc, vld1q_f32(x + k), vld1q_f32(h + k));
+  }
+#if defined(__aarch64__)
+  return vaddvq_f32(acc);
+#else
+  float32x2_t sum = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+  return vget_lane_f32(vpadd_f32(sum, sum), 0);
+#endif
+#elif defined(__SSE2__)
+  __m128 acc = _mm_setzero_ps();
+  for (int k = 0; k < A2DP_LHDCV3_SINK_ASRC_TAPS; k += 4) {
+    acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(x + k), _mm_load_ps(h + k)));
+  }
+  acc = _mm_add_ps(acc, _mm_movehl_ps(acc, acc));
+  acc = _mm_add_ss(acc, _mm_shuffle_ps(acc, acc, 1));
+  return _mm_cvtss_f32(acc);
+#else
+  float acc = 0;
+  for (int k = 0; k < A2DP_LHDCV3_SINK_ASRC_TAPS; k++) acc += x[k] * h[k];
+  return acc;
+#endif
+}
+
+static void a2dp_lhdcv3_sink_asrc_reset(tA2DP_LHDCV3_SINK_CB* p_cb) {
+  tA2DP_LHDCV3_SINK_ASRC* p_asrc = &p_cb->asrc;
+
+  std::call_once(a2dp_lhdcv3_sink_asrc_coefs_once,
+                 a2dp_lhdcv3_sink_asrc_build_coefs);
+  // Start from a zeroed history of TAPS - 1 frames
+  for (auto& work : p_asrc->work) {
+    std::fill(work.begin(), work.begin() + A2DP_LHDCV3_SINK_ASRC_TAPS - 1, 0.0f);
+  }
+  p_asrc->work_frames = A2DP_LHDCV3_SINK_ASRC_TAPS - 1;
+  p_asrc->position = 0;
+}
+
+// Returns true if the hand-back has room for |p_chunk|.
+static bool a2dp_lhdcv3_sink_handback_room(const tA2DP_LHDCV3_SINK_HANDBACK* p_handback,
+                                           const tA2DP_LHDCV3_SINK_PCM_CHUNK* p_chunk) {
+  return p_chunk->begin + p_chunk->len -
+                 p_handback->tail.load(std::memory_order_acquire) <=
+             p_handback->arena.size() &&
+         p_handback->chunks.Size() < A2DP_LHDCV3_SINK_HANDBACK_CHUNKS;
+}
+
+// Queues |len| bytes of output PCM at |buf| for hand-back. Runs on the decode
+// thread, and waits for the stack to make room if the hand-back is full.
+static void a2dp_lhdcv3_sink_deliver(tA2DP_LHDCV3_SINK_CB* p_cb, uint8_t* buf,
+                                     uint32_t len) {
+  tA2DP_LHDCV3_SINK_HANDBACK* p_handback = &p_cb->handback;
+  size_t size = p_handback->arena.size();
+  if (len > size) {
+    LOG_ERROR("%s: %u bytes of PCM do not fit the hand-back", __func__, len);
+    return;
+  }
+  tA2DP_LHDCV3_SINK_PCM_CHUNK chunk;
+  chunk.begin = p_handback->head;
+  chunk.len = len;
+  chunk.generation = p_cb->config_generation;
+  // Chunks do not wrap: start over at the front if this one would
+  if (chunk.begin % size + len > size) chunk.begin += size - chunk.begin % size;
+
+  bool counted = false;
+  while (!a2dp_lhdcv3_sink_handback_room(p_handback, &chunk)) {
+    if (!counted) {
+      a2dp_lhdcv3_sink_count(&p_cb->stats.handback_waits, 1);
+      counted = true;
+    }
+    // Flag the wait before looking again, so that a drain or a cleanup
+    // running meanwhile either is seen here or sees the flag.
+    p_handback->waiting.store(true);
+    if (p_cb->exiting.load()) return;
+    if (a2dp_lhdcv3_sink_handback_room(p_handback, &chunk)) {
+      // Take back the post of a drain that already saw the flag
+      if (!p_handback->waiting.exchange(false)) semaphore_wait(p_handback->room_sem);
+      break;
+    }
+    semaphore_wait(p_handback->room_sem);
+  }
+  memcpy(p_handback->arena.data() + chunk.begin % size, buf, len);
+  p_handback->chunks.Push(chunk);
+  p_handback->head = chunk.begin + len;
+}
+
+// Hands the PCM decoded so far to the decoded data callback. Runs on the
+// thread driving the decoder interface, with no lock held. PCM decoded under
+// a configuration other than the latest is dropped, as the audio track has
+// been set up for the new one. A pending delay report is sent along.
+static void a2dp_lhdcv3_sink_handback_drain(tA2DP_LHDCV3_SINK_CB* p_cb) {
+  tA2DP_LHDCV3_SINK_HANDBACK* p_handback = &p_cb->handback;
+  const tA2DP_LHDCV3_SINK_CONFIG* p_config =
+      p_cb->active_config.load(std::memory_order_relaxed);
+  uint32_t generation = p_config != NULL ? p_config->generation : 0;
+  size_t size = p_handback->arena.size();
+
+  // Take only what is there now, so a busy decode thread cannot keep this
+  // going.
+  tA2DP_LHDCV3_SINK_PCM_CHUNK chunk;
+  for (size_t count = p_handback->chunks.Size();
+       count != 0 && p_handback->chunks.Pop(&chunk); count--) {
+    if (chunk.generation == generation) {
+      A2DP_LHDCV3_SINK_SPAN("pcm_handback", chunk.len);
+      a2dp_lhdcv3_sink_count(&p_cb->stats.pcm_callbacks, 1);
+      p_cb->decode_callback(p_handback->arena.data() + chunk.begin % size,
+                            chunk.len);
+    }
+    p_handback->tail.store(chunk.begin + chunk.len, std::memory_order_release);
+  }
+  if (p_handback->waiting.exchange(false)) semaphore_post(p_handback->room_sem);
+
+  int32_t report = p_cb->delay.report.exchange(-1, std::memory_order_acquire);
+  tA2DP_LHDCV3_SINK_DELAY_CBACK cback =
+      a2dp_lhdcv3_sink_delay_cback.load(std::memory_order_acquire);
+  if (report >= 0 && cback != NULL && p_cb->replay == NULL) cback((uint16_t)report);
+}
+
+// Hands on the partial period, if any.
+static void a2dp_lhdcv3_sink_period_flush(tA2DP_LHDCV3_SINK_CB* p_cb) {
+  tA2DP_LHDCV3_SINK_PERIOD* p_period = &p_cb->period;
+  if (p_period->fill == 0) return;
+  a2dp_lhdcv3_sink_deliver(p_cb, p_period->buf.data(), p_period->fill);
+  p_period->fill = 0;
+}
+
+// Sizes the output period to the requested frames at the output format.
+static void a2dp_lhdcv3_sink_period_bind(tA2DP_LHDCV3_SINK_CB* p_cb) {
+  tA2DP_LHDCV3_SINK_PERIOD* p_period = &p_cb->period;
+  a2dp_lhdcv3_sink_period_flush(p_cb);
+  p_period->frames = p_cb->period_frames.load(std::memory_order_relaxed);
+  p_period->bytes = p_cb->sample_rate > 0 ? (size_t)p_period->frames *
+                                                p_cb->channels *
+                                                (p_cb->requant.out_bits / 8)
+                                          : 0;
+  a2dp_lhdcv3_sink_pcm_resize(p_cb, &p_period->buf, p_period->bytes);
+}
+
+// Returns the audio held in the sink, in microseconds: the packets queued in
+// the ring, at the frames per packet seen so far, plus the PCM of a partial
+// period and the PCM not yet handed back. Runs on the decode thread.
+static uint32_t a2dp_lhdcv3_sink_held_us(tA2DP_LHDCV3_SINK_CB* p_cb) {
+  if (p_cb->sample_rate <= 0 || p_cb->requant.out_bits == 0) return 0;
+  const tA2DP_LHDCV3_SINK_HANDBACK* p_handback = &p_cb->handback;
+  uint64_t pcm_bytes =
+      p_cb->period.fill +
+      (p_handback->head - p_handback->tail.load(std::memory_order_acquire));
+  uint64_t frames =
+      (uint64_t)p_cb->ring.Size() * p_cb->plc.packet_frames +
+      pcm_bytes / (p_cb->channels * (p_cb->requant.out_bits / 8));
+  return (uint32_t)std::min<uint64_t>(frames * 1000000 / p_cb->sample_rate,
+                                      UINT32_MAX);
+}
+
+// Restarts the presentation delay estimate at |now_us|. The last estimate
+// stays readable until a new one is made.
+static void a2dp_lhdcv3_sink_delay_reset(tA2DP_LHDCV3_SINK_CB* p_cb,
+                                         uint64_t now_us) {
+  tA2DP_LHDCV3_SINK_DELAY* p_delay = &p_cb->delay;
+  p_delay->have_estimate = false;
+  p_delay->depth_us = 0;
+  p_delay->last_report_us = now_us;
+  p_delay->reported_us = 0;
+  p_delay->report.store(-1, std::memory_order_relaxed);
+}
+
+// Folds the audio queued in the sink into the presentation delay estimate
+// after a packet was decoded at |now_us|, and queues a report to the source
+// once it has settled after the start and then whenever it moves.
+static void a2dp_lhdcv3_sink_delay_update(tA2DP_LHDCV3_SINK_CB* p_cb,
+                                          uint64_t now_us) {
+  tA2DP_LHDCV3_SINK_DELAY* p_delay = &p_cb->delay;
+  uint32_t depth_us = a2dp_lhdcv3_sink_held_us(p_cb);
+  if (!p_delay->have_estimate) {
+    p_delay->depth_us = depth_us;
+    p_delay->have_estimate = true;
+  } else {
+    p_delay->depth_us += ((int64_t)depth_us - (int64_t)p_delay->depth_us) / 16;
+  }
+
+  uint64_t delay_us = p_delay->depth_us +
+                      p_cb->output_latency_us.load(std::memory_order_relaxed);
+  if (p_cb->sample_rate > 0 && p_cb->asrc.enabled) {
+    delay_us += A2DP_LHDCV3_SINK_ASRC_TAPS / 2 * 1000000 / p_cb->sample_rate;
+  }
+  delay_us = std::min<uint64_t>(delay_us, UINT16_MAX * 100);
+  p_delay->delay_us.store((uint32_t)delay_us, std::memory_order_relaxed);
+
+  if (now_us - p_delay->last_report_us < A2DP_LHDCV3_SINK_DELAY_REPORT_US) return;
+  if (p_delay->reported_us != 0 &&
+      std::abs((int64_t)delay_us - (int64_t)p_delay->reported_us) <
+          A2DP_LHDCV3_SINK_DELAY_STEP_US)
+    return;
+  p_delay->last_report_us = now_us;
+  p_delay->reported_us = (uint32_t)delay_us;
+  LOG_INFO("%s: presentation delay %u us", __func__, p_delay->reported_us);
+  p_delay->report.store((int32_t)(delay_us / 100), std::memory_order_release);
+}
+
+// Converts |*p_len| bytes of decoded PCM at |buf| to the output format with
+// |gain| applied. Returns the converted PCM and updates |*p_len|.
+static uint8_t* a2dp_lhdcv3_sink_requantize(tA2DP_LHDCV3_SINK_CB* p_cb,
+                                            uint8_t* buf, uint32_t* p_len,
+                                            float gain) {
+  tA2DP_LHDCV3_SINK_REQUANT* p_requant = &p_cb->requant;
+  size_t samples = *p_len / (p_cb->bits_per_sample / 8);
+  if (p_requant->out_bits == 16) {
+    a2dp_lhdcv3_sink_pcm_resize(p_cb, &p_requant->out, samples * 2);
+    p_cb->pcm_kernels->requantize16(buf, p_requant->out.data(), samples, gain,
+                                    p_requant->dither);
+    *p_len = samples * 2;
+    return p_requant->out.data();
+  }
+
+  // 24-bit output keeps its precision and needs no dither: scale in place
+  const int64_t gain_q16 = lrintf(gain * 65536.0f);
+  a2dp_lhdcv3_sink_pcm_resize(p_cb, &p_requant->q31, samples);
+  int32_t* q31 = p_requant->q31.data();
+  p_cb->pcm_kernels->unpack(buf, q31, samples);
+  for (size_t i = 0; i < samples; i++) q31[i] = (int32_t)((q31[i] * gain_q16) >> 16);
+  p_cb->pcm_kernels->pack(q31, buf, samples);
+  return buf;
+}
+
+// Final stage of every output path: converts the PCM to the output format
+// when it differs or a gain is set, then hands |len| bytes of it on, either
+// as they come or regrouped into whole output periods.
+static void a2dp_lhdcv3_sink_emit(tA2DP_LHDCV3_SINK_CB* p_cb, uint8_t* buf,
+                                  uint32_t len) {
+  float gain = p_cb->gain.load(std::memory_order_relaxed);
+  if (p_cb->requant.out_bits != 0 &&
+      (p_cb->requant.out_bits != p_cb->bits_per_sample || gain != 1.0f)) {
+    buf = a2dp_lhdcv3_sink_requantize(p_cb, buf, &len, gain);
+  }
+
+  tA2DP_LHDCV3_SINK_PERIOD* p_period = &p_cb->period;
+  if (p_period->frames != p_cb->period_frames.load(std::memory_order_relaxed)) {
+    a2dp_lhdcv3_sink_period_bind(p_cb);
+  }
+  if (p_period->bytes == 0) {
+    a2dp_lhdcv3_sink_deliver(p_cb, buf, len);
+    return;
+  }
+
+  while (len > 0) {
+    // Whole periods go out straight from |buf|
+    if (p_period->fill == 0 && len >= p_period->bytes) {
+      a2dp_lhdcv3_sink_deliver(p_cb, buf, p_period->bytes);
+      buf += p_period->bytes;
+      len -= p_period->bytes;
+      continue;
+    }
+    size_t n = std::min<size_t>(len, p_period->bytes - p_period->fill);
+    memcpy(p_period->buf.data() + p_period->fill, buf, n);
+    p_period->fill += n;
+    buf += n;
+    len -= n;
+    if (p_period->fill == p_period->bytes) a2dp_lhdcv3_sink_period_flush(p_cb);
+  }
+}
+
+// Post-decode output path for one negotiated (sample rate, bits per sample,
+// output channels) combination. Frame sizes and buffer strides are
+// compile-time constants, and the instantiation matching the configuration is
+// bound once in configure. Decoded PCM is always interleaved stereo; a mono
+// (TWS split) path keeps only the channel of this device, after the library
+// has decoded both.
+template <int kSampleRate, int kBitsPerSample, int kOutChannels>
+struct A2dpLhdcV3SinkOutputPath {
+  static_assert(kBitsPerSample == 16 || kBitsPerSample == 24,
+                "unsupported bits per sample");
+  static_assert(kOutChannels == 1 || kOutChannels == 2,
+                "unsupported output channels");
+
+  static constexpr size_t kSampleBytes = kBitsPerSample / 8;
+  static constexpr size_t kFrameBytes = A2DP_LHDCV3_SINK_CHANNELS * kSampleBytes;
+  static constexpr size_t kOutFrameBytes = kOutChannels * kSampleBytes;
+  // Input is resampled in chunks of at most this many frames
+  static constexpr size_t kMaxFrames =
+      kSampleRate * A2DP_LHDCV3_SINK_OUTPUT_CHUNK_MS / 1000;
+  // Output frames a chunk can produce at the largest allowed drift
+  static constexpr size_t kMaxOutFrames = kMaxFrames + kMaxFrames / 500 + 2;
+
+  // Sizes the ASRC buffers so that the output path never allocates.
+  static void Reserve(tA2DP_LHDCV3_SINK_CB* p_cb) {
+    tA2DP_LHDCV3_SINK_ASRC* p_asrc = &p_cb->asrc;
+    for (auto& work : p_asrc->work) {
+      a2dp_lhdcv3_sink_pcm_resize(p_cb, &work, kMaxFrames + A2DP_LHDCV3_SINK_ASRC_TAPS);
+    }
+    for (auto& planar : p_asrc->planar) {
+      a2dp_lhdcv3_sink_pcm_resize(p_cb, &planar, kMaxOutFrames);
+    }
+    a2dp_lhdcv3_sink_pcm_resize(p_cb, &p_asrc->q31,
+                                A2DP_LHDCV3_SINK_CHANNELS * kMaxOutFrames);
+    a2dp_lhdcv3_sink_pcm_resize(p_cb, &p_asrc->interleaved,
+                                A2DP_LHDCV3_SINK_CHANNELS * kMaxOutFrames);
+    a2dp_lhdcv3_sink_pcm_resize(p_cb, &p_asrc->out, kMaxOutFrames * kFrameBytes);
+  }
+
+  static void Passthrough(tA2DP_LHDCV3_SINK_CB* p_cb, uint8_t* buf, uint32_t len) {
+    if (kOutChannels == A2DP_LHDCV3_SINK_CHANNELS) {
+      a2dp_lhdcv3_sink_emit(p_cb, buf, len - len % kFrameBytes);
+      return;
+    }
+
+    // Pick this device's samples out of the stereo frames
+    const uint8_t* in = buf + p_cb->tws_channel * kSampleBytes;
+    size_t frames = len / kFrameBytes;
+    while (frames > 0) {
+      size_t chunk = std::min(frames, kMaxOutFrames);
+      uint8_t* out = p_cb->asrc.out.data();
+      for (size_t i = 0; i < chunk; i++) {
+        memcpy(out + i * kSampleBytes, in + i * kFrameBytes, kSampleBytes);
+      }
+      a2dp_lhdcv3_sink_emit(p_cb, out, chunk * kOutFrameBytes);
+      in += chunk * kFrameBytes;
+      frames -= chunk;
+    }
+  }
+
+  // Resamples decoded interleaved PCM by the current drift estimate and hands
+  // the result to the output.
+  static void Resample(tA2DP_LHDCV3_SINK_CB* p_cb, uint8_t* buf, uint32_t len) {
+    size_t frames = len / kFrameBytes;
+    while (frames > 0) {
+      size_t chunk = std::min(frames, kMaxFrames);
+      ResampleChunk(p_cb, buf, chunk);
+      buf += chunk * kFrameBytes;
+      frames -= chunk;
+    }
+  }
+
+ private:
+  static void ResampleChunk(tA2DP_LHDCV3_SINK_CB* p_cb, const uint8_t* buf,
+                            size_t in_frames) {
+    tA2DP_LHDCV3_SINK_ASRC* p_asrc = &p_cb->asrc;
+    const tA2DP_LHDCV3_SINK_PCM_KERNELS* p_kernels =
+        p_cb->pcm_kernels;
+    float* left = p_asrc->work[0].data();
+    float* right = p_asrc->work[1].data();
+
+    // Append the new input, deinterleaved, behind the kept history
+    const size_t history = p_asrc->work_frames;
+    p_kernels->unpack(buf, p_asrc->q31.data(), in_frames * A2DP_LHDCV3_SINK_CHANNELS);
+    p_kernels->to_float(p_asrc->q31.data(), p_asrc->interleaved.data(),
+                        in_frames * A2DP_LHDCV3_SINK_CHANNELS);
+    p_kernels->deinterleave(p_asrc->interleaved.data(), left + history,
+                            right + history, in_frames);
+    const size_t avail = history + in_frames;
+
+    // Input frames consumed per output frame
+    const double step = 1.0 + p_cb->drift.drift_ppm * 1e-6;
+    float* out_left = p_asrc->planar[0].data();
+    float* out_right = p_asrc->planar[1].data();
+    // A mono path filters only the kept channel, into |out_left|
+    const float* mono = (p_cb->tws_channel == 1) ? right : left;
+    size_t out_frames = 0;
+    double position = p_asrc->position;
+    while (out_frames < kMaxOutFrames) {
+      size_t index = (size_t)position;
+      if (index + A2DP_LHDCV3_SINK_ASRC_TAPS > avail) break;
+      double phase = (position - index) * A2DP_LHDCV3_SINK_ASRC_PHASES;
+      int row = (int)phase;
+      float frac = (float)(phase - row);
+      const float* h0 = a2dp_lhdcv3_sink_asrc_coefs[row];
+      const float* h1 = a2dp_lhdcv3_sink_asrc_coefs[row + 1];
+
+      if (kOutChannels == 1) {
+        float m0 = a2dp_lhdcv3_sink_asrc_dot(mono + index, h0);
+        float m1 = a2dp_lhdcv3_sink_asrc_dot(mono + index, h1);
+        out_left[out_frames] = m0 + frac * (m1 - m0);
+      } else {
+        float l0 = a2dp_lhdcv3_sink_asrc_dot(left + index, h0);
+        float l1 = a2dp_lhdcv3_sink_asrc_dot(left + index, h1);
+        float r0 = a2dp_lhdcv3_sink_asrc_dot(right + index, h0);
+        float r1 = a2dp_lhdcv3_sink_asrc_dot(right + index, h1);
+        out_left[out_frames] = l0 + frac * (l1 - l0);
+        out_right[out_frames] = r0 + frac * (r1 - r0);
+      }
+      out_frames++;
+      position += step;
+    }
+
+    // Keep the unconsumed tail as history for the next chunk
+    size_t consumed = std::min((size_t)position, avail);
+    memmove(left, left + consumed, (avail - consumed) * sizeof(float));
+    memmove(right, right + consumed, (avail - consumed) * sizeof(float));
+    p_asrc->work_frames = avail - consumed;
+    p_asrc->position = position - consumed;
+
+    if (out_frames == 0) return;
+
+    const size_t out_samples = out_frames * kOutChannels;
+    const float* out_pcm = out_left;
+    if (kOutChannels == 2) {
+      p_kernels->interleave(out_left, out_right, p_asrc->interleaved.data(), out_frames);
+      out_pcm = p_asrc->interleaved.data();
+    }
+    p_kernels->from_float(out_pcm, p_asrc->q31.data(), out_samples);
+    p_kernels->pack(p_asrc->q31.data(), p_asrc->out.data(), out_samples);
+    a2dp_lhdcv3_sink_emit(p_cb, p_asrc->out.data(), out_frames * kOutFrameBytes);
+  }
+};
+
+typedef struct {
+  void (*reserve)(tA2DP_LHDCV3_SINK_CB* p_cb);
+  tA2DP_LHDCV3_SINK_OUTPUT passthrough;
+  tA2DP_LHDCV3_SINK_OUTPUT resample;
+} tA2DP_LHDCV3_SINK_OUTPUT_PATH;
+
+#define A2DP_LHDCV3_SINK_OUTPUT_PATH(rate, bits, channels)              \
+  {                                                                     \
+    A2dpLhdcV3SinkOutputPath<rate, bits, channels>::Reserve,            \
+        A2dpLhdcV3SinkOutputPath<rate, bits, channels>::Passthrough,    \
+        A2dpLhdcV3SinkOutputPath<rate, bits, channels>::Resample        \
+  }
+
+#define A2DP_LHDCV3_SINK_OUTPUT_PATHS(rate)                             \
+  {                                                                     \
+    {A2DP_LHDCV3_SINK_OUTPUT_PATH(rate, 16, 1),                         \
+     A2DP_LHDCV3_SINK_OUTPUT_PATH(rate, 16, 2)},                        \
+    {                                                                   \
+      A2DP_LHDCV3_SINK_OUTPUT_PATH(rate, 24, 1),                        \
+          A2DP_LHDCV3_SINK_OUTPUT_PATH(rate, 24, 2)                     \
+    }                                                                   \
+  }
+
+// Indexed by sample rate (44.1, 48, 88.2, 96 kHz), then by 16/24 bits, then
+// by mono/stereo output
+static const tA2DP_LHDCV3_SINK_OUTPUT_PATH a2dp_lhdcv3_sink_output_paths[4][2][2] = {
+    A2DP_LHDCV3_SINK_OUTPUT_PATHS(44100),
+    A2DP_LHDCV3_SINK_OUTPUT_PATHS(48000),
+    A2DP_LHDCV3_SINK_OUTPUT_PATHS(88200),
+    A2DP_LHDCV3_SINK_OUTPUT_PATHS(96000),
+};
+
+// Used until a valid configuration has been seen
+static void a2dp_lhdcv3_sink_output_passthrough(tA2DP_LHDCV3_SINK_CB* p_cb,
+                                                uint8_t* buf, uint32_t len) {
+  a2dp_lhdcv3_sink_emit(p_cb, buf, len);
+}
+
+// Returns the output path for |sample_rate|, |bits_per_sample| and |channels|,
+// or NULL if there is none.
+static const tA2DP_LHDCV3_SINK_OUTPUT_PATH* a2dp_lhdcv3_sink_find_output_path(
+    int sample_rate, int bits_per_sample, int channels) {
+  int rate_index;
+  switch (sample_rate) {
+    case 44100:
+      rate_index = 0;
+      break;
+    case 48000:
+      rate_index = 1;
+      break;
+    case 88200:
+      rate_index = 2;
+      break;
+    case 96000:
+      rate_index = 3;
+      break;
+    default:
+      return NULL;
+  }
+  return &a2dp_lhdcv3_sink_output_paths[rate_index][bits_per_sample == 24 ? 1 : 0]
+                                       [channels == 1 ? 0 : 1];
+}
+
+// Binds the output path matching the configuration in the control block.
+// Buffers reserved up front for a configuration at least this large are
+// reused as they are.
+static void a2dp_lhdcv3_sink_bind_output(tA2DP_LHDCV3_SINK_CB* p_cb) {
+  a2dp_lhdcv3_sink_period_bind(p_cb);
+  const tA2DP_LHDCV3_SINK_OUTPUT_PATH* p_path = a2dp_lhdcv3_sink_find_output_path(
+      p_cb->sample_rate, p_cb->bits_per_sample, p_cb->channels);
+  if (p_path == NULL) {
+    p_cb->output = a2dp_lhdcv3_sink_output_passthrough;
+    return;
+  }
+
+  // Mono passthrough extracts its channel into the ASRC output buffer
+  p_path->reserve(p_cb);
+  if (p_cb->asrc.enabled) {
+    a2dp_lhdcv3_sink_asrc_reset(p_cb);
+    p_cb->output = p_path->resample;
+  } else {
+    p_cb->output = p_path->passthrough;
+  }
+}
+
+// Reserves the packet arena and the PCM scratch buffers for the largest
+// stream |ie| allows, so that configuring and streaming do not allocate.
+static void a2dp_lhdcv3_sink_reserve(tA2DP_LHDCV3_SINK_CB* p_cb,
+                                     const tA2DP_LHDCV3_SINK_CIE& ie) {
+  a2dp_lhdcv3_sink_pool_reserve(p_cb);
+
+  int sample_rate = 0;
+  if (ie.sampleRate & A2DP_LHDC_SAMPLING_FREQ_44100) sample_rate = 44100;
+  if (ie.sampleRate & A2DP_LHDC_SAMPLING_FREQ_48000) sample_rate = 48000;
+  if (ie.sampleRate & A2DP_LHDC_SAMPLING_FREQ_88200) sample_rate = 88200;
+  if (ie.sampleRate & A2DP_LHDC_SAMPLING_FREQ_96000) sample_rate = 96000;
+  int bits_per_sample =
+      (ie.bits_per_sample & BTAV_A2DP_CODEC_BITS_PER_SAMPLE_24) ? 24 : 16;
+  const tA2DP_LHDCV3_SINK_OUTPUT_PATH* p_path =
+      a2dp_lhdcv3_sink_find_output_path(sample_rate, bits_per_sample, 2);
+  if (p_path != NULL && !p_cb->decode_thread.joinable()) {
+    p_path->reserve(p_cb);
+    a2dp_lhdcv3_sink_plc_resize(p_cb, sample_rate, bits_per_sample);
+  }
+}
+
+// Starts loading the decoder library in the background, unless it is loaded
+// or being loaded. A load that failed is started over, so a library that was
+// missing at boot is picked up by the next codec init.
+static void a2dp_lhdcv3_sink_library_preload(void) {
+  std::lock_guard<std::mutex> lock(a2dp_lhdcv3_sink_library_load_mutex);
+  std::shared_future<bool>& loaded = a2dp_lhdcv3_sink_library_loaded;
+  if (loaded.valid() &&
+      (loaded.wait_for(std::chrono::seconds(0)) != std::future_status::ready ||
+       loaded.get()))
+    return;
+
+  loaded = std::async(std::launch::async, [] {
+             uint64_t start_us = time_get_os_boottime_us();
+             bool result = A2DP_VendorLoadDecoderLhdcV3();
+             LOG_INFO("%s: decoder library %s in %" PRIu64 " us", __func__,
+                      result ? "loaded" : "failed to load",
+                      time_get_os_boottime_us() - start_us);
+             return result;
+           }).share();
+}
+
+// Waits for the background load of the decoder library, starting it over if
+// the last one failed. Returns false if it could not be loaded.
+static bool a2dp_lhdcv3_sink_library_wait_loaded(void) {
+  a2dp_lhdcv3_sink_library_preload();
+  std::shared_future<bool> loaded;
+  {
+    std::lock_guard<std::mutex> lock(a2dp_lhdcv3_sink_library_load_mutex);
+    loaded = a2dp_lhdcv3_sink_library_loaded;
+  }
+  return loaded.get();
+}
+
+// Decoded data callback handed to the decoder library. The library calls it
+// from within decode_packet, on the decode thread.
+static void a2dp_lhdcv3_sink_on_decoded_data(uint8_t* buf, uint32_t len) {
+  A2DP_LHDCV3_SINK_SPAN("pcm_handoff", len);
+  tA2DP_LHDCV3_SINK_CB* p_cb = &a2dp_lhdcv3_sink_cb;
+  if (p_cb->first_pcm_pending) {
+    p_cb->first_pcm_pending = false;
+    uint32_t elapsed_us = (uint32_t)(time_get_os_boottime_us() - p_cb->start_us);
+    std::atomic<uint32_t>* p_first_pcm_us = p_cb->warm_start
+                                                ? &p_cb->stats.first_pcm_warm_us
+                                                : &p_cb->stats.first_pcm_cold_us;
+    p_first_pcm_us->store(elapsed_us, std::memory_order_relaxed);
+    LOG_INFO("%s: first PCM %u us after %s start", __func__, elapsed_us,
+             p_cb->warm_start ? "warm" : "cold");
+  }
+  a2dp_lhdcv3_sink_plc_on_decoded(p_cb, buf, len);
+  p_cb->output(p_cb, buf, len);
+}
+
+// Derives the pipeline settings from the configuration snapshot |p_config|
+// and binds the matching output path. Runs on the decode thread.
+static void a2dp_lhdcv3_sink_apply_config(tA2DP_LHDCV3_SINK_CB* p_cb,
+                                          const tA2DP_LHDCV3_SINK_CONFIG* p_config) {
+  bool valid = p_config->status == A2DP_SUCCESS;
+  bool low_latency = valid && p_config->cie.isLLSupported;
+  p_cb->stats.config_hash.store(
+      a2dp_lhdcv3_sink_hash(p_config->codec_info, A2DP_LHDCV3_CODEC_LEN + 1),
+      std::memory_order_relaxed);
+  LOG_INFO("%s: low latency %s", __func__, low_latency ? "on" : "off");
+  a2dp_lhdcv3_sink_prefill_reset(p_cb, low_latency);
+
+  p_cb->sample_rate =
+      valid ? A2DP_VendorGetTrackSampleRateLhdcV3Sink(p_config->codec_info) : -1;
+  p_cb->bits_per_sample =
+      (valid &&
+       (p_config->cie.bits_per_sample & BTAV_A2DP_CODEC_BITS_PER_SAMPLE_24))
+          ? 24
+          : 16;
+  p_cb->pcm_kernels =
+      a2dp_lhdcv3_sink_select_pcm_kernels(p_cb->bits_per_sample);
+  p_cb->requant.out_bits = valid ? p_config->out_bits : p_cb->bits_per_sample;
+  for (size_t i = 0; i < A2DP_LHDCV3_SINK_DITHER_LANES; i++) {
+    p_cb->requant.dither[i] = 0x9E3779B9u * (uint32_t)(i + 1);
+  }
+  p_cb->channels = 2;
+  if (valid && (p_config->cie.channelSplitMode & A2DP_LHDC_CH_SPLIT_TWS)) {
+    p_cb->channels = 1;
+    p_cb->tws_channel =
+        osi_property_get_int32("persist.bluetooth.lhdcv3_sink.tws_channel", 0) == 1 ? 1 : 0;
+    LOG_INFO("%s: TWS split, playing the %s channel", __func__,
+             p_cb->tws_channel == 1 ? "right" : "left");
+  }
+  LOG_INFO("%s: %d bits per sample, %d bits out, %s PCM kernels", __func__,
+           p_cb->bits_per_sample, p_cb->requant.out_bits,
+           p_cb->pcm_kernels->name);
+
+  p_cb->drift = {};
+  if (p_cb->sample_rate > 0)
+    p_cb->drift.sample_rate = p_cb->sample_rate;
+  a2dp_lhdcv3_sink_link_reset(p_cb);
+  if (p_cb->sample_rate > 0) {
+    a2dp_lhdcv3_sink_plc_resize(p_cb, p_cb->sample_rate, p_cb->bits_per_sample);
+  }
+  a2dp_lhdcv3_sink_plc_reset(p_cb);
+  p_cb->asrc.enabled =
+      p_cb->sample_rate > 0 &&
+      osi_property_get_bool("persist.bluetooth.lhdcv3_sink.asrc", false);
+  a2dp_lhdcv3_sink_bind_output(p_cb);
+}
+
+static void a2dp_lhdcv3_sink_decode_thread(tA2DP_LHDCV3_SINK_CB* p_cb) {
+  pthread_setname_np(pthread_self(), "bt_lhdcv3_dec");
+  raise_priority_a2dp(TASK_HIGH_MEDIA);
+
+  tA2DP_LHDCV3_SINK_DESC desc = {};
+  uint32_t batch_left = 0;  // Entries of the current batch still to take
+  while (true) {
+    if (batch_left == 0) {
+      semaphore_wait(p_cb->ring_sem);
+      a2dp_lhdcv3_sink_count(&p_cb->stats.wakeups, 1);
+    }
+    if (p_cb->exiting.load(std::memory_order_acquire)) break;
+
+    const tA2DP_LHDCV3_SINK_DESC* p_next = p_cb->ring.Peek();
+    if (p_next == NULL) {
+      batch_left = 0;
+      continue;
+    }
+    if (batch_left == 0) batch_left = std::max<uint32_t>(p_next->batch, 1);
+    batch_left--;
+    uint32_t conceal_frames = 0;
+    if (p_next->cmd == A2DP_LHDCV3_SINK_CMD_PACKET) {
+      a2dp_lhdcv3_sink_hist_add(&p_cb->stats.depth, (uint32_t)p_cb->ring.Size());
+      a2dp_lhdcv3_sink_hist_add(&p_cb->stats.held_us, a2dp_lhdcv3_sink_held_us(p_cb));
+      uint32_t lost = a2dp_lhdcv3_sink_plc_on_packet(p_cb, p_next->p_buf);
+      a2dp_lhdcv3_sink_drift_on_packet(p_cb, p_next->p_buf, lost, p_next->enqueue_us);
+      conceal_frames = a2dp_lhdcv3_sink_plc_frames(p_cb, lost);
+      uint64_t concealed_us =
+          conceal_frames != 0 ? (uint64_t)conceal_frames * 1000000 / p_cb->sample_rate
+                              : 0;
+      a2dp_lhdcv3_sink_prefill_on_arrival(p_cb, p_next->enqueue_us, 1 + lost);
+      bool underrun =
+          a2dp_lhdcv3_sink_prefill_wait(p_cb, p_next->enqueue_us, concealed_us);
+      a2dp_lhdcv3_sink_link_on_packet(p_cb, lost, p_next->enqueue_us, underrun);
+      // After an underrun the gap has already been heard
+      if (underrun) conceal_frames = 0;
+    }
+    p_cb->ring.Pop(&desc);
+
+    switch (desc.cmd) {
+      case A2DP_LHDCV3_SINK_CMD_PACKET: {
+        if (conceal_frames != 0) a2dp_lhdcv3_sink_plc_conceal(p_cb, conceal_frames);
+        uint64_t decode_start_us = time_get_os_boottime_us();
+        bool decoded;
+        {
+          A2DP_LHDCV3_SINK_SPAN("decode", desc.p_buf->len);
+          decoded = a2dp_vendor_lhdcv3_decoder_decode_packet(desc.p_buf);
+        }
+        // A packet that decoded to nothing still took its media time
+        p_cb->drift.decoded_frames += p_cb->plc.decoded_frames != 0
+                                          ? p_cb->plc.decoded_frames
+                                          : p_cb->plc.packet_frames;
+        a2dp_lhdcv3_sink_plc_on_packet_decoded(p_cb);
+        if (decoded) {
+          a2dp_lhdcv3_sink_count(&p_cb->stats.packets_decoded, 1);
+        } else {
+          LOG_ERROR("%s: decoding failed", __func__);
+          a2dp_lhdcv3_sink_count(&p_cb->stats.decode_errors, 1);
+        }
+        uint64_t decode_end_us = time_get_os_boottime_us();
+        a2dp_lhdcv3_sink_hist_add(&p_cb->stats.decode_us,
+                                  (uint32_t)(decode_end_us - decode_start_us));
+        a2dp_lhdcv3_sink_pool_free(p_cb, desc.p_buf);
+        a2dp_lhdcv3_sink_delay_update(p_cb, decode_end_us);
+        if (p_cb->replay != NULL) {
+          tA2DP_LHDCV3_SINK_REPLAY* p_replay = p_cb->replay;
+          size_t i = p_replay->count.load(std::memory_order_relaxed);
+          if (i < p_replay->latency_us.size()) {
+            p_replay->latency_us[i] =
+                (uint32_t)(time_get_os_boottime_us() - desc.enqueue_us);
+            p_replay->count.store(i + 1, std::memory_order_release);
+          }
+        }
+        break;
+      }
+      case A2DP_LHDCV3_SINK_CMD_START:
+        a2dp_lhdcv3_sink_prefill_reset(p_cb, p_cb->prefill.low_latency);
+        p_cb->drift.have_anchor = false;
+        a2dp_lhdcv3_sink_link_reset(p_cb);
+        a2dp_lhdcv3_sink_plc_reset(p_cb);
+        a2dp_lhdcv3_sink_delay_reset(p_cb, desc.enqueue_us);
+        // The library still holds the stream state from before the suspend:
+        // resume without configuring it again. decoder_start is still
+        // called, since the library may reset per-stream state in it.
+        p_cb->warm_start = p_cb->warm_generation != 0 &&
+                           p_cb->warm_generation == p_cb->config_generation;
+        p_cb->warm_generation = 0;
+        p_cb->start_us = desc.enqueue_us;
+        p_cb->first_pcm_pending = true;
+        a2dp_vendor_lhdcv3_decoder_start();
+        break;
+      case A2DP_LHDCV3_SINK_CMD_SUSPEND:
+        if (p_cb->warm_resume && p_cb->config != NULL) {
+          p_cb->warm_generation = p_cb->config_generation;
+        } else {
+          a2dp_vendor_lhdcv3_decoder_suspend();
+        }
+        a2dp_lhdcv3_sink_prefill_reset(p_cb, p_cb->prefill.low_latency);
+        LOG_INFO("%s: link: %u lost, %u late, %u underruns", __func__,
+                 p_cb->stats.packets_lost.load(std::memory_order_relaxed),
+                 p_cb->stats.packets_late.load(std::memory_order_relaxed),
+                 p_cb->stats.underruns.load(std::memory_order_relaxed));
+        a2dp_lhdcv3_sink_period_flush(p_cb);
+        break;
+      case A2DP_LHDCV3_SINK_CMD_CONFIGURE: {
+        // Pick up the latest snapshot. A burst of configure() calls applies
+        // the last one once.
+        const tA2DP_LHDCV3_SINK_CONFIG* p_config =
+            p_cb->active_config.load(std::memory_order_acquire);
+        bool changed = p_config->generation != p_cb->config_generation;
+        if (changed && p_cb->config != NULL &&
+            memcmp(p_config->codec_info, p_cb->config->codec_info,
+                   sizeof(p_config->codec_info)) == 0) {
+          // Same configuration again: nothing to redo, and a warm library
+          // state stays usable.
+          if (p_cb->warm_generation == p_cb->config_generation)
+            p_cb->warm_generation = p_config->generation;
+          p_cb->config = p_config;
+          p_cb->config_generation = p_config->generation;
+        } else if (changed) {
+          A2DP_LHDCV3_SINK_SPAN("apply_config");
+          p_cb->config = p_config;
+          p_cb->config_generation = p_config->generation;
+          p_cb->warm_generation = 0;
+          a2dp_lhdcv3_sink_apply_config(p_cb, p_config);
+          // The decoder library state is only ever touched from here
+          save_codec_info(p_config->codec_info);
+          a2dp_vendor_lhdcv3_decoder_configure(p_config->codec_info);
+        }
+        // The replaced snapshot is no longer applied, so it can go.
+        delete desc.p_retired;
+        break;
+      }
+    }
+  }
+
+  struct timespec cpu;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu) == 0) {
+    p_cb->stats.decode_cpu_us.store(
+        (uint32_t)(cpu.tv_sec * 1000000 + cpu.tv_nsec / 1000),
+        std::memory_order_relaxed);
+  }
+}
+
+// Appends a record of |type| with |len| bytes of |p_data| to the trace of
+// |p_cb|, if one is being captured. Runs on the stack thread.
+static void a2dp_lhdcv3_sink_trace_record(tA2DP_LHDCV3_SINK_CB* p_cb,
+                                          tA2DP_LHDCV3_SINK_TRACE_TYPE type,
+                                          uint64_t arrival_us, const BT_HDR* p_buf,
+                                          const uint8_t* p_data, size_t len) {
+  tA2DP_LHDCV3_SINK_TRACE* p_trace = &p_cb->trace;
+  if (!p_trace->active) return;
+
+  size_t size = sizeof(tA2DP_LHDCV3_SINK_TRACE_RECORD) + len;
+  if (p_trace->size - p_trace->used < size || len > UINT16_MAX) {
+    // Unmapped on close, off the receive path
+    LOG_WARN("%s: trace full after %zu bytes, capture stopped", __func__,
+             p_trace->used);
+    p_trace->active = false;
+    return;
+  }
+
+  tA2DP_LHDCV3_SINK_TRACE_RECORD record = {};
+  record.delta_us = (uint32_t)std::min<uint64_t>(arrival_us - p_trace->last_us,
+                                                 UINT32_MAX);
+  record.type = type;
+  if (p_buf != NULL) {
+    record.offset = p_buf->offset;
+    record.layer_specific = p_buf->layer_specific;
+  }
+  record.len = (uint16_t)len;
+  memcpy(p_trace->map + p_trace->used, &record, sizeof(record));
+  memcpy(p_trace->map + p_trace->used + sizeof(record), p_data, len);
+  p_trace->used += size;
+  p_trace->last_us = arrival_us;
+}
+
+// Starts capturing the stream of |p_cb| if persist.bluetooth.lhdcv3_sink.trace
+// is set. The trace holds up to persist.bluetooth.lhdcv3_sink.trace_mb MB.
+static void a2dp_lhdcv3_sink_trace_open(tA2DP_LHDCV3_SINK_CB* p_cb) {
+  tA2DP_LHDCV3_SINK_TRACE* p_trace = &p_cb->trace;
+  if (!osi_property_get_bool("persist.bluetooth.lhdcv3_sink.trace", false)) return;
+  // A replay would truncate the trace it reads
+  if (p_cb->replay != NULL) return;
+
+  const char* path = A2DP_LHDCV3_SINK_TRACE_DIR "/lhdcv3_sink.trc";
+  size_t size = (size_t)osi_property_get_int32(
+                    "persist.bluetooth.lhdcv3_sink.trace_mb", 16) << 20;
+
+  int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0660);
+  if (fd < 0) {
+    LOG_ERROR("%s: cannot create %s: %s", __func__, path, strerror(errno));
+    return;
+  }
+  if (ftruncate(fd, size) != 0) {
+    LOG_ERROR("%s: cannot size %s: %s", __func__, path, strerror(errno));
+    close(fd);
+    return;
+  }
+  void* map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    LOG_ERROR("%s: cannot map %s: %s", __func__, path, strerror(errno));
+    close(fd);
+    return;
+  }
+
+  p_trace->fd = fd;
+  p_trace->map = (uint8_t*)map;
+  p_trace->size = size;
+  p_trace->used = sizeof(tA2DP_LHDCV3_SINK_TRACE_HEADER);
+  p_trace->last_us = time_get_os_boottime_us();
+  tA2DP_LHDCV3_SINK_TRACE_HEADER* p_header =
+      (tA2DP_LHDCV3_SINK_TRACE_HEADER*)p_trace->map;
+  memcpy(p_header->magic, A2DP_LHDCV3_SINK_TRACE_MAGIC, sizeof(p_header->magic));
+  const tA2DP_LHDCV3_SINK_CONFIG* p_config =
+      p_cb->active_config.load(std::memory_order_acquire);
+  if (p_config != NULL) {
+    memcpy(p_header->codec_info, p_config->codec_info, sizeof(p_header->codec_info));
+  } else {
+    memset(p_header->codec_info, 0, sizeof(p_header->codec_info));
+  }
+  p_trace->active = true;
+  LOG_INFO("%s: capturing to %s", __func__, path);
+}
+
+// Ends the capture, full or not, and trims the trace file to what was
+// written.
+static void a2dp_lhdcv3_sink_trace_close(tA2DP_LHDCV3_SINK_CB* p_cb) {
+  tA2DP_LHDCV3_SINK_TRACE* p_trace = &p_cb->trace;
+  if (p_trace->map == NULL) return;
+
+  p_trace->active = false;
+  munmap(p_trace->map, p_trace->size);
+  if (ftruncate(p_trace->fd, p_trace->used) != 0) {
+    LOG_WARN("%s: cannot trim the trace: %s", __func__, strerror(errno));
+  }
+  close(p_trace->fd);
+  LOG_INFO("%s: captured %zu bytes", __func__, p_trace->used);
+  p_trace->fd = -1;
+  p_trace->map = NULL;
+  p_trace->size = 0;
+  p_trace->used = 0;
+}
+
+static bool a2dp_lhdcv3_sink_decoder_init(tA2DP_LHDCV3_SINK_CB* p_cb,
+                                          decoded_data_callback_t decode_callback) {
+  A2DP_LHDCV3_SINK_SPAN("decoder_init");
+  if (p_cb->decode_thread.joinable()) {
+    LOG_WARN("%s: decode thread already running", __func__);
+    return true;
+  }
+
+  p_cb->decode_callback = decode_callback;
+  p_cb->output = a2dp_lhdcv3_sink_output_passthrough;
+  if (!a2dp_vendor_lhdcv3_decoder_init(a2dp_lhdcv3_sink_on_decoded_data))
+    return false;
+
+  // Reserve the stream buffers once, for the largest configuration the
+  // capabilities allow, so that configuring and streaming do not allocate.
+  a2dp_lhdcv3_sink_reserve(p_cb, a2dp_lhdcv3_sink_caps);
+  p_cb->handback.arena.resize(A2DP_LHDCV3_SINK_HANDBACK_BYTES);
+  p_cb->handback.head = 0;
+  p_cb->handback.tail = 0;
+  p_cb->handback.waiting = false;
+  p_cb->handback.room_sem = semaphore_new(0);
+  p_cb->exiting = false;
+  p_cb->ring_sem = semaphore_new(0);
+  a2dp_lhdcv3_sink_stats_reset(p_cb);
+  a2dp_lhdcv3_sink_prefill_reset(p_cb, false);
+  p_cb->link = {};
+  a2dp_lhdcv3_sink_plc_reset(p_cb);
+  a2dp_lhdcv3_sink_trace_open(p_cb);
+  p_cb->warm_resume =
+      osi_property_get_bool("persist.bluetooth.lhdcv3_sink.warm_resume", true);
+  p_cb->warm_generation = 0;
+  p_cb->first_pcm_pending = false;
+  p_cb->period_frames.store(
+      std::max(osi_property_get_int32("persist.bluetooth.lhdcv3_sink.period_frames", 0), 0),
+      std::memory_order_relaxed);
+  p_cb->period = {};
+  p_cb->output_latency_us.store(
+      std::max(osi_property_get_int32("persist.bluetooth.lhdcv3_sink.output_latency_ms", 0), 0) *
+          1000,
+      std::memory_order_relaxed);
+  a2dp_lhdcv3_sink_delay_reset(p_cb, time_get_os_boottime_us());
+  p_cb->delay.delay_us.store(0, std::memory_order_relaxed);
+  p_cb->decode_thread = std::thread(a2dp_lhdcv3_sink_decode_thread, p_cb);
+  return true;
+}
+
+static void a2dp_lhdcv3_sink_decoder_cleanup(tA2DP_LHDCV3_SINK_CB* p_cb) {
+  A2DP_LHDCV3_SINK_SPAN("decoder_cleanup");
+  bool running = p_cb->decode_thread.joinable();
+  if (running) {
+    p_cb->exiting.store(true);
+    semaphore_post(p_cb->ring_sem);
+    if (p_cb->handback.waiting.exchange(false)) semaphore_post(p_cb->handback.room_sem);
+    p_cb->decode_thread.join();
+  }
+
+  // Release whatever was still queued, and the PCM nobody will play now
+  tA2DP_LHDCV3_SINK_DESC desc = {};
+  while (p_cb->ring.Pop(&desc)) {
+    if (desc.cmd == A2DP_LHDCV3_SINK_CMD_PACKET) {
+      a2dp_lhdcv3_sink_pool_free(p_cb, desc.p_buf);
+    }
+    delete desc.p_retired;
+  }
+  for (const tA2DP_LHDCV3_SINK_CONFIG* p_retired : p_cb->retired) delete p_retired;
+  p_cb->retired.clear();
+  tA2DP_LHDCV3_SINK_PCM_CHUNK chunk;
+  while (p_cb->handback.chunks.Pop(&chunk)) {
+  }
+  std::vector<uint8_t>().swap(p_cb->handback.arena);
+  if (p_cb->handback.room_sem != NULL) {
+    semaphore_free(p_cb->handback.room_sem);
+    p_cb->handback.room_sem = NULL;
+  }
+  if (p_cb->ring_sem != NULL) {
+    semaphore_free(p_cb->ring_sem);
+    p_cb->ring_sem = NULL;
+  }
+
+  delete p_cb->active_config.exchange(NULL);
+  p_cb->config = NULL;
+  p_cb->config_generation = 0;
+  a2dp_lhdcv3_sink_trace_close(p_cb);
+
+  if (!running) return;
+  a2dp_lhdcv3_sink_pool_release(p_cb);
+  a2dp_vendor_lhdcv3_decoder_cleanup();
+}
+
+static void a2dp_lhdcv3_sink_drop_packet(tA2DP_LHDCV3_SINK_CB* p_cb) {
+  uint32_t dropped = p_cb->stats.packets_dropped.load(std::memory_order_relaxed);
+  a2dp_lhdcv3_sink_count(&p_cb->stats.packets_dropped, 1);
+  if ((dropped % 100) == 0) {
+    LOG_WARN("%s: media ring full, %u packets dropped", __func__, dropped + 1);
+  }
+}
+
+// Runs on the receive path: copy the |count| packets of |pp_bufs| into the
+// ring and return, waking the decode thread once for all of them.
+// The caller keeps ownership of the packets, so the copy into a pool slot is
+// the one copy the pipeline makes. LHDC frames split across media packets are
+// reassembled inside the decoder library, which takes whole packets.
+// Returns the number of packets queued; the rest were dropped.
+static size_t a2dp_lhdcv3_sink_decode_packets(tA2DP_LHDCV3_SINK_CB* p_cb,
+                                              BT_HDR* const* pp_bufs,
+                                              size_t count) {
+  A2DP_LHDCV3_SINK_SPAN("receive", count);
+  if (!p_cb->decode_thread.joinable()) return 0;
+  a2dp_lhdcv3_sink_handback_drain(p_cb);
+
+  uint64_t arrival_us = time_get_os_boottime_us();
+  // Only this thread fills the ring, so the room can only grow meanwhile
+  size_t used = p_cb->ring.Size();
+  size_t room = used < A2DP_LHDCV3_SINK_PACKET_ENTRIES
+                    ? A2DP_LHDCV3_SINK_PACKET_ENTRIES - used
+                    : 0;
+  size_t queued = 0;
+  for (size_t i = 0; i < count; i++) {
+    BT_HDR* p_buf = pp_bufs[i];
+    a2dp_lhdcv3_sink_count(&p_cb->stats.packets_received, 1);
+    a2dp_lhdcv3_sink_trace_record(p_cb, A2DP_LHDCV3_SINK_TRACE_PACKET,
+                                  arrival_us, p_buf,
+                                  (const uint8_t*)(p_buf + 1),
+                                  p_buf->offset + p_buf->len);
+
+    // Drop before copying when the ring is already full
+    if (queued == room) {
+      a2dp_lhdcv3_sink_drop_packet(p_cb);
+      continue;
+    }
+
+    size_t size = BT_HDR_SIZE + p_buf->offset + p_buf->len;
+    tA2DP_LHDCV3_SINK_DESC desc = {};
+    desc.cmd = A2DP_LHDCV3_SINK_CMD_PACKET;
+    desc.p_buf = a2dp_lhdcv3_sink_pool_alloc(p_cb, size);
+    memcpy(desc.p_buf, p_buf, size);
+    desc.enqueue_us = arrival_us;
+    if (queued == 0) desc.batch = (uint32_t)std::min(count, room);
+
+    A2DP_LHDCV3_SINK_SPAN("enqueue");
+    if (!p_cb->ring.Push(desc)) {
+      a2dp_lhdcv3_sink_pool_free(p_cb, desc.p_buf);
+      a2dp_lhdcv3_sink_drop_packet(p_cb);
+      continue;
+    }
+    queued++;
+  }
+  if (queued != 0) semaphore_post(p_cb->ring_sem);
+  return queued;
+}
+
+static bool a2dp_lhdcv3_sink_decode_packet(tA2DP_LHDCV3_SINK_CB* p_cb, BT_HDR* p_buf) {
+  return a2dp_lhdcv3_sink_decode_packets(p_cb, &p_buf, 1) == 1;
+}
+
+static void a2dp_lhdcv3_sink_decoder_start(tA2DP_LHDCV3_SINK_CB* p_cb) {
+  A2DP_LHDCV3_SINK_SPAN("decoder_start");
+  a2dp_lhdcv3_sink_handback_drain(p_cb);
+  a2dp_lhdcv3_sink_push_cmd(p_cb, A2DP_LHDCV3_SINK_CMD_START, NULL);
+}
+
+static void a2dp_lhdcv3_sink_decoder_suspend(tA2DP_LHDCV3_SINK_CB* p_cb) {
+  A2DP_LHDCV3_SINK_SPAN("decoder_suspend");
+  a2dp_lhdcv3_sink_handback_drain(p_cb);
+  a2dp_lhdcv3_sink_push_cmd(p_cb, A2DP_LHDCV3_SINK_CMD_SUSPEND, NULL);
+}
+
+// Returns a configuration generation no snapshot has had before. 0 is
+// reserved for "no configuration".
+static uint32_t a2dp_lhdcv3_sink_next_generation(void) {
+  static std::atomic<uint32_t> generation{0};
+  uint32_t result;
+  do {
+    result = generation.fetch_add(1, std::memory_order_relaxed) + 1;
+  } while (result == 0);
+  return result;
+}
+
+static void a2dp_lhdcv3_sink_decoder_configure(tA2DP_LHDCV3_SINK_CB* p_cb,
+                                               const uint8_t* p_codec_info) {
+  A2DP_LHDCV3_SINK_SPAN("decoder_configure");
+  // PCM of the previous configuration goes out before the new one is seen
+  a2dp_lhdcv3_sink_handback_drain(p_cb);
+  tA2DP_LHDCV3_SINK_CONFIG* p_config = new tA2DP_LHDCV3_SINK_CONFIG();
+  p_config->generation = a2dp_lhdcv3_sink_next_generation();
+  memcpy(p_config->codec_info, p_codec_info, sizeof(p_config->codec_info));
+  std::shared_ptr<const tA2DP_LHDCV3_SINK_CIE> cfg_cie;
+  p_config->status = A2DP_LookupInfoLhdcV3Sink(p_codec_info, false, &cfg_cie);
+  if (p_config->status == A2DP_SUCCESS) {
+    p_config->cie = *cfg_cie;
+    // Same answer as A2DP_VendorGetTrackBitsPerSampleLhdcV3Sink() gave the
+    // audio track for this configuration
+    p_config->out_bits = a2dp_lhdcv3_sink_output_bits(
+        (cfg_cie->bits_per_sample & BTAV_A2DP_CODEC_BITS_PER_SAMPLE_24) ? 24 : 16);
+  } else {
+    LOG_ERROR("%s: invalid configuration %d", __func__, p_config->status);
+  }
+
+  a2dp_lhdcv3_sink_trace_record(p_cb, A2DP_LHDCV3_SINK_TRACE_CONFIG,
+                                time_get_os_boottime_us(), NULL,
+                                p_config->codec_info, sizeof(p_config->codec_info));
+  const tA2DP_LHDCV3_SINK_CONFIG* p_retired =
+      p_cb->active_config.exchange(p_config, std::memory_order_acq_rel);
+  if (!a2dp_lhdcv3_sink_push_cmd(p_cb, A2DP_LHDCV3_SINK_CMD_CONFIGURE, p_retired) &&
+      p_retired != NULL) {
+    p_cb->retired.push_back(p_retired);
+  }
+}
+
+static bool a2dp_lhdcv3_sink_interface_init(decoded_data_callback_t decode_callback) {
+  return a2dp_lhdcv3_sink_decoder_init(&a2dp_lhdcv3_sink_cb, decode_callback);
+}
+
+static void a2dp_lhdcv3_sink_interface_cleanup(void) {
+  a2dp_lhdcv3_sink_decoder_cleanup(&a2dp_lhdcv3_sink_cb);
+}
+
+static bool a2dp_lhdcv3_sink_interface_decode_packet(BT_HDR* p_buf) {
+  return a2dp_lhdcv3_sink_decode_packet(&a2dp_lhdcv3_sink_cb, p_buf);
+}
+
+static void a2dp_lhdcv3_sink_interface_start(void) {
+  a2dp_lhdcv3_sink_decoder_start(&a2dp_lhdcv3_sink_cb);
+}
+
+static void a2dp_lhdcv3_sink_interface_suspend(void) {
+  a2dp_lhdcv3_sink_decoder_suspend(&a2dp_lhdcv3_sink_cb);
+}
+
+static void a2dp_lhdcv3_sink_interface_configure(const uint8_t* p_codec_info) {
+  a2dp_lhdcv3_sink_decoder_configure(&a2dp_lhdcv3_sink_cb, p_codec_info);
+}
+
+static const tA2DP_DECODER_INTERFACE a2dp_decoder_interface_lhdcv3 = {
+    a2dp_lhdcv3_sink_interface_init,
+    a2dp_lhdcv3_sink_interface_cleanup,
+    a2dp_lhdcv3_sink_interface_decode_packet,
+    a2dp_lhdcv3_sink_interface_start,
+    a2dp_lhdcv3_sink_interface_suspend,
+    a2dp_lhdcv3_sink_interface_configure,
+};
+
+static const tA2DP_DECODER_INTERFACE* a2dp_lhdcv3_sink_decoder_interface(void) {
+  return &a2dp_decoder_interface_lhdcv3;
+}
+
+size_t A2DP_VendorDecodePacketsLhdcV3Sink(BT_HDR* const* pp_bufs, size_t count) {
+  return a2dp_lhdcv3_sink_decode_packets(&a2dp_lhdcv3_sink_cb, pp_bufs, count);
+}
+
+void A2DP_VendorSetOutputPeriodLhdcV3Sink(uint32_t period_frames) {
+  a2dp_lhdcv3_sink_cb.period_frames.store(period_frames, std::memory_order_relaxed);
+}
+
+void A2DP_VendorSetOutputGainLhdcV3Sink(float gain) {
+  gain = (gain > 0.0f) ? std::min(gain, 1.0f) : 0.0f;
+  a2dp_lhdcv3_sink_cb.gain.store(gain, std::memory_order_relaxed);
+}
+
+void A2DP_VendorSetDelayReportCallbackLhdcV3Sink(tA2DP_LHDCV3_SINK_DELAY_CBACK p_cback) {
+  a2dp_lhdcv3_sink_delay_cback.store(p_cback, std::memory_order_release);
+}
+
+void A2DP_VendorSetOutputLatencyLhdcV3Sink(uint32_t latency_us) {
+  a2dp_lhdcv3_sink_cb.output_latency_us.store(latency_us, std::memory_order_relaxed);
+}
+
+bool A2DP_VendorGetDelayLhdcV3Sink(uint32_t* p_delay_us) {
+  *p_delay_us = a2dp_lhdcv3_sink_cb.delay.delay_us.load(std::memory_order_relaxed);
+  return *p_delay_us != 0;
+}
+
+static void a2dp_lhdcv3_sink_hist_summary(
+    const tA2DP_LHDCV3_SINK_HIST* p_hist,
+    tA2DP_LHDCV3_SINK_HIST_SUMMARY* p_summary) {
+  p_summary->p50 = a2dp_lhdcv3_sink_hist_percentile(p_hist, 500);
+  p_summary->p90 = a2dp_lhdcv3_sink_hist_percentile(p_hist, 900);
+  p_summary->p99 = a2dp_lhdcv3_sink_hist_percentile(p_hist, 990);
+  p_summary->max = p_hist->max.load(std::memory_order_relaxed);
+}
+
+static void a2dp_lhdcv3_sink_stats_snapshot(
+    const tA2DP_LHDCV3_SINK_CB* p_cb,
+    tA2DP_LHDCV3_SINK_STATS_SNAPSHOT* p_snapshot) {
+  const tA2DP_LHDCV3_SINK_STATS* p_stats = &p_cb->stats;
+  auto load = [](const std::atomic<uint32_t>& counter) {
+    return counter.load(std::memory_order_relaxed);
+  };
+  p_snapshot->packets_received = load(p_stats->packets_received);
+  p_snapshot->packets_dropped = load(p_stats->packets_dropped);
+  p_snapshot->heap_fallbacks = load(p_stats->heap_fallbacks);
+  p_snapshot->packets_decoded = load(p_stats->packets_decoded);
+  p_snapshot->decode_errors = load(p_stats->decode_errors);
+  p_snapshot->packets_lost = load(p_stats->packets_lost);
+  p_snapshot->packets_late = load(p_stats->packets_late);
+  p_snapshot->underruns = load(p_stats->underruns);
+  p_snapshot->concealed_frames = load(p_stats->concealed_frames);
+  p_snapshot->handback_waits = load(p_stats->handback_waits);
+  p_snapshot->first_pcm_cold_us = load(p_stats->first_pcm_cold_us);
+  p_snapshot->first_pcm_warm_us = load(p_stats->first_pcm_warm_us);
+  p_snapshot->wakeups = load(p_stats->wakeups);
+  p_snapshot->pcm_callbacks = load(p_stats->pcm_callbacks);
+  p_snapshot->decode_cpu_us = load(p_stats->decode_cpu_us);
+  p_snapshot->delay_us = load(p_cb->delay.delay_us);
+  a2dp_lhdcv3_sink_hist_summary(&p_stats->decode_us, &p_snapshot->decode_us);
+  a2dp_lhdcv3_sink_hist_summary(&p_stats->jitter_us, &p_snapshot->jitter_us);
+  a2dp_lhdcv3_sink_hist_summary(&p_stats->depth, &p_snapshot->depth);
+  a2dp_lhdcv3_sink_hist_summary(&p_stats->held_us, &p_snapshot->held_us);
+}
+
+void A2DP_VendorGetStreamStatsLhdcV3Sink(tA2DP_LHDCV3_SINK_STATS_SNAPSHOT* p_snapshot) {
+  a2dp_lhdcv3_sink_stats_snapshot(&a2dp_lhdcv3_sink_cb, p_snapshot);
+}
+
+// Appends the instrumentation of the stream to the codec info string |p_res|
+// if it runs the configuration |p_codec_info|.
+static void a2dp_lhdcv3_sink_append_stats(std::stringstream* p_res,
+                                          const uint8_t* p_codec_info) {
+  uint32_t config_hash =
+      a2dp_lhdcv3_sink_hash(p_codec_info, A2DP_LHDCV3_CODEC_LEN + 1);
+
+  const tA2DP_LHDCV3_SINK_CB* p_cb = &a2dp_lhdcv3_sink_cb;
+  if (p_cb->stats.config_hash.load(std::memory_order_relaxed) != config_hash)
+    return;
+  tA2DP_LHDCV3_SINK_STATS_SNAPSHOT snapshot;
+  a2dp_lhdcv3_sink_stats_snapshot(p_cb, &snapshot);
+  *p_res << "\tstream:\n"
+         << "\t  packets: " << snapshot.packets_received << " received, "
+         << snapshot.packets_decoded << " decoded, "
+         << snapshot.packets_dropped << " dropped, "
+         << snapshot.decode_errors << " errors, " << snapshot.packets_lost
+         << " lost, " << snapshot.packets_late << " late\n"
+         << "\t  heap fallbacks: " << snapshot.heap_fallbacks << "\n"
+         << "\t  underruns: " << snapshot.underruns
+         << ", concealed frames: " << snapshot.concealed_frames
+         << ", hand-back waits: " << snapshot.handback_waits << "\n"
+         << "\t  first PCM: cold " << snapshot.first_pcm_cold_us << " us, warm "
+         << snapshot.first_pcm_warm_us << " us\n"
+         << "\t  wakeups: " << snapshot.wakeups
+         << ", PCM callbacks: " << snapshot.pcm_callbacks << "\n"
+         << "\t  presentation delay: " << snapshot.delay_us << " us\n";
+  const struct {
+    const char* name;
+    const tA2DP_LHDCV3_SINK_HIST_SUMMARY& summary;
+  } hists[] = {{"decode us", snapshot.decode_us},
+               {"jitter us", snapshot.jitter_us},
+               {"ring depth", snapshot.depth},
+               {"held us", snapshot.held_us}};
+  for (const auto& hist : hists) {
+    *p_res << "\t  " << hist.name << " p50/p90/p99/max: " << hist.summary.p50
+           << "/" << hist.summary.p90 << "/" << hist.summary.p99 << "/"
+           << hist.summary.max << "\n";
+  }
+}
+
+bool A2DP_VendorExportSpansLhdcV3Sink(const char* path) {
+#if defined(A2DP_LHDCV3_SINK_SPANS)
+  FILE* fp = fopen(path, "w");
+  if (fp == NULL) {
+    LOG_ERROR("%s: cannot open %s: %s", __func__, path, strerror(errno));
+    return false;
+  }
+
+  std::vector<tA2DP_LHDCV3_SINK_SPAN_RECORD> records;
+  {
+    std::lock_guard<std::mutex> lock(a2dp_lhdcv3_sink_span_mutex);
+    for (const tA2DP_LHDCV3_SINK_SPAN_RING* p_ring : a2dp_lhdcv3_sink_span_rings) {
+      uint64_t head = p_ring->head.load(std::memory_order_acquire);
+      uint64_t first = head > A2DP_LHDCV3_SINK_SPAN_RING_SIZE
+                           ? head - A2DP_LHDCV3_SINK_SPAN_RING_SIZE
+                           : 0;
+      // The owner may keep writing meanwhile: spans it overwrote are skipped
+      tA2DP_LHDCV3_SINK_SPAN_RECORD record;
+      for (uint64_t i = first; i < head; i++) {
+        if (a2dp_lhdcv3_sink_span_read(p_ring, i, &record)) {
+          records.push_back(record);
+        }
+      }
+    }
+  }
+
+  int pid = getpid();
+  fprintf(fp, "{\"traceEvents\":[\n");
+  for (size_t i = 0; i < records.size(); i++) {
+    const tA2DP_LHDCV3_SINK_SPAN_RECORD& record = records[i];
+    fprintf(fp,
+            "{\"name\":\"%s\",\"cat\":\"lhdcv3_sink\",\"ph\":\"X\","
+            "\"ts\":%" PRIu64 ",\"dur\":%u,\"pid\":%d,\"tid\":%d,"
+            "\"args\":{\"arg\":%u}}%s\n",
+            record.name, record.begin_us, record.dur_us, pid, (int)record.tid,
+            record.arg, i + 1 < records.size() ? "," : "");
+  }
+  fprintf(fp, "],\"displayTimeUnit\":\"ms\"}\n");
+
+  bool ok = !ferror(fp);
+  if (fclose(fp) != 0) ok = false;
+  LOG_INFO("%s: %zu spans to %s", __func__, records.size(), path);
+  return ok;
+#else
+  (void)path;
+  LOG_WARN("%s: built without A2DP_LHDCV3_SINK_SPANS", __func__);
+  return false;
+#endif
+}
+
+// Queues the |count| packets of |pp_bufs| for replay. Faster than real time,
+// waits for room rather than drop, handing back PCM meanwhile as the stack
+// would.
+static size_t a2dp_lhdcv3_sink_replay_feed(tA2DP_LHDCV3_SINK_CB* p_cb,
+                                           BT_HDR* const* pp_bufs,
+                                           size_t count, bool real_time) {
+  while (!real_time &&
+         p_cb->ring.Size() + count > A2DP_LHDCV3_SINK_PACKET_ENTRIES) {
+    a2dp_lhdcv3_sink_handback_drain(p_cb);
+    sched_yield();
+  }
+  return a2dp_lhdcv3_sink_decode_packets(p_cb, pp_bufs, count);
+}
+
+bool A2DP_VendorReplayTraceLhdcV3Sink(const char* path, bool real_time,
+                                      size_t batch,
+                                      decoded_data_callback_t decode_callback,
+                                      tA2DP_LHDCV3_SINK_REPLAY_STATS* p_stats) {
+  tA2DP_LHDCV3_SINK_CB* p_cb = &a2dp_lhdcv3_sink_cb;
+  tA2DP_LHDCV3_SINK_REPLAY replay;
+  const tA2DP_DECODER_INTERFACE* p_interface = NULL;
+  const tA2DP_LHDCV3_SINK_TRACE_HEADER* p_header;
+  std::vector<std::vector<uint8_t>> packets;
+  std::vector<BT_HDR*> p_bufs;
+  uint64_t start_us, base_us;
+  size_t pos, count;
+  bool result = false;
+  void* map = MAP_FAILED;
+  size_t size = 0;
+
+  *p_stats = {};
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    LOG_ERROR("%s: cannot open %s: %s", __func__, path, strerror(errno));
+    return false;
+  }
+  off_t end = lseek(fd, 0, SEEK_END);
+  if (end < (off_t)sizeof(tA2DP_LHDCV3_SINK_TRACE_HEADER)) goto fail;
+  size = (size_t)end;
+  map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED) goto fail;
+  p_header = (const tA2DP_LHDCV3_SINK_TRACE_HEADER*)map;
+  if (memcmp(p_header->magic, A2DP_LHDCV3_SINK_TRACE_MAGIC,
+             sizeof(p_header->magic)) != 0) {
+    LOG_ERROR("%s: %s is not a trace", __func__, path);
+    goto fail;
+  }
+  if (!a2dp_lhdcv3_sink_library_wait_loaded()) goto fail;
+  a2dp_lhdcv3_sink_read_output_bits();
+
+  // Count the packets, to size the latency samples up front
+  count = 0;
+  for (pos = sizeof(*p_header);
+       pos + sizeof(tA2DP_LHDCV3_SINK_TRACE_RECORD) <= size;) {
+    tA2DP_LHDCV3_SINK_TRACE_RECORD record;
+    memcpy(&record, (const uint8_t*)map + pos, sizeof(record));
+    if (record.type == A2DP_LHDCV3_SINK_TRACE_PACKET) count++;
+    pos += sizeof(record) + record.len;
+  }
+  replay.latency_us.resize(count);
+  replay.count = 0;
+  batch = std::min<size_t>(std::max<size_t>(batch, 1), A2DP_LHDCV3_SINK_PACKET_ENTRIES);
+  packets.resize(batch);
+
+  if (p_cb->decode_thread.joinable()) {
+    LOG_ERROR("%s: a stream is being decoded", __func__);
+    goto fail;
+  }
+  p_cb->replay = &replay;
+  p_interface = a2dp_lhdcv3_sink_decoder_interface();
+  if (!p_interface->decoder_init(decode_callback)) goto fail;
+  p_interface->decoder_configure(p_header->codec_info);
+  p_interface->decoder_start();
+
+  start_us = time_get_os_boottime_us();
+  base_us = 0;
+  for (pos = sizeof(*p_header);
+       pos + sizeof(tA2DP_LHDCV3_SINK_TRACE_RECORD) <= size;) {
+    tA2DP_LHDCV3_SINK_TRACE_RECORD record;
+    memcpy(&record, (const uint8_t*)map + pos, sizeof(record));
+    const uint8_t* p_data = (const uint8_t*)map + pos + sizeof(record);
+    pos += sizeof(record) + record.len;
+    if (pos > size) break;
+
+    base_us += record.delta_us;
+    if (real_time) {
+      uint64_t now_us = time_get_os_boottime_us();
+      if (now_us < start_us + base_us) {
+        std::this_thread::sleep_for(
+            std::chrono::microseconds(start_us + base_us - now_us));
+      }
+    }
+
+    if (record.type == A2DP_LHDCV3_SINK_TRACE_CONFIG) {
+      // Packets before the new configuration go out under the old one
+      p_stats->packets += a2dp_lhdcv3_sink_replay_feed(
+          p_cb, p_bufs.data(), p_bufs.size(), real_time);
+      p_bufs.clear();
+      if (record.len == AVDT_CODEC_SIZE) p_interface->decoder_configure(p_data);
+      continue;
+    }
+    if (record.type != A2DP_LHDCV3_SINK_TRACE_PACKET || record.offset > record.len)
+      continue;
+    std::vector<uint8_t>& packet = packets[p_bufs.size()];
+    packet.resize(BT_HDR_SIZE + record.len);
+    BT_HDR* p_buf = (BT_HDR*)packet.data();
+    p_buf->event = 0;
+    p_buf->offset = record.offset;
+    p_buf->len = record.len - record.offset;
+    p_buf->layer_specific = record.layer_specific;
+    memcpy(p_buf + 1, p_data, record.len);
+    p_bufs.push_back(p_buf);
+    if (p_bufs.size() == batch) {
+      p_stats->packets += a2dp_lhdcv3_sink_replay_feed(
+          p_cb, p_bufs.data(), p_bufs.size(), real_time);
+      p_bufs.clear();
+    }
+  }
+  p_stats->packets += a2dp_lhdcv3_sink_replay_feed(p_cb, p_bufs.data(),
+                                                   p_bufs.size(), real_time);
+  while (replay.count.load(std::memory_order_acquire) < p_stats->packets) {
+    a2dp_lhdcv3_sink_handback_drain(p_cb);
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  a2dp_lhdcv3_sink_handback_drain(p_cb);
+  p_stats->elapsed_us = time_get_os_boottime_us() - start_us;
+  p_interface->decoder_cleanup();
+  p_stats->wakeups = p_cb->stats.wakeups.load(std::memory_order_relaxed);
+  p_stats->pcm_callbacks = p_cb->stats.pcm_callbacks.load(std::memory_order_relaxed);
+  p_stats->decode_cpu_us = p_cb->stats.decode_cpu_us.load(std::memory_order_relaxed);
+  p_stats->delay_us = p_cb->delay.delay_us.load(std::memory_order_relaxed);
+
+  p_stats->decoded = (uint32_t)replay.count.load(std::memory_order_acquire);
+  if (p_stats->elapsed_us != 0) {
+    p_stats->packets_per_sec = p_stats->decoded * 1e6 / p_stats->elapsed_us;
+  }
+  if (p_stats->decoded != 0) {
+    std::vector<uint32_t>& latency_us = replay.latency_us;
+    latency_us.resize(p_stats->decoded);
+    std::sort(latency_us.begin(), latency_us.end());
+    p_stats->latency_p50_us = latency_us[latency_us.size() * 50 / 100];
+    p_stats->latency_p90_us = latency_us[latency_us.size() * 90 / 100];
+    p_stats->latency_p99_us = latency_us[latency_us.size() * 99 / 100];
+    p_stats->latency_max_us = latency_us.back();
+  }
+  LOG_INFO("%s: %u packets in %" PRIu64 " us, %.0f packets/s, latency p50 %u p90 %u "
+           "p99 %u max %u us, %u wakeups, %u PCM callbacks, %u us CPU, "
+           "delay %u us",
+           __func__, p_stats->decoded, p_stats->elapsed_us,
+           p_stats->packets_per_sec, p_stats->latency_p50_us,
+           p_stats->latency_p90_us, p_stats->latency_p99_us,
+           p_stats->latency_max_us, p_stats->wakeups, p_stats->pcm_callbacks,
+           p_stats->decode_cpu_us, p_stats->delay_us);
+  result = true;
+
+fail:
+  if (p_interface != NULL) {
+    if (!result) p_interface->decoder_cleanup();
+    p_cb->replay = NULL;
+  }
+  if (map != MAP_FAILED) munmap(map, size);
+  close(fd);
+  return result;
+}
+
+A2dpCodecConfigLhdcV3Sink::A2dpCodecConfigLhdcV3Sink(
+    btav_a2dp_codec_priority_t codec_priority)
+    : A2dpCodecConfigLhdcV3Base(BTAV_A2DP_CODEC_INDEX_SINK_LHDCV3,
+                             A2DP_VendorCodecIndexStrLhdcV3Sink(), codec_priority,
+                             false) {
+  // Get the decoder library ready by the time the first stream comes up
+  a2dp_lhdcv3_sink_library_preload();
+}
+
+A2dpCodecConfigLhdcV3Sink::~A2dpCodecConfigLhdcV3Sink() {}
+
+bool A2dpCodecConfigLhdcV3Sink::init() {
+  A2DP_LHDCV3_SINK_SPAN("codec_init");
+  if (!isValid()) return false;
+
+  a2dp_lhdcv3_sink_read_output_bits();
+
+  // Wait for the decoder library loaded in the background
+  if (!a2dp_lhdcv3_sink_library_wait_loaded()) {
+    LOG_ERROR("%s: cannot load the decoder", __func__);
+    return false;
+  }
+
+  return true;
+}
+
+bool A2dpCodecConfigLhdcV3Sink::useRtpHeaderMarkerBit() const {
+  // TODO: This method applies only to Source codecs
+  return false;
+}
+
+bool A2dpCodecConfigLhdcV3Sink::updateEncoderUserConfig(
+    UNUSED_ATTR const tA2DP_ENCODER_INIT_PEER_PARAMS* p_peer_params,
+    UNUSED_ATTR bool* p_restart_input, UNUSED_ATTR bool* p_restart_output,
+    UNUSED_ATTR bool* p_config_updated) {
+  // TODO: This method applies only to Source codecs
+  return false;
+}
+
+uint64_t A2dpCodecConfigLhdcV3Sink::encoderIntervalMs() const {
+  // TODO: This method applies only to Source codecs
+  return 0;
+}
+
+int A2dpCodecConfigLhdcV3Sink::getEffectiveMtu() const {
+  // TODO: This method applies only to Source codecs
+  return 0;
+}
+
+
+// Scores the single-valued configuration |ie| against |budget|. Within the
+// budget, the latency preference comes first, then sample rate, bit depth and
+// bitrate. Configurations over the budget score negative, cheapest highest,
+// so that one is still picked when nothing fits.
+static int A2DP_ScoreConfigLhdcV3Sink(const tA2DP_LHDCV3_SINK_CIE& ie,
+                                      const tA2DP_LHDCV3_SINK_BUDGET& budget) {
+  int rate_rank = 0;
+  uint32_t sample_rate = 44100;
+  if (ie.sampleRate & A2DP_LHDC_SAMPLING_FREQ_48000) rate_rank = 1, sample_rate = 48000;
+  if (ie.sampleRate & A2DP_LHDC_SAMPLING_FREQ_88200) rate_rank = 2, sample_rate = 88200;
+  if (ie.sampleRate & A2DP_LHDC_SAMPLING_FREQ_96000) rate_rank = 3, sample_rate = 96000;
+  bool is_24 = (ie.bits_per_sample & BTAV_A2DP_CODEC_BITS_PER_SAMPLE_24) != 0;
+  uint32_t channels = (ie.channelSplitMode & A2DP_LHDC_CH_SPLIT_TWS) ? 1 : 2;
+  uint32_t pcm_bytes_per_sec = sample_rate * channels * (is_24 ? 3 : 2);
+  uint32_t bitrate_bps = a2dp_lhdcv3_sink_max_bitrate_bps(ie.maxTargetBitrate);
+
+  if ((budget.max_pcm_bytes_per_sec != 0 &&
+       pcm_bytes_per_sec > budget.max_pcm_bytes_per_sec) ||
+      (budget.max_bitrate_bps != 0 && bitrate_bps > budget.max_bitrate_bps)) {
+    return -(int)(pcm_bytes_per_sec / 1000 + bitrate_bps / 1000) - 1;
+  }
+
+  int score = 0;
+  if (ie.isLLSupported == budget.low_latency) score += 10000;
+  score += rate_rank * 1000;
+  if (is_24) score += 500;
+  score += bitrate_bps / 10000;
+  return score;
+}
+
+// Maps a user-selected sample rate to the LHDC sampling frequency bit.
+static uint8_t A2DP_UserSampleRateLhdcV3Sink(btav_a2dp_codec_sample_rate_t sample_rate) {
+  switch (sample_rate) {
+    case BTAV_A2DP_CODEC_SAMPLE_RATE_44100:
+      return A2DP_LHDC_SAMPLING_FREQ_44100;
+    case BTAV_A2DP_CODEC_SAMPLE_RATE_48000:
+      return A2DP_LHDC_SAMPLING_FREQ_48000;
+    case BTAV_A2DP_CODEC_SAMPLE_RATE_88200:
+      return A2DP_LHDC_SAMPLING_FREQ_88200;
+    case BTAV_A2DP_CODEC_SAMPLE_RATE_96000:
+      return A2DP_LHDC_SAMPLING_FREQ_96000;
+    default:
+      return A2DP_LHDC_SAMPLING_FREQ_MASK;
+  }
+}
+
+// Checks that the configuration |cfg_ie| chosen by the source asks for
+// nothing |local_ie| does not offer: one sample rate and one sample width the
+// sink supports, a split mode, bitrate and low latency mode it allows, and no
+// feature it lacks. Logs the first mismatch and returns false on it.
+static bool A2DP_ConfigFitsLocalCapsLhdcV3Sink(
+    const tA2DP_LHDCV3_SINK_CIE& local_ie, const tA2DP_LHDCV3_SINK_CIE& cfg_ie) {
+  tA2DP_STATUS status = A2DP_CieMatchesCapabilityLhdcV3Sink(local_ie, cfg_ie);
+  if (status != A2DP_SUCCESS) {
+    LOG_ERROR("%s: configuration outside the local capabilities: %d", __func__,
+              status);
+    return false;
+  }
+  if (A2DP_BitsSet(cfg_ie.sampleRate) != A2DP_SET_ONE_BIT ||
+      A2DP_BitsSet(static_cast<int>(cfg_ie.bits_per_sample)) != A2DP_SET_ONE_BIT) {
+    LOG_ERROR("%s: configuration picks no single format: rate 0x%x bits 0x%x",
+              __func__, cfg_ie.sampleRate,
+              static_cast<int>(cfg_ie.bits_per_sample));
+    return false;
+  }
+  if (a2dp_lhdcv3_sink_max_bitrate_bps(cfg_ie.maxTargetBitrate) >
+      a2dp_lhdcv3_sink_max_bitrate_bps(local_ie.maxTargetBitrate)) {
+    LOG_ERROR("%s: bitrate 0x%x above the local maximum 0x%x", __func__,
+              cfg_ie.maxTargetBitrate, local_ie.maxTargetBitrate);
+    return false;
+  }
+  if ((cfg_ie.isLLSupported && !local_ie.isLLSupported) ||
+      (cfg_ie.hasFeatureJAS && !local_ie.hasFeatureJAS) ||
+      (cfg_ie.hasFeatureAR && !local_ie.hasFeatureAR) ||
+      (cfg_ie.hasFeatureLLAC && !local_ie.hasFeatureLLAC) ||
+      (cfg_ie.hasFeatureMETA && !local_ie.hasFeatureMETA) ||
+      (cfg_ie.hasFeatureMinBitrate && !local_ie.hasFeatureMinBitrate) ||
+      (cfg_ie.hasFeatureLARC && !local_ie.hasFeatureLARC) ||
+      (cfg_ie.hasFeatureLHDCV4 && !local_ie.hasFeatureLHDCV4)) {
+    LOG_ERROR("%s: configuration enables a feature the sink lacks", __func__);
+    return false;
+  }
+  return true;
+}
+
+// Selects the best configuration that both |local_ie| and |peer_ie| allow and
+// stores it in |p_result|. If |is_capability| is false, |peer_ie| is a
+// configuration chosen by the source: it is rejected unless it fits the local
+// capabilities, and then taken as it is. Otherwise candidates are narrowed by
+// |user_config| and scored against |budget|. Returns false if there is no
+// common configuration.
+static bool A2DP_SelectConfigLhdcV3Sink(const tA2DP_LHDCV3_SINK_CIE& local_ie,
+                                        const tA2DP_LHDCV3_SINK_CIE& peer_ie,
+                                        bool is_capability,
+                                        const btav_a2dp_codec_config_t& user_config,
+                                        const tA2DP_LHDCV3_SINK_BUDGET& budget,
+                                        tA2DP_LHDCV3_SINK_CIE* p_result) {
+  static const uint8_t sample_rates[] = {
+      A2DP_LHDC_SAMPLING_FREQ_44100, A2DP_LHDC_SAMPLING_FREQ_48000,
+      A2DP_LHDC_SAMPLING_FREQ_88200, A2DP_LHDC_SAMPLING_FREQ_96000};
+  static const btav_a2dp_codec_bits_per_sample_t bits_per_samples[] = {
+      BTAV_A2DP_CODEC_BITS_PER_SAMPLE_16, BTAV_A2DP_CODEC_BITS_PER_SAMPLE_24};
+  static const uint8_t bitrates[] = {A2DP_LHDC_MAX_BIT_RATE_400K,
+                                     A2DP_LHDC_MAX_BIT_RATE_500K,
+                                     A2DP_LHDC_MAX_BIT_RATE_900K};
+
+  if (!is_capability && !A2DP_ConfigFitsLocalCapsLhdcV3Sink(local_ie, peer_ie)) {
+    return false;
+  }
+
+  uint8_t sample_rate = local_ie.sampleRate & peer_ie.sampleRate;
+  int bits_per_sample = static_cast<int>(local_ie.bits_per_sample) &
+                        static_cast<int>(peer_ie.bits_per_sample);
+  // Sources that leave the split mode empty mean no split
+  uint8_t split = local_ie.channelSplitMode &
+                  (peer_ie.channelSplitMode != 0 ? peer_ie.channelSplitMode
+                                                 : A2DP_LHDC_CH_SPLIT_NONE);
+  uint32_t max_bitrate_bps =
+      std::min(a2dp_lhdcv3_sink_max_bitrate_bps(local_ie.maxTargetBitrate),
+               a2dp_lhdcv3_sink_max_bitrate_bps(peer_ie.maxTargetBitrate));
+  bool low_latency = local_ie.isLLSupported && peer_ie.isLLSupported;
+
+  if (is_capability) {
+    sample_rate &= A2DP_UserSampleRateLhdcV3Sink(
+        static_cast<btav_a2dp_codec_sample_rate_t>(user_config.sample_rate));
+    if (user_config.bits_per_sample != BTAV_A2DP_CODEC_BITS_PER_SAMPLE_NONE &&
+        (bits_per_sample & static_cast<int>(user_config.bits_per_sample)) != 0) {
+      bits_per_sample &= static_cast<int>(user_config.bits_per_sample);
+    }
+  }
+  if (sample_rate == 0 || bits_per_sample == 0 || split == 0) return false;
+
+  // Only the capabilities of an earbud allow the TWS split, and an earbud
+  // takes it whenever the source offers it
+  uint8_t split_mode = (split & A2DP_LHDC_CH_SPLIT_TWS) ? A2DP_LHDC_CH_SPLIT_TWS
+                                                        : A2DP_LHDC_CH_SPLIT_NONE;
+
+  tA2DP_LHDCV3_SINK_CIE candidate = {};
+  candidate.vendorId = local_ie.vendorId;
+  candidate.codecId = local_ie.codecId;
+  candidate.version = local_ie.version;
+  candidate.channelSplitMode = split_mode;
+  candidate.hasFeatureJAS = local_ie.hasFeatureJAS && peer_ie.hasFeatureJAS;
+  candidate.hasFeatureAR = local_ie.hasFeatureAR && peer_ie.hasFeatureAR;
+  candidate.hasFeatureLLAC = local_ie.hasFeatureLLAC && peer_ie.hasFeatureLLAC;
+  candidate.hasFeatureMETA = local_ie.hasFeatureMETA && peer_ie.hasFeatureMETA;
+  candidate.hasFeatureMinBitrate =
+      local_ie.hasFeatureMinBitrate && peer_ie.hasFeatureMinBitrate;
+  candidate.hasFeatureLARC = local_ie.hasFeatureLARC && peer_ie.hasFeatureLARC;
+  candidate.hasFeatureLHDCV4 = local_ie.hasFeatureLHDCV4 && peer_ie.hasFeatureLHDCV4;
+
+  bool found = false;
+  int best_score = 0;
+  for (uint8_t rate : sample_rates) {
+    if (!(sample_rate & rate)) continue;
+    for (btav_a2dp_codec_bits_per_sample_t bits : bits_per_samples) {
+      if (!(bits_per_sample & static_cast<int>(bits))) continue;
+      for (uint8_t bitrate : bitrates) {
+        if (is_capability ? a2dp_lhdcv3_sink_max_bitrate_bps(bitrate) > max_bitrate_bps
+                          : bitrate != peer_ie.maxTargetBitrate)
+          continue;
+        for (int ll = 0; ll < 2; ll++) {
+          if (is_capability ? (ll && !low_latency)
+                            : (ll != 0) != peer_ie.isLLSupported)
+            continue;
+          candidate.sampleRate = rate;
+          candidate.bits_per_sample = bits;
+          candidate.maxTargetBitrate = bitrate;
+          candidate.isLLSupported = ll != 0;
+          int score = A2DP_ScoreConfigLhdcV3Sink(candidate, budget);
+          if (!found || score > best_score) {
+            *p_result = candidate;
+            best_score = score;
+            found = true;
+          }
+        }
+      }
+    }
+  }
+
+  if (found && best_score < 0) {
+    LOG_WARN("%s: no configuration fits the local budget, using the cheapest",
+             __func__);
+  }
+  return found;
+}
+
+// Returns the codec config values for every setting |local_ie| and |peer_ie|
+// have in common.
+static tA2DP_LHDCV3_SINK_CIE A2DP_IntersectCapsLhdcV3Sink(
+    const tA2DP_LHDCV3_SINK_CIE& local_ie, const tA2DP_LHDCV3_SINK_CIE& peer_ie) {
+  tA2DP_LHDCV3_SINK_CIE common_ie = local_ie;
+  common_ie.sampleRate = local_ie.sampleRate & peer_ie.sampleRate;
+  common_ie.bits_per_sample = static_cast<btav_a2dp_codec_bits_per_sample_t>(
+      static_cast<int>(local_ie.bits_per_sample) &
+      static_cast<int>(peer_ie.bits_per_sample));
+  common_ie.channelSplitMode =
+      local_ie.channelSplitMode &
+      (peer_ie.channelSplitMode != 0 ? peer_ie.channelSplitMode
+                                     : A2DP_LHDC_CH_SPLIT_NONE);
+  return common_ie;
+}
+
+// Resets the sample rate, bits per sample and channel mode of |p_config|
+// and fills them in from |ie|. A TWS capable |ie| offers both channel modes.
+static void A2DP_FillCodecConfigLhdcV3Sink(const tA2DP_LHDCV3_SINK_CIE& ie,
+                                           btav_a2dp_codec_config_t* p_config) {
+  p_config->sample_rate = BTAV_A2DP_CODEC_SAMPLE_RATE_NONE;
+  p_config->bits_per_sample = BTAV_A2DP_CODEC_BITS_PER_SAMPLE_NONE;
+  p_config->channel_mode = BTAV_A2DP_CODEC_CHANNEL_MODE_NONE;
+  build_codec_config(ie, p_config);
+  if (ie.channelSplitMode & A2DP_LHDC_CH_SPLIT_NONE)
+    p_config->channel_mode |= BTAV_A2DP_CODEC_CHANNEL_MODE_STEREO;
+}
+
+bool A2dpCodecConfigLhdcV3Base::setCodecConfig(const uint8_t* p_peer_codec_info, bool is_capability,
+                      uint8_t* p_result_codec_config) {
+  A2DP_LHDCV3_SINK_SPAN("set_codec_config", is_capability);
+  std::lock_guard<std::recursive_mutex> lock(codec_mutex_);
+  tA2DP_LHDCV3_SINK_CIE peer_info_cie;
+  tA2DP_LHDCV3_SINK_CIE result_config_cie;
+  tA2DP_LHDCV3_SINK_BUDGET budget = A2DP_GetBudgetLhdcV3Sink();
+  const tA2DP_LHDCV3_SINK_CIE* p_a2dp_lhdc_caps =
+      &A2DP_LocalCapsLhdcV3Sink(budget.tws);
+  tA2DP_STATUS status;
+
+  is_source_ = false;
+
+  // Save the internal state
+  btav_a2dp_codec_config_t saved_codec_config = codec_config_;
+  btav_a2dp_codec_config_t saved_codec_capability = codec_capability_;
+  uint8_t saved_ota_codec_config[AVDT_CODEC_SIZE];
+  uint8_t saved_ota_codec_peer_capability[AVDT_CODEC_SIZE];
+  uint8_t saved_ota_codec_peer_config[AVDT_CODEC_SIZE];
+  memcpy(saved_ota_codec_config, ota_codec_config_, sizeof(ota_codec_config_));
+  memcpy(saved_ota_codec_peer_capability, ota_codec_peer_capability_,
+         sizeof(ota_codec_peer_capability_));
+  memcpy(saved_ota_codec_peer_config, ota_codec_peer_config_,
+         sizeof(ota_codec_peer_config_));
+
+  status = A2DP_ParseInfoLhdcV3Sink(&peer_info_cie, p_peer_codec_info, is_capability);
+  if (status != A2DP_SUCCESS) {
+    LOG_ERROR("%s: can't parse peer's capabilities: error = %d", __func__,
+              status);
+    goto fail;
+  }
+
+  // Try using the prefered peer codec config (if valid), instead of the peer
+  // capability.
+  if (is_capability && A2DP_IsVendorPeerSourceCodecValidLhdcV3(ota_codec_peer_config_)) {
+    tA2DP_LHDCV3_SINK_CIE peer_config_cie;
+    if (A2DP_ParseInfoLhdcV3Sink(&peer_config_cie, ota_codec_peer_config_, false) ==
+            A2DP_SUCCESS &&
+        A2DP_CieMatchesCapabilityLhdcV3Sink(peer_info_cie, peer_config_cie) ==
+            A2DP_SUCCESS) {
+      peer_info_cie = peer_config_cie;
+    }
+  }
+
+  if (!A2DP_SelectConfigLhdcV3Sink(*p_a2dp_lhdc_caps, peer_info_cie, is_capability,
+                                   codec_user_config_, budget, &result_config_cie)) {
+    LOG_ERROR("%s: no common configuration with the peer", __func__);
+    goto fail;
+  }
+  LOG_INFO("%s: selected rate 0x%x bits 0x%x bitrate 0x%x LL %d split 0x%x",
+           __func__, result_config_cie.sampleRate,
+           static_cast<int>(result_config_cie.bits_per_sample),
+           result_config_cie.maxTargetBitrate, result_config_cie.isLLSupported,
+           result_config_cie.channelSplitMode);
+
+  A2DP_FillCodecConfigLhdcV3Sink(
+      A2DP_IntersectCapsLhdcV3Sink(*p_a2dp_lhdc_caps, peer_info_cie),
+      &codec_capability_);
+  A2DP_FillCodecConfigLhdcV3Sink(result_config_cie, &codec_config_);
+
+  if (A2DP_BuildInfoLhdcV3Sink(AVDT_MEDIA_TYPE_AUDIO, &result_config_cie,
+                               p_result_codec_config) != A2DP_SUCCESS) {
+    goto fail;
+  }
+
+  // Create a local copy of the peer codec capability/config, and the
+  // result codec config.
+  if (is_capability) {
+    status = A2DP_BuildInfoLhdcV3Sink(AVDT_MEDIA_TYPE_AUDIO, &peer_info_cie,
+                                      ota_codec_peer_capability_);
+  } else {
+    status = A2DP_BuildInfoLhdcV3Sink(AVDT_MEDIA_TYPE_AUDIO, &peer_info_cie,
+                                      ota_codec_peer_config_);
+  }
+  CHECK(status == A2DP_SUCCESS);
+  status = A2DP_BuildInfoLhdcV3Sink(AVDT_MEDIA_TYPE_AUDIO, &result_config_cie,
+                                    ota_codec_config_);
+  CHECK(status == A2DP_SUCCESS);
+  return true;
+
+fail:
+  // Restore the internal state
+  codec_config_ = saved_codec_config;
+  codec_capability_ = saved_codec_capability;
+  memcpy(ota_codec_config_, saved_ota_codec_config, sizeof(ota_codec_config_));
+  memcpy(ota_codec_peer_capability_, saved_ota_codec_peer_capability,
+         sizeof(ota_codec_peer_capability_));
+  memcpy(ota_codec_peer_config_, saved_ota_codec_peer_config,
+         sizeof(ota_codec_peer_config_));
+  return false;
+}
+
+bool A2dpCodecConfigLhdcV3Base::setPeerCodecCapabilities(
+      const uint8_t* p_peer_codec_capabilities) {
+  A2DP_LHDCV3_SINK_SPAN("set_peer_codec_capabilities");
+  std::lock_guard<std::recursive_mutex> lock(codec_mutex_);
+  std::shared_ptr<const tA2DP_LHDCV3_SINK_CIE> peer_info_cie;
+  const tA2DP_LHDCV3_SINK_CIE* p_a2dp_lhdc_caps =
+      &A2DP_LocalCapsLhdcV3Sink(A2DP_IsEarbudLhdcV3Sink());
+
+  is_source_ = false;
+
+  // Save the internal state
+  btav_a2dp_codec_config_t saved_codec_selectable_capability =
+      codec_selectable_capability_;
+  uint8_t saved_ota_codec_peer_capability[AVDT_CODEC_SIZE];
+  memcpy(saved_ota_codec_peer_capability, ota_codec_peer_capability_,
+         sizeof(ota_codec_peer_capability_));
+
+  tA2DP_STATUS status =
+      A2DP_LookupInfoLhdcV3Sink(p_peer_codec_capabilities, true, &peer_info_cie);
+  if (status != A2DP_SUCCESS) {
+    LOG_ERROR("%s: can't parse peer's capabilities: error = %d", __func__,
+              status);
+    goto fail;
+  }
+
+  // Compute the selectable capability
+  A2DP_FillCodecConfigLhdcV3Sink(
+      A2DP_IntersectCapsLhdcV3Sink(*p_a2dp_lhdc_caps, *peer_info_cie),
+      &codec_selectable_capability_);
+
+  status = A2DP_BuildInfoLhdcV3Sink(AVDT_MEDIA_TYPE_AUDIO, peer_info_cie.get(),
+                                    ota_codec_peer_capability_);
+  CHECK(status == A2DP_SUCCESS);
+  return true;
+
+fail:
+  // Restore the internal state
+  codec_selectable_capability_ = saved_codec_selectable_capability;
+  memcpy(ota_codec_peer_capability_, saved_ota_codec_peer_capability,
+         sizeof(ota_codec_peer_capability_));
+  return false;
+}
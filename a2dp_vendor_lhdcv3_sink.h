@@ -0,0 +1,149 @@
+/******************************************************************************
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at:
+ *
+ *  http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ ******************************************************************************/
+
+//
+// LHDC V3 sink decode pipeline: the entry points beyond the decoder interface
+// for the stack, the audio HAL glue and offline tools.
+//
+// The decoder library keeps a single process-wide state, so the pipeline
+// decodes one stream at a time and every entry point below acts on that
+// stream.
+//
+
+#ifndef A2DP_VENDOR_LHDCV3_SINK_H
+#define A2DP_VENDOR_LHDCV3_SINK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "a2dp_vendor.h"
+
+// Called when the presentation delay of the stream has moved, with the AVDTP
+// delay report value in 1/10 milliseconds. It runs on the thread driving the
+// decoder interface, from within its next call.
+typedef void (*tA2DP_LHDCV3_SINK_DELAY_CBACK)(uint16_t delay_1_10_ms);
+
+// Percentiles of one histogram
+typedef struct {
+  uint32_t p50;
+  uint32_t p90;
+  uint32_t p99;
+  uint32_t max;
+} tA2DP_LHDCV3_SINK_HIST_SUMMARY;
+
+// Point-in-time copy of the instrumentation of the stream
+typedef struct {
+  uint32_t packets_received;
+  uint32_t packets_dropped;
+  uint32_t heap_fallbacks;
+  uint32_t packets_decoded;
+  uint32_t decode_errors;
+  uint32_t packets_lost;
+  uint32_t packets_late;
+  uint32_t underruns;
+  uint32_t concealed_frames;
+  uint32_t handback_waits;
+  uint32_t first_pcm_cold_us;
+  uint32_t first_pcm_warm_us;
+  uint32_t wakeups;
+  uint32_t pcm_callbacks;
+  uint32_t decode_cpu_us;
+  uint32_t delay_us;
+  tA2DP_LHDCV3_SINK_HIST_SUMMARY decode_us;
+  tA2DP_LHDCV3_SINK_HIST_SUMMARY jitter_us;
+  tA2DP_LHDCV3_SINK_HIST_SUMMARY depth;
+  tA2DP_LHDCV3_SINK_HIST_SUMMARY held_us;
+} tA2DP_LHDCV3_SINK_STATS_SNAPSHOT;
+
+// Result of replaying a trace
+typedef struct {
+  uint32_t packets;           // Packets fed to the decoder
+  uint32_t decoded;           // Packets decoded
+  uint64_t elapsed_us;        // Wall time of the replay
+  double packets_per_sec;
+  uint32_t latency_p50_us;    // Enqueue to decoded percentiles
+  uint32_t latency_p90_us;
+  uint32_t latency_p99_us;
+  uint32_t latency_max_us;
+  uint32_t wakeups;           // Decode thread wakeups
+  uint32_t pcm_callbacks;     // Calls to |decode_callback|
+  uint32_t decode_cpu_us;     // Decode thread CPU time
+  uint32_t delay_us;          // Final presentation delay estimate
+} tA2DP_LHDCV3_SINK_REPLAY_STATS;
+
+// Local budget that codec negotiation steers toward
+typedef struct {
+  uint32_t max_pcm_bytes_per_sec;  // Decoded PCM the sink can keep up with, 0 if unlimited
+  uint32_t max_bitrate_bps;        // Highest bitrate to ask for, 0 if unlimited
+  bool low_latency;                // Prefer the LL mode when both sides have it
+  bool tws;                        // Sink is one earbud of a TWS pair
+} tA2DP_LHDCV3_SINK_BUDGET;
+
+// Sets the local budget of codec negotiation to |p_budget|. Without it, the
+// budget is read once from the persist.bluetooth.lhdcv3_sink properties.
+void A2DP_VendorSetBudgetLhdcV3Sink(const tA2DP_LHDCV3_SINK_BUDGET* p_budget);
+
+// Returns the container size, 16 or 24, of the PCM handed to the audio track
+// for the configuration |p_codec_info|, or -1 if it is invalid.
+int A2DP_VendorGetTrackBitsPerSampleLhdcV3Sink(const uint8_t* p_codec_info);
+
+// Queues the |count| media packets of |pp_bufs| in one go, for a receive path
+// that gathers packets. Returns the number of packets queued; the rest were
+// dropped.
+size_t A2DP_VendorDecodePacketsLhdcV3Sink(BT_HDR* const* pp_bufs, size_t count);
+
+// Makes the stream hand decoded PCM on in periods of |period_frames| frames,
+// the buffer size of the audio HAL output, instead of per packet. 0 goes back
+// to per packet. A partial period is handed on at suspend and on
+// reconfiguration.
+void A2DP_VendorSetOutputPeriodLhdcV3Sink(uint32_t period_frames);
+
+// Sets the software volume of the stream, as a linear gain from 0 to 1. It is
+// applied in the same pass that converts the decoded PCM to the output format.
+void A2DP_VendorSetOutputGainLhdcV3Sink(float gain);
+
+// Sets the callback that carries the presentation delay of the stream to the
+// source as AVDTP delay reports, or clears it if |p_cback| is NULL.
+void A2DP_VendorSetDelayReportCallbackLhdcV3Sink(tA2DP_LHDCV3_SINK_DELAY_CBACK p_cback);
+
+// Sets the latency of the audio output past the decoded data callback, as
+// reported by the audio HAL. It is part of the presentation delay.
+void A2DP_VendorSetOutputLatencyLhdcV3Sink(uint32_t latency_us);
+
+// Copies the current presentation delay estimate of the stream to
+// |p_delay_us|. Returns false if there is no estimate yet.
+bool A2DP_VendorGetDelayLhdcV3Sink(uint32_t* p_delay_us);
+
+// Copies the instrumentation of the stream to |p_snapshot|.
+void A2DP_VendorGetStreamStatsLhdcV3Sink(tA2DP_LHDCV3_SINK_STATS_SNAPSHOT* p_snapshot);
+
+// Writes the recorded spans of all threads to |path| as Chrome trace event
+// JSON. Returns false if the file cannot be written or spans are compiled out.
+bool A2DP_VendorExportSpansLhdcV3Sink(const char* path);
+
+// Replays the trace at |path| through the stream context, handing the decoded
+// PCM to |decode_callback|. With |real_time| packets are fed at their
+// captured arrival times, otherwise as fast as the pipeline takes them.
+// Packets are queued |batch| at a time, as A2DP_VendorDecodePacketsLhdcV3Sink()
+// does, so that batched and per-packet decoding can be compared on the same
+// trace. The output period comes from persist.bluetooth.lhdcv3_sink.period_frames.
+// Returns false if the trace cannot be read or a stream is being decoded.
+bool A2DP_VendorReplayTraceLhdcV3Sink(const char* path, bool real_time,
+                                      size_t batch,
+                                      decoded_data_callback_t decode_callback,
+                                      tA2DP_LHDCV3_SINK_REPLAY_STATS* p_stats);
+
+#endif  // A2DP_VENDOR_LHDCV3_SINK_H
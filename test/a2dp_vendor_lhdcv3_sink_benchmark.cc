@@ -0,0 +1,284 @@
+/*
+ * Host benchmarks for the LHDC V3 sink codec: codec info handling on the
+ * negotiation path and the decode pipeline fed from the stack's side.
+ */
+
+#include "a2dp_vendor_lhdcv3_dec_AOSP12.cc"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fake_lhdcv3_decoder.h"
+
+static std::string testing_tmp_dir(void) {
+  const char* dir = getenv("TMPDIR");
+  return dir != nullptr ? dir : "/tmp";
+}
+
+static void BM_ParseInfo(benchmark::State& state) {
+  tA2DP_LHDCV3_SINK_CIE cie;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(A2DP_ParseInfoLhdcV3Sink(
+        &cie, a2dp_lhdcv3_sink_default_config_info.data(), false));
+  }
+}
+BENCHMARK(BM_ParseInfo);
+
+static void BM_BuildInfo(benchmark::State& state) {
+  uint8_t codec_info[AVDT_CODEC_SIZE];
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(A2DP_BuildInfoLhdcV3Sink(
+        AVDT_MEDIA_TYPE_AUDIO, &a2dp_lhdcv3_sink_default_config, codec_info));
+    benchmark::ClobberMemory();
+  }
+}
+BENCHMARK(BM_BuildInfo);
+
+static void BM_LookupInfo(benchmark::State& state) {
+  std::shared_ptr<const tA2DP_LHDCV3_SINK_CIE> cie;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(A2DP_LookupInfoLhdcV3Sink(
+        a2dp_lhdcv3_sink_default_config_info.data(), false, &cie));
+  }
+}
+BENCHMARK(BM_LookupInfo);
+
+static void BM_MatchCapability(benchmark::State& state) {
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(A2DP_IsPeerSourceCodecSupportedLhdcV3(
+        a2dp_lhdcv3_sink_caps_info.data()));
+  }
+}
+BENCHMARK(BM_MatchCapability);
+
+// Picks a configuration from the capabilities of a source, with the local
+// budget as negotiation takes it (range(0) 0), or read from the properties
+// each time (range(0) 1), as it used to be.
+static void BM_SelectConfig(benchmark::State& state) {
+  const btav_a2dp_codec_config_t user_config = {};
+  const bool read_properties = state.range(0) != 0;
+  tA2DP_LHDCV3_SINK_CIE result;
+  for (auto _ : state) {
+    tA2DP_LHDCV3_SINK_BUDGET budget = read_properties
+                                          ? A2DP_ReadBudgetLhdcV3Sink()
+                                          : A2DP_GetBudgetLhdcV3Sink();
+    benchmark::DoNotOptimize(A2DP_SelectConfigLhdcV3Sink(
+        a2dp_lhdcv3_sink_caps, a2dp_lhdcv3_sink_earbud_caps, true, user_config,
+        budget, &result));
+  }
+}
+BENCHMARK(BM_SelectConfig)->Arg(0)->Arg(1);
+
+static void BM_CodecInfoString(benchmark::State& state) {
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(A2DP_VendorCodecInfoStringLhdcV3Sink(
+        a2dp_lhdcv3_sink_default_config_info.data()));
+  }
+}
+BENCHMARK(BM_CodecInfoString);
+
+static void BM_NegotiateConfig(benchmark::State& state) {
+  const btav_a2dp_codec_config_t user_config = {};
+  tA2DP_LHDCV3_SINK_BUDGET budget = {};
+  // A budget that rules out the best configuration
+  if (state.range(0)) budget = {48000 * 2 * 2, 500000, true, false};
+  tA2DP_LHDCV3_SINK_CIE result;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(A2DP_SelectConfigLhdcV3Sink(
+        a2dp_lhdcv3_sink_caps, a2dp_lhdcv3_sink_caps, true, user_config, budget,
+        &result));
+  }
+}
+BENCHMARK(BM_NegotiateConfig)->Arg(0)->Arg(1);
+
+static std::atomic<uint64_t> stream_pcm_bytes;
+static void stream_pcm(UNUSED_ATTR uint8_t* buf, uint32_t len) {
+  stream_pcm_bytes.fetch_add(len, std::memory_order_relaxed);
+}
+
+// Queues one packet per iteration through the decoder interface, as the
+// stack's media timer would, and waits at the end until every packet came
+// back as PCM. Reports packets per second.
+static void BM_DecodeStream(benchmark::State& state) {
+  fake_lhdcv3_reset();
+  fake_lhdcv3_frames_per_packet = 256;
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  const tA2DP_DECODER_INTERFACE* p_itf =
+      A2DP_VendorGetDecoderInterfaceLhdcV3(codec_info);
+  stream_pcm_bytes = 0;
+  p_itf->decoder_init(stream_pcm);
+  p_itf->decoder_configure(codec_info);
+  p_itf->decoder_start();
+
+  alignas(BT_HDR) uint8_t raw[BT_HDR_SIZE + 600] = {};
+  BT_HDR* p_buf = (BT_HDR*)raw;
+  p_buf->len = 500;
+  int64_t queued = 0;
+  for (auto _ : state) {
+    if (p_itf->decode_packet(p_buf)) queued++;
+    // Stay below the ring size so no packet is dropped
+    while (queued * 256 * 6 - (int64_t)stream_pcm_bytes.load() > 64 * 256 * 6) {
+      a2dp_lhdcv3_sink_handback_drain(&a2dp_lhdcv3_sink_cb);
+      std::this_thread::yield();
+    }
+  }
+  while ((int64_t)stream_pcm_bytes.load() < queued * 256 * 6) {
+    a2dp_lhdcv3_sink_handback_drain(&a2dp_lhdcv3_sink_cb);
+    std::this_thread::yield();
+  }
+  p_itf->decoder_cleanup();
+  state.SetItemsProcessed(queued);
+}
+BENCHMARK(BM_DecodeStream)->UseRealTime();
+
+// Enqueue times of the packets of BM_MediaTimerTicks, and the enqueue to PCM
+// latency of each, filled in as its PCM is handed back.
+static std::vector<uint64_t> tick_enqueue_us;
+static std::vector<uint32_t> tick_latency_us;
+static void tick_pcm(UNUSED_ATTR uint8_t* buf, UNUSED_ATTR uint32_t len) {
+  size_t i = tick_latency_us.size();
+  if (i < tick_enqueue_us.size()) {
+    tick_latency_us.push_back(
+        (uint32_t)(time_get_os_boottime_us() - tick_enqueue_us[i]));
+  }
+}
+
+// Drives the decoder interface as the stack's media timer does: every
+// range(0) ms, the range(1) packets that arrived since the last tick are
+// queued, and the PCM decoded since then is handed back on that same call.
+// Reports the enqueue to PCM latency percentiles, which take in the prefill
+// at start and the wait for the next tick, and those of the audio held in the
+// sink as packets are released.
+static void BM_MediaTimerTicks(benchmark::State& state) {
+  fake_lhdcv3_reset();
+  fake_lhdcv3_frames_per_packet = 480;
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  const tA2DP_DECODER_INTERFACE* p_itf =
+      A2DP_VendorGetDecoderInterfaceLhdcV3(codec_info);
+  const std::chrono::milliseconds tick(state.range(0));
+  tick_enqueue_us.clear();
+  tick_latency_us.clear();
+  tick_enqueue_us.reserve(state.max_iterations * state.range(1));
+  tick_latency_us.reserve(state.max_iterations * state.range(1));
+  p_itf->decoder_init(tick_pcm);
+  p_itf->decoder_configure(codec_info);
+  p_itf->decoder_start();
+
+  alignas(BT_HDR) uint8_t raw[BT_HDR_SIZE + 600] = {};
+  BT_HDR* p_buf = (BT_HDR*)raw;
+  p_buf->len = 500;
+  auto next_tick = std::chrono::steady_clock::now();
+  for (auto _ : state) {
+    next_tick += tick;
+    std::this_thread::sleep_until(next_tick);
+    for (int64_t i = 0; i < state.range(1); i++) {
+      tick_enqueue_us.push_back(time_get_os_boottime_us());
+      p_itf->decode_packet(p_buf);
+      p_buf->layer_specific++;
+    }
+  }
+  // Keep ticking until the last packets came back
+  for (int i = 0; i < 100 && tick_latency_us.size() < tick_enqueue_us.size(); i++) {
+    next_tick += tick;
+    std::this_thread::sleep_until(next_tick);
+    a2dp_lhdcv3_sink_handback_drain(&a2dp_lhdcv3_sink_cb);
+  }
+  p_itf->decoder_cleanup();
+
+  std::vector<uint32_t>& latency_us = tick_latency_us;
+  std::sort(latency_us.begin(), latency_us.end());
+  state.SetItemsProcessed(latency_us.size());
+  if (!latency_us.empty()) {
+    state.counters["p50_us"] = latency_us[latency_us.size() * 50 / 100];
+    state.counters["p99_us"] = latency_us[latency_us.size() * 99 / 100];
+  }
+  tA2DP_LHDCV3_SINK_STATS_SNAPSHOT snapshot;
+  A2DP_VendorGetStreamStatsLhdcV3Sink(&snapshot);
+  state.counters["held_p50_us"] = snapshot.held_us.p50;
+  state.counters["held_p99_us"] = snapshot.held_us.p99;
+}
+BENCHMARK(BM_MediaTimerTicks)
+    ->Args({20, 2})
+    ->Args({20, 8})
+    ->Iterations(100)
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+// Writes a trace of |count| 10 ms packets as the stack receives them: an RTP
+// header in front of the payload.
+static std::string write_synthetic_trace(size_t count) {
+  std::string path = testing_tmp_dir() + "/lhdcv3_sink_bench.trc";
+  FILE* fp = fopen(path.c_str(), "wb");
+  tA2DP_LHDCV3_SINK_TRACE_HEADER header = {};
+  memcpy(header.magic, A2DP_LHDCV3_SINK_TRACE_MAGIC, sizeof(header.magic));
+  memcpy(header.codec_info, a2dp_lhdcv3_sink_default_config_info.data(),
+         a2dp_lhdcv3_sink_default_config_info.size());
+  fwrite(&header, sizeof(header), 1, fp);
+
+  uint8_t data[12 + 500] = {};
+  for (size_t i = 0; i < count; i++) {
+    uint16_t seq = (uint16_t)i;
+    uint32_t timestamp = (uint32_t)(i * 960);
+    data[0] = 0x80;
+    data[1] = 0x60;
+    data[2] = seq >> 8;
+    data[3] = seq & 0xFF;
+    data[4] = timestamp >> 24;
+    data[5] = (timestamp >> 16) & 0xFF;
+    data[6] = (timestamp >> 8) & 0xFF;
+    data[7] = timestamp & 0xFF;
+    tA2DP_LHDCV3_SINK_TRACE_RECORD record = {};
+    record.delta_us = 10000;
+    record.type = A2DP_LHDCV3_SINK_TRACE_PACKET;
+    record.offset = 12;
+    record.len = sizeof(data);
+    record.layer_specific = seq;
+    fwrite(&record, sizeof(record), 1, fp);
+    fwrite(data, sizeof(data), 1, fp);
+  }
+  fclose(fp);
+  return path;
+}
+
+// Replays a 2000 packet trace as fast as the pipeline takes it, queuing
+// range(0) packets at a time, with HAL periods of range(1) frames (0 hands
+// PCM on per packet). Compares per-packet and batched decoding and reports
+// the enqueue to decoded latency of the last replay.
+static void BM_ReplayTrace(benchmark::State& state) {
+  fake_lhdcv3_reset();
+  fake_lhdcv3_frames_per_packet = 960;
+  std::string path = write_synthetic_trace(2000);
+  osi_property_set("persist.bluetooth.lhdcv3_sink.period_frames",
+                   std::to_string(state.range(1)).c_str());
+  tA2DP_LHDCV3_SINK_REPLAY_STATS stats = {};
+  uint64_t packets = 0, wakeups = 0, callbacks = 0;
+  for (auto _ : state) {
+    A2DP_VendorReplayTraceLhdcV3Sink(path.c_str(), false, state.range(0),
+                                     stream_pcm, &stats);
+    packets += stats.decoded;
+    wakeups += stats.wakeups;
+    callbacks += stats.pcm_callbacks;
+  }
+  osi_property_clear();
+  unlink(path.c_str());
+  state.SetItemsProcessed(packets);
+  state.counters["wakeups_per_packet"] = packets ? (double)wakeups / packets : 0;
+  state.counters["pcm_calls_per_packet"] =
+      packets ? (double)callbacks / packets : 0;
+  state.counters["p50_us"] = stats.latency_p50_us;
+  state.counters["p99_us"] = stats.latency_p99_us;
+}
+BENCHMARK(BM_ReplayTrace)
+    ->Args({1, 0})
+    ->Args({8, 0})
+    ->Args({8, 480})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
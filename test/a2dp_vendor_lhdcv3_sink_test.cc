@@ -0,0 +1,1332 @@
+/*
+ * Host unit tests for the LHDC V3 sink codec. The codec source is included
+ * directly so its static helpers can be exercised; the stack services and
+ * the decoder library come from test/stubs.
+ */
+
+#include "a2dp_vendor_lhdcv3_dec_AOSP12.cc"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fake_lhdcv3_decoder.h"
+
+namespace {
+
+// Polls |done| for up to a second. Each poll hands back the PCM decoded so
+// far, as the next media timer tick of the stack would.
+template <typename Pred>
+bool WaitFor(Pred done) {
+  for (int i = 0; i < 1000; i++) {
+    a2dp_lhdcv3_sink_handback_drain(&a2dp_lhdcv3_sink_cb);
+    if (done()) return true;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  a2dp_lhdcv3_sink_handback_drain(&a2dp_lhdcv3_sink_cb);
+  return done();
+}
+
+class A2dpLhdcV3SinkTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    osi_property_clear();
+    fake_lhdcv3_reset();
+    a2dp_lhdcv3_sink_budget_valid = false;
+  }
+  void TearDown() override { osi_property_clear(); }
+};
+
+}  // namespace
+
+// Runs first, before any other test had the library loaded for good.
+TEST_F(A2dpLhdcV3SinkTest, library_load_is_retried_after_failure) {
+  if (a2dp_lhdcv3_sink_library_loaded.valid()) {
+    GTEST_SKIP() << "decoder library already loaded";
+  }
+  fake_lhdcv3_load_result = false;
+  EXPECT_FALSE(a2dp_lhdcv3_sink_library_wait_loaded());
+  EXPECT_FALSE(a2dp_lhdcv3_sink_library_wait_loaded());
+  fake_lhdcv3_load_result = true;
+  EXPECT_TRUE(a2dp_lhdcv3_sink_library_wait_loaded());
+  EXPECT_EQ(fake_lhdcv3_load_calls, 3);
+
+  // Loaded for good: no more attempts
+  a2dp_lhdcv3_sink_library_preload();
+  EXPECT_TRUE(a2dp_lhdcv3_sink_library_wait_loaded());
+  EXPECT_EQ(fake_lhdcv3_load_calls, 3);
+}
+
+TEST_F(A2dpLhdcV3SinkTest, build_parse_round_trip) {
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  ASSERT_EQ(A2DP_BuildInfoLhdcV3Sink(AVDT_MEDIA_TYPE_AUDIO,
+                                     &a2dp_lhdcv3_sink_default_config,
+                                     codec_info),
+            A2DP_SUCCESS);
+
+  tA2DP_LHDCV3_SINK_CIE cie = {};
+  ASSERT_EQ(A2DP_ParseInfoLhdcV3Sink(&cie, codec_info, false), A2DP_SUCCESS);
+  EXPECT_TRUE(A2DP_CieEqualsLhdcV3Sink(cie, a2dp_lhdcv3_sink_default_config));
+
+  ASSERT_EQ(A2DP_ParseInfoLhdcV3Sink(&cie, a2dp_lhdcv3_sink_caps_info.data(),
+                                     true),
+            A2DP_SUCCESS);
+  EXPECT_TRUE(A2DP_CieEqualsLhdcV3Sink(cie, a2dp_lhdcv3_sink_caps));
+}
+
+TEST_F(A2dpLhdcV3SinkTest, rejects_foreign_codec_info) {
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  EXPECT_TRUE(A2DP_IsVendorSinkCodecValidLhdcV3(codec_info));
+
+  codec_info[3] ^= 0xFF;  // vendor ID
+  EXPECT_FALSE(A2DP_IsVendorSinkCodecValidLhdcV3(codec_info));
+  EXPECT_EQ(A2DP_VendorGetDecoderInterfaceLhdcV3(codec_info), nullptr);
+
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  codec_info[0] = A2DP_LHDCV3_CODEC_LEN - 1;  // LOSC
+  EXPECT_FALSE(A2DP_IsVendorSinkCodecValidLhdcV3(codec_info));
+}
+
+TEST_F(A2dpLhdcV3SinkTest, matches_capability) {
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  EXPECT_TRUE(A2DP_IsPeerSourceCodecSupportedLhdcV3(
+      a2dp_lhdcv3_sink_caps_info.data()));
+  EXPECT_EQ(A2DP_CodecInfoMatchesCapabilityLhdcV3Sink(&a2dp_lhdcv3_sink_caps,
+                                                      codec_info, false),
+            A2DP_SUCCESS);
+
+  tA2DP_LHDCV3_SINK_CIE cap = a2dp_lhdcv3_sink_caps;
+  cap.sampleRate = A2DP_LHDC_SAMPLING_FREQ_44100;
+  EXPECT_EQ(A2DP_CodecInfoMatchesCapabilityLhdcV3Sink(&cap, codec_info, false),
+            A2DP_NS_SAMP_FREQ);
+}
+
+TEST_F(A2dpLhdcV3SinkTest, track_parameters) {
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  EXPECT_EQ(A2DP_VendorGetTrackSampleRateLhdcV3Sink(codec_info), 96000);
+  EXPECT_EQ(A2DP_VendorGetSinkTrackChannelTypeLhdcV3(codec_info),
+            A2DP_LHDC_CHANNEL_MODE_STEREO);
+  EXPECT_TRUE(A2DP_VendorCodecEqualsLhdcV3Sink(codec_info, codec_info));
+}
+
+TEST_F(A2dpLhdcV3SinkTest, codec_info_string) {
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  std::string info = A2DP_VendorCodecInfoStringLhdcV3Sink(codec_info);
+  EXPECT_NE(info.find("samp_freq: 96000"), std::string::npos) << info;
+  EXPECT_NE(info.find("bits_depth: 24 bits"), std::string::npos) << info;
+  EXPECT_NE(info.find("ch_split: No split"), std::string::npos) << info;
+}
+
+static std::atomic<uint32_t> pcm_bytes;
+static void count_pcm(UNUSED_ATTR uint8_t* buf, uint32_t len) {
+  pcm_bytes += len;
+}
+
+TEST_F(A2dpLhdcV3SinkTest, decodes_stream_through_library) {
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  const tA2DP_DECODER_INTERFACE* p_itf =
+      A2DP_VendorGetDecoderInterfaceLhdcV3(codec_info);
+  ASSERT_NE(p_itf, nullptr);
+
+  pcm_bytes = 0;
+  fake_lhdcv3_frames_per_packet = 256;
+  ASSERT_TRUE(p_itf->decoder_init(count_pcm));
+  p_itf->decoder_configure(codec_info);
+  p_itf->decoder_start();
+
+  const int kPackets = 50;
+  alignas(BT_HDR) uint8_t raw[BT_HDR_SIZE + 600] = {};
+  BT_HDR* p_buf = (BT_HDR*)raw;
+  p_buf->len = 500;
+  for (int i = 0; i < kPackets; i++) {
+    p_buf->layer_specific = i;
+    EXPECT_TRUE(p_itf->decode_packet(p_buf));
+  }
+
+  const uint32_t expected = kPackets * 256 * 2 * 3;
+  EXPECT_TRUE(WaitFor([&] { return pcm_bytes >= expected; })) << pcm_bytes;
+  p_itf->decoder_cleanup();
+
+  EXPECT_EQ(fake_lhdcv3_decode_calls, kPackets);
+  EXPECT_EQ(pcm_bytes, expected);
+}
+
+TEST_F(A2dpLhdcV3SinkTest, reconfigure_applies_latest_generation) {
+  uint8_t config_96k[AVDT_CODEC_SIZE] = {};
+  uint8_t config_48k[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(config_96k);
+  tA2DP_LHDCV3_SINK_CIE cie = a2dp_lhdcv3_sink_default_config;
+  cie.sampleRate = A2DP_LHDC_SAMPLING_FREQ_48000;
+  ASSERT_EQ(A2DP_BuildInfoLhdcV3Sink(AVDT_MEDIA_TYPE_AUDIO, &cie, config_48k),
+            A2DP_SUCCESS);
+  const tA2DP_DECODER_INTERFACE* p_itf =
+      A2DP_VendorGetDecoderInterfaceLhdcV3(config_96k);
+  ASSERT_NE(p_itf, nullptr);
+
+  pcm_bytes = 0;
+  fake_lhdcv3_frames_per_packet = 64;
+  ASSERT_TRUE(p_itf->decoder_init(count_pcm));
+  // Snapshots freed along the way may hand their address to the next one
+  for (int i = 0; i < 20; i++) {
+    p_itf->decoder_configure((i % 2) ? config_48k : config_96k);
+  }
+  p_itf->decoder_configure(config_48k);
+  p_itf->decoder_start();
+
+  alignas(BT_HDR) uint8_t raw[BT_HDR_SIZE + 100] = {};
+  BT_HDR* p_buf = (BT_HDR*)raw;
+  p_buf->len = 80;
+  EXPECT_TRUE(p_itf->decode_packet(p_buf));
+  EXPECT_TRUE(WaitFor([] { return pcm_bytes != 0; }));
+
+  const tA2DP_LHDCV3_SINK_CB* p_cb = &a2dp_lhdcv3_sink_cb;
+  const tA2DP_LHDCV3_SINK_CONFIG* p_active =
+      p_cb->active_config.load(std::memory_order_acquire);
+  EXPECT_EQ(p_cb->config_generation, p_active->generation);
+  EXPECT_EQ(p_cb->sample_rate, 48000);
+  p_itf->decoder_cleanup();
+}
+
+TEST_F(A2dpLhdcV3SinkTest, only_configure_reaches_the_decoder_library) {
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  const uint8_t unset[sizeof(fake_lhdcv3_saved_info)] = {};
+
+  // Validity queries and parsing have no side effects
+  tA2DP_LHDCV3_SINK_CIE cie;
+  EXPECT_TRUE(A2DP_IsVendorSinkCodecValidLhdcV3(codec_info));
+  EXPECT_EQ(A2DP_ParseInfoLhdcV3Sink(&cie, codec_info, false), A2DP_SUCCESS);
+  EXPECT_EQ(memcmp(fake_lhdcv3_saved_info, unset, sizeof(unset)), 0);
+
+  // The decode thread hands the published snapshot to the library. PCM
+  // from a packet queued behind it shows it was applied.
+  const tA2DP_DECODER_INTERFACE* p_itf =
+      A2DP_VendorGetDecoderInterfaceLhdcV3(codec_info);
+  ASSERT_TRUE(p_itf->decoder_init(count_pcm));
+  p_itf->decoder_configure(codec_info);
+  p_itf->decoder_start();
+  alignas(BT_HDR) uint8_t raw[BT_HDR_SIZE + 100] = {};
+  BT_HDR* p_buf = (BT_HDR*)raw;
+  p_buf->len = 80;
+  pcm_bytes = 0;
+  EXPECT_TRUE(p_itf->decode_packet(p_buf));
+  EXPECT_TRUE(WaitFor([] { return pcm_bytes != 0; }));
+  p_itf->decoder_cleanup();
+  EXPECT_EQ(memcmp(fake_lhdcv3_saved_info, codec_info,
+                   sizeof(fake_lhdcv3_saved_info)),
+            0);
+}
+
+TEST_F(A2dpLhdcV3SinkTest, stream_context_is_reused_across_sessions) {
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  const tA2DP_DECODER_INTERFACE* p_itf =
+      A2DP_VendorGetDecoderInterfaceLhdcV3(codec_info);
+  ASSERT_NE(p_itf, nullptr);
+  fake_lhdcv3_frames_per_packet = 256;
+
+  alignas(BT_HDR) uint8_t raw[BT_HDR_SIZE + 600] = {};
+  BT_HDR* p_buf = (BT_HDR*)raw;
+  p_buf->len = 500;
+  for (int session = 0; session < 2; session++) {
+    pcm_bytes = 0;
+    ASSERT_TRUE(p_itf->decoder_init(count_pcm));
+    // A second init of a running stream keeps the context as it is
+    EXPECT_TRUE(p_itf->decoder_init(count_pcm));
+    p_itf->decoder_configure(codec_info);
+    p_itf->decoder_start();
+    EXPECT_TRUE(p_itf->decode_packet(p_buf));
+    EXPECT_TRUE(WaitFor([] { return pcm_bytes >= 256 * 2 * 3; })) << pcm_bytes;
+    p_itf->decoder_cleanup();
+    EXPECT_FALSE(p_itf->decode_packet(p_buf));
+  }
+}
+
+static std::vector<uint8_t> tws_pcm;
+static void collect_tws_pcm(uint8_t* buf, uint32_t len) {
+  tws_pcm.insert(tws_pcm.end(), buf, buf + len);
+}
+
+TEST_F(A2dpLhdcV3SinkTest, tws_split_plays_one_channel) {
+  tA2DP_LHDCV3_SINK_CIE config = a2dp_lhdcv3_sink_default_config;
+  config.channelSplitMode = A2DP_LHDC_CH_SPLIT_TWS;
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  ASSERT_EQ(A2DP_BuildInfoLhdcV3Sink(AVDT_MEDIA_TYPE_AUDIO, &config, codec_info),
+            A2DP_SUCCESS);
+  EXPECT_EQ(A2DP_CodecInfoMatchesCapabilityLhdcV3Sink(&a2dp_lhdcv3_sink_earbud_caps,
+                                                      codec_info, false),
+            A2DP_SUCCESS);
+  EXPECT_EQ(A2DP_VendorGetSinkTrackChannelTypeLhdcV3(codec_info),
+            A2DP_LHDC_CHANNEL_MODE_MONO);
+  std::string info = A2DP_VendorCodecInfoStringLhdcV3Sink(codec_info);
+  EXPECT_NE(info.find("ch_split: TWS"), std::string::npos) << info;
+
+  // The right earbud keeps the second sample of each stereo frame
+  osi_property_set("persist.bluetooth.lhdcv3_sink.asrc", "false");
+  osi_property_set("persist.bluetooth.lhdcv3_sink.tws_channel", "1");
+  const tA2DP_DECODER_INTERFACE* p_itf =
+      A2DP_VendorGetDecoderInterfaceLhdcV3(codec_info);
+  ASSERT_NE(p_itf, nullptr);
+  fake_lhdcv3_frames_per_packet = 4;
+  tws_pcm.clear();
+  ASSERT_TRUE(p_itf->decoder_init(collect_tws_pcm));
+  p_itf->decoder_configure(codec_info);
+  p_itf->decoder_start();
+  alignas(BT_HDR) uint8_t raw[BT_HDR_SIZE + 600] = {};
+  BT_HDR* p_buf = (BT_HDR*)raw;
+  p_buf->len = 500;
+  EXPECT_TRUE(p_itf->decode_packet(p_buf));
+  EXPECT_TRUE(WaitFor([] { return !tws_pcm.empty(); }));
+  p_itf->decoder_cleanup();
+
+  ASSERT_EQ(tws_pcm.size(), 4u * 3);
+  for (size_t i = 0; i < tws_pcm.size(); i++) {
+    size_t frame = i / 3, byte = i % 3;
+    EXPECT_EQ(tws_pcm[i], (uint8_t)((frame * 6 + 3 + byte) * 7 + 500)) << i;
+  }
+}
+
+// Every peer capability built from the sample rates, bit depths, maximum
+// bitrates and LL support a source can advertise.
+static std::vector<tA2DP_LHDCV3_SINK_CIE> peer_capability_matrix(void) {
+  static const uint8_t kRates[] = {
+      A2DP_LHDC_SAMPLING_FREQ_44100, A2DP_LHDC_SAMPLING_FREQ_48000,
+      A2DP_LHDC_SAMPLING_FREQ_88200, A2DP_LHDC_SAMPLING_FREQ_96000};
+  static const btav_a2dp_codec_bits_per_sample_t kBits[] = {
+      BTAV_A2DP_CODEC_BITS_PER_SAMPLE_16, BTAV_A2DP_CODEC_BITS_PER_SAMPLE_24,
+      BTAV_A2DP_CODEC_BITS_PER_SAMPLE_16 | BTAV_A2DP_CODEC_BITS_PER_SAMPLE_24};
+  static const uint8_t kBitrates[] = {A2DP_LHDC_MAX_BIT_RATE_400K,
+                                      A2DP_LHDC_MAX_BIT_RATE_500K,
+                                      A2DP_LHDC_MAX_BIT_RATE_900K};
+  std::vector<tA2DP_LHDCV3_SINK_CIE> matrix;
+  for (int rates = 1; rates < 16; rates++) {
+    for (btav_a2dp_codec_bits_per_sample_t bits : kBits) {
+      for (uint8_t bitrate : kBitrates) {
+        for (bool ll : {false, true}) {
+          tA2DP_LHDCV3_SINK_CIE peer = a2dp_lhdcv3_sink_caps;
+          peer.sampleRate = 0;
+          for (int i = 0; i < 4; i++) {
+            if (rates & (1 << i)) peer.sampleRate |= kRates[i];
+          }
+          peer.bits_per_sample = bits;
+          peer.channelSplitMode = A2DP_LHDC_CH_SPLIT_NONE;
+          peer.maxTargetBitrate = bitrate;
+          peer.isLLSupported = ll;
+          matrix.push_back(peer);
+        }
+      }
+    }
+  }
+  return matrix;
+}
+
+static bool is_single_bit(uint32_t value) {
+  return value != 0 && (value & (value - 1)) == 0;
+}
+
+TEST_F(A2dpLhdcV3SinkTest, negotiates_every_peer_capability_within_budget) {
+  const btav_a2dp_codec_config_t user_config = {};
+  tA2DP_LHDCV3_SINK_BUDGET unlimited = {};
+  // 48 kHz 16-bit stereo at most, 500 kbps, LL preferred
+  tA2DP_LHDCV3_SINK_BUDGET low_power = {48000 * 2 * 2, 500000, true, false};
+
+  for (const tA2DP_LHDCV3_SINK_CIE& peer : peer_capability_matrix()) {
+    for (const tA2DP_LHDCV3_SINK_BUDGET& budget : {unlimited, low_power}) {
+      tA2DP_LHDCV3_SINK_CIE result;
+      ASSERT_TRUE(A2DP_SelectConfigLhdcV3Sink(a2dp_lhdcv3_sink_caps, peer, true,
+                                              user_config, budget, &result));
+      // A single setting of each, that both sides have
+      EXPECT_TRUE(is_single_bit(result.sampleRate & peer.sampleRate));
+      EXPECT_TRUE(is_single_bit(static_cast<int>(result.bits_per_sample) &
+                                static_cast<int>(peer.bits_per_sample)));
+      EXPECT_LE(a2dp_lhdcv3_sink_max_bitrate_bps(result.maxTargetBitrate),
+                a2dp_lhdcv3_sink_max_bitrate_bps(peer.maxTargetBitrate));
+      EXPECT_TRUE(!result.isLLSupported || peer.isLLSupported);
+      EXPECT_EQ(result.channelSplitMode, A2DP_LHDC_CH_SPLIT_NONE);
+
+      uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+      ASSERT_EQ(A2DP_BuildInfoLhdcV3Sink(AVDT_MEDIA_TYPE_AUDIO, &result, codec_info),
+                A2DP_SUCCESS);
+      EXPECT_EQ(A2DP_CieMatchesCapabilityLhdcV3Sink(peer, result), A2DP_SUCCESS);
+
+      bool fits = A2DP_ScoreConfigLhdcV3Sink(result, budget) >= 0;
+      if (budget.max_pcm_bytes_per_sec == 0) {
+        // Nothing limits the choice: the best each side allows
+        EXPECT_TRUE(fits);
+        // The highest sample rate has the lowest bit
+        EXPECT_EQ(result.sampleRate, peer.sampleRate & -peer.sampleRate);
+        EXPECT_EQ(result.maxTargetBitrate, peer.maxTargetBitrate);
+      } else {
+        bool can_fit =
+            (peer.sampleRate &
+             (A2DP_LHDC_SAMPLING_FREQ_44100 | A2DP_LHDC_SAMPLING_FREQ_48000)) &&
+            (peer.bits_per_sample & BTAV_A2DP_CODEC_BITS_PER_SAMPLE_16);
+        EXPECT_EQ(fits, can_fit);
+        if (fits) {
+          EXPECT_EQ(result.isLLSupported, peer.isLLSupported);
+        }
+      }
+    }
+  }
+}
+
+TEST_F(A2dpLhdcV3SinkTest, set_codec_config_writes_the_negotiated_config) {
+  A2dpCodecConfigLhdcV3Sink codec(BTAV_A2DP_CODEC_PRIORITY_DEFAULT);
+  uint8_t result[AVDT_CODEC_SIZE] = {};
+  ASSERT_TRUE(codec.setPeerCodecCapabilities(a2dp_lhdcv3_sink_caps_info.data()));
+  ASSERT_TRUE(codec.setCodecConfig(a2dp_lhdcv3_sink_caps_info.data(), true, result));
+
+  tA2DP_LHDCV3_SINK_CIE config;
+  ASSERT_EQ(A2DP_ParseInfoLhdcV3Sink(&config, result, false), A2DP_SUCCESS);
+  EXPECT_EQ(config.sampleRate, A2DP_LHDC_SAMPLING_FREQ_96000);
+  EXPECT_EQ(config.bits_per_sample, BTAV_A2DP_CODEC_BITS_PER_SAMPLE_24);
+  EXPECT_EQ(config.maxTargetBitrate, A2DP_LHDC_MAX_BIT_RATE_900K);
+
+  // A blob of another codec leaves the result alone
+  uint8_t foreign[AVDT_CODEC_SIZE] = {};
+  memcpy(foreign, a2dp_lhdcv3_sink_caps_info.data(),
+         a2dp_lhdcv3_sink_caps_info.size());
+  foreign[3] ^= 0xFF;
+  uint8_t unchanged[AVDT_CODEC_SIZE];
+  memcpy(unchanged, result, sizeof(unchanged));
+  EXPECT_FALSE(codec.setCodecConfig(foreign, true, result));
+  EXPECT_EQ(memcmp(result, unchanged, sizeof(result)), 0);
+}
+
+TEST_F(A2dpLhdcV3SinkTest, source_config_outside_the_local_caps_is_rejected) {
+  const btav_a2dp_codec_config_t user_config = {};
+  const tA2DP_LHDCV3_SINK_BUDGET budget = {};
+  tA2DP_LHDCV3_SINK_CIE result;
+  tA2DP_LHDCV3_SINK_CIE config = a2dp_lhdcv3_sink_default_config;
+  ASSERT_TRUE(A2DP_SelectConfigLhdcV3Sink(a2dp_lhdcv3_sink_caps, config, false,
+                                          user_config, budget, &result));
+  EXPECT_EQ(result.hasFeatureLLAC, config.hasFeatureLLAC);
+  EXPECT_EQ(result.hasFeatureMinBitrate, config.hasFeatureMinBitrate);
+
+  // A feature the sink lacks is not silently dropped
+  config.hasFeatureLARC = true;
+  EXPECT_FALSE(A2DP_SelectConfigLhdcV3Sink(a2dp_lhdcv3_sink_caps, config, false,
+                                           user_config, budget, &result));
+
+  // Only an earbud takes the TWS split
+  config = a2dp_lhdcv3_sink_default_config;
+  config.channelSplitMode = A2DP_LHDC_CH_SPLIT_TWS;
+  EXPECT_FALSE(A2DP_SelectConfigLhdcV3Sink(a2dp_lhdcv3_sink_caps, config, false,
+                                           user_config, budget, &result));
+  EXPECT_TRUE(A2DP_SelectConfigLhdcV3Sink(a2dp_lhdcv3_sink_earbud_caps, config,
+                                          false, user_config, budget, &result));
+
+  // A configuration names one sample width
+  config = a2dp_lhdcv3_sink_default_config;
+  config.bits_per_sample = a2dp_lhdcv3_sink_caps.bits_per_sample;
+  EXPECT_FALSE(A2DP_SelectConfigLhdcV3Sink(a2dp_lhdcv3_sink_caps, config, false,
+                                           user_config, budget, &result));
+
+  // Through the codec config as well
+  config = a2dp_lhdcv3_sink_default_config;
+  config.hasFeatureLARC = true;
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  ASSERT_EQ(A2DP_BuildInfoLhdcV3Sink(AVDT_MEDIA_TYPE_AUDIO, &config, codec_info),
+            A2DP_SUCCESS);
+  A2dpCodecConfigLhdcV3Sink codec(BTAV_A2DP_CODEC_PRIORITY_DEFAULT);
+  uint8_t out[AVDT_CODEC_SIZE] = {};
+  EXPECT_FALSE(codec.setCodecConfig(codec_info, false, out));
+}
+
+TEST_F(A2dpLhdcV3SinkTest, link_statistics_count_late_and_lost_packets) {
+  std::unique_ptr<tA2DP_LHDCV3_SINK_CB> p_cb(new tA2DP_LHDCV3_SINK_CB());
+  a2dp_lhdcv3_sink_stats_reset(p_cb.get());
+  p_cb->prefill.interval_us = 10000;
+
+  uint64_t arrival_us = 1000000;
+  for (int i = 0; i < 10; i++) {
+    a2dp_lhdcv3_sink_link_on_packet(p_cb.get(), 0, arrival_us, false);
+    arrival_us += 10000;
+  }
+  // 25 ms after the previous packet: late, with two packets lost before it
+  arrival_us += 15000;
+  a2dp_lhdcv3_sink_link_on_packet(p_cb.get(), 2, arrival_us, true);
+
+  EXPECT_EQ(p_cb->stats.packets_late.load(), 1u);
+  EXPECT_EQ(p_cb->stats.packets_lost.load(), 2u);
+  EXPECT_EQ(p_cb->stats.underruns.load(), 1u);
+
+  // A new session starts tracking afresh but keeps the totals
+  a2dp_lhdcv3_sink_link_reset(p_cb.get());
+  a2dp_lhdcv3_sink_link_on_packet(p_cb.get(), 0, arrival_us + 5000000, false);
+  EXPECT_EQ(p_cb->stats.packets_late.load(), 1u);
+  EXPECT_EQ(p_cb->stats.packets_lost.load(), 2u);
+}
+
+TEST_F(A2dpLhdcV3SinkTest, stream_statistics_track_the_decode) {
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  const tA2DP_DECODER_INTERFACE* p_itf =
+      A2DP_VendorGetDecoderInterfaceLhdcV3(codec_info);
+  ASSERT_NE(p_itf, nullptr);
+
+  fake_lhdcv3_frames_per_packet = 256;
+  ASSERT_TRUE(p_itf->decoder_init(count_pcm));
+  p_itf->decoder_configure(codec_info);
+  p_itf->decoder_start();
+
+  const int kPackets = 20;
+  alignas(BT_HDR) uint8_t raw[BT_HDR_SIZE + 600] = {};
+  BT_HDR* p_buf = (BT_HDR*)raw;
+  p_buf->len = 500;
+  for (int i = 0; i < kPackets; i++) {
+    p_buf->layer_specific = i;
+    EXPECT_TRUE(p_itf->decode_packet(p_buf));
+  }
+  EXPECT_TRUE(WaitFor([] {
+    return a2dp_lhdcv3_sink_cb.stats.packets_decoded.load() == kPackets;
+  }));
+
+  tA2DP_LHDCV3_SINK_STATS_SNAPSHOT snapshot;
+  A2DP_VendorGetStreamStatsLhdcV3Sink(&snapshot);
+  EXPECT_EQ(snapshot.packets_received, (uint32_t)kPackets);
+  EXPECT_EQ(snapshot.packets_decoded, (uint32_t)kPackets);
+  EXPECT_EQ(snapshot.packets_dropped, 0u);
+  EXPECT_EQ(snapshot.decode_errors, 0u);
+  EXPECT_LE(snapshot.decode_us.p50, snapshot.decode_us.p99);
+  EXPECT_LE(snapshot.decode_us.p99, snapshot.decode_us.max);
+
+  // The stream shows up in the info string of the configuration it runs
+  std::string info = A2DP_VendorCodecInfoStringLhdcV3Sink(codec_info);
+  EXPECT_NE(info.find("packets: 20 received, 20 decoded"), std::string::npos)
+      << info;
+  p_itf->decoder_cleanup();
+}
+
+static std::vector<int16_t> plc_pcm;
+
+static void collect_plc_pcm(tA2DP_LHDCV3_SINK_CB* p_cb, uint8_t* buf,
+                            uint32_t len) {
+  const int16_t* samples = reinterpret_cast<const int16_t*>(buf);
+  plc_pcm.insert(plc_pcm.end(), samples, samples + len / sizeof(int16_t));
+}
+
+TEST_F(A2dpLhdcV3SinkTest, lost_packets_are_concealed_with_a_fade) {
+  std::unique_ptr<tA2DP_LHDCV3_SINK_CB> p_cb(new tA2DP_LHDCV3_SINK_CB());
+  p_cb->sample_rate = 48000;
+  p_cb->bits_per_sample = 16;
+  p_cb->pcm_kernels = a2dp_lhdcv3_sink_select_pcm_kernels(16);
+  p_cb->output = collect_plc_pcm;
+  a2dp_lhdcv3_sink_plc_resize(p_cb.get(), 48000, 16);
+  a2dp_lhdcv3_sink_plc_reset(p_cb.get());
+  plc_pcm.clear();
+  alignas(BT_HDR) uint8_t raw[BT_HDR_SIZE + 600] = {};
+  BT_HDR* p_buf = (BT_HDR*)raw;
+  p_buf->len = 500;
+
+  // 480 frames per packet, then two packets missing
+  for (uint16_t seq : {0, 1}) {
+    p_buf->layer_specific = seq;
+    EXPECT_EQ(a2dp_lhdcv3_sink_plc_on_packet(p_cb.get(), p_buf), 0u);
+    p_cb->plc.decoded_frames = 480;
+    a2dp_lhdcv3_sink_plc_on_packet_decoded(p_cb.get());
+  }
+  p_buf->layer_specific = 4;
+  uint32_t lost = a2dp_lhdcv3_sink_plc_on_packet(p_cb.get(), p_buf);
+  EXPECT_EQ(lost, 2u);
+  uint32_t frames = a2dp_lhdcv3_sink_plc_frames(p_cb.get(), lost);
+  EXPECT_EQ(frames, 960u);
+
+  std::vector<int16_t> decoded(2 * 480, 10000);
+  a2dp_lhdcv3_sink_plc_on_decoded(p_cb.get(),
+                                  reinterpret_cast<uint8_t*>(decoded.data()),
+                                  decoded.size() * sizeof(int16_t));
+  a2dp_lhdcv3_sink_plc_conceal(p_cb.get(), frames);
+  ASSERT_EQ(plc_pcm.size(), 2u * frames);
+  EXPECT_GT(plc_pcm.front(), 9000);
+  for (size_t i = 2; i < plc_pcm.size(); i++) EXPECT_LE(plc_pcm[i], plc_pcm[i - 2]);
+  // 20 ms of concealment ends about halfway through the 40 ms fade
+  EXPECT_GT(plc_pcm.back(), 0);
+  EXPECT_LT(plc_pcm.back(), 6000);
+
+  // The audio after the gap fades back in from where the concealment ended
+  std::vector<int16_t> next(2 * 480, 10000);
+  a2dp_lhdcv3_sink_plc_on_decoded(p_cb.get(),
+                                  reinterpret_cast<uint8_t*>(next.data()),
+                                  next.size() * sizeof(int16_t));
+  EXPECT_LT(next.front(), 6000);
+  EXPECT_EQ(next.back(), 10000);
+}
+
+TEST_F(A2dpLhdcV3SinkTest, captured_trace_replays_every_packet) {
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  const tA2DP_DECODER_INTERFACE* p_itf =
+      A2DP_VendorGetDecoderInterfaceLhdcV3(codec_info);
+  ASSERT_NE(p_itf, nullptr);
+  const std::string path = A2DP_LHDCV3_SINK_TRACE_DIR "/lhdcv3_sink.trc";
+  unlink(path.c_str());
+
+  osi_property_set("persist.bluetooth.lhdcv3_sink.trace", "true");
+  osi_property_set("persist.bluetooth.lhdcv3_sink.trace_mb", "1");
+  pcm_bytes = 0;
+  fake_lhdcv3_frames_per_packet = 256;
+  ASSERT_TRUE(p_itf->decoder_init(count_pcm));
+  p_itf->decoder_configure(codec_info);
+  p_itf->decoder_start();
+
+  const int kPackets = 20;
+  alignas(BT_HDR) uint8_t raw[BT_HDR_SIZE + 600] = {};
+  BT_HDR* p_buf = (BT_HDR*)raw;
+  p_buf->len = 500;
+  for (int i = 0; i < kPackets; i++) {
+    p_buf->layer_specific = i;
+    EXPECT_TRUE(p_itf->decode_packet(p_buf));
+  }
+  const uint32_t expected = kPackets * 256 * 2 * 3;
+  EXPECT_TRUE(WaitFor([&] { return pcm_bytes >= expected; })) << pcm_bytes;
+
+  // A replay cannot take the context while the stream is being decoded
+  tA2DP_LHDCV3_SINK_REPLAY_STATS stats;
+  EXPECT_FALSE(A2DP_VendorReplayTraceLhdcV3Sink(path.c_str(), false, 1,
+                                                count_pcm, &stats));
+  p_itf->decoder_cleanup();
+
+  // The file is trimmed to the header, the configuration and the packets
+  struct stat st;
+  ASSERT_EQ(stat(path.c_str(), &st), 0);
+  EXPECT_EQ((size_t)st.st_size,
+            sizeof(tA2DP_LHDCV3_SINK_TRACE_HEADER) +
+                sizeof(tA2DP_LHDCV3_SINK_TRACE_RECORD) + AVDT_CODEC_SIZE +
+                kPackets * (sizeof(tA2DP_LHDCV3_SINK_TRACE_RECORD) + 500));
+
+  // Replaying with capture still on does not overwrite the trace
+  pcm_bytes = 0;
+  fake_lhdcv3_decode_calls = 0;
+  ASSERT_TRUE(A2DP_VendorReplayTraceLhdcV3Sink(path.c_str(), false, 1,
+                                               count_pcm, &stats));
+  EXPECT_EQ(stats.packets, (uint32_t)kPackets);
+  EXPECT_EQ(stats.decoded, (uint32_t)kPackets);
+  EXPECT_EQ(fake_lhdcv3_decode_calls, kPackets);
+  EXPECT_EQ(pcm_bytes, expected);
+  EXPECT_LE(stats.latency_p50_us, stats.latency_max_us);
+  ASSERT_EQ(stat(path.c_str(), &st), 0);
+  EXPECT_GT(st.st_size, 0);
+  unlink(path.c_str());
+}
+
+TEST_F(A2dpLhdcV3SinkTest, full_trace_is_trimmed_on_cleanup) {
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  const tA2DP_DECODER_INTERFACE* p_itf =
+      A2DP_VendorGetDecoderInterfaceLhdcV3(codec_info);
+  ASSERT_NE(p_itf, nullptr);
+  const std::string path = A2DP_LHDCV3_SINK_TRACE_DIR "/lhdcv3_sink.trc";
+  unlink(path.c_str());
+
+  osi_property_set("persist.bluetooth.lhdcv3_sink.trace", "true");
+  osi_property_set("persist.bluetooth.lhdcv3_sink.trace_mb", "1");
+  fake_lhdcv3_frames_per_packet = 256;
+  ASSERT_TRUE(p_itf->decoder_init(count_pcm));
+  p_itf->decoder_configure(codec_info);
+  p_itf->decoder_start();
+
+  // More packets than the 1 MB trace holds
+  alignas(BT_HDR) uint8_t raw[BT_HDR_SIZE + 600] = {};
+  BT_HDR* p_buf = (BT_HDR*)raw;
+  p_buf->len = 500;
+  for (int i = 0; i < 2500; i++) {
+    p_buf->layer_specific = i;
+    p_itf->decode_packet(p_buf);
+  }
+  EXPECT_FALSE(a2dp_lhdcv3_sink_cb.trace.active);
+  EXPECT_NE(a2dp_lhdcv3_sink_cb.trace.map, nullptr);
+  p_itf->decoder_cleanup();
+  EXPECT_EQ(a2dp_lhdcv3_sink_cb.trace.map, nullptr);
+
+  // Trimmed to the records that fit
+  const size_t head = sizeof(tA2DP_LHDCV3_SINK_TRACE_HEADER) +
+                      sizeof(tA2DP_LHDCV3_SINK_TRACE_RECORD) + AVDT_CODEC_SIZE;
+  const size_t record = sizeof(tA2DP_LHDCV3_SINK_TRACE_RECORD) + 500;
+  struct stat st;
+  ASSERT_EQ(stat(path.c_str(), &st), 0);
+  EXPECT_EQ((size_t)st.st_size, head + ((1 << 20) - head) / record * record);
+  unlink(path.c_str());
+}
+
+// Starts the stream, decodes one packet and waits for its PCM.
+static void start_and_decode_one(const tA2DP_DECODER_INTERFACE* p_itf) {
+  alignas(BT_HDR) uint8_t raw[BT_HDR_SIZE + 600] = {};
+  BT_HDR* p_buf = (BT_HDR*)raw;
+  p_buf->len = 500;
+  uint32_t expected = pcm_bytes + 256 * 2 * 3;
+  p_itf->decoder_start();
+  EXPECT_TRUE(p_itf->decode_packet(p_buf));
+  EXPECT_TRUE(WaitFor([&] { return pcm_bytes >= expected; })) << pcm_bytes;
+}
+
+TEST_F(A2dpLhdcV3SinkTest, suspend_keeps_the_library_warm) {
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  const tA2DP_DECODER_INTERFACE* p_itf =
+      A2DP_VendorGetDecoderInterfaceLhdcV3(codec_info);
+  ASSERT_NE(p_itf, nullptr);
+  pcm_bytes = 0;
+  fake_lhdcv3_frames_per_packet = 256;
+
+  ASSERT_TRUE(p_itf->decoder_init(count_pcm));
+  p_itf->decoder_configure(codec_info);
+  start_and_decode_one(p_itf);
+  EXPECT_EQ(fake_lhdcv3_start_calls, 1);
+  EXPECT_FALSE(a2dp_lhdcv3_sink_cb.warm_start);
+
+  // The same configuration again does not make the next start cold. The
+  // library is still started, only the suspend is skipped.
+  p_itf->decoder_suspend();
+  p_itf->decoder_configure(codec_info);
+  start_and_decode_one(p_itf);
+  EXPECT_EQ(fake_lhdcv3_start_calls, 2);
+  EXPECT_EQ(fake_lhdcv3_suspend_calls, 0);
+  EXPECT_TRUE(a2dp_lhdcv3_sink_cb.warm_start);
+  p_itf->decoder_cleanup();
+
+  // Without warm resume, every suspend and start reaches the library
+  osi_property_set("persist.bluetooth.lhdcv3_sink.warm_resume", "false");
+  ASSERT_TRUE(p_itf->decoder_init(count_pcm));
+  p_itf->decoder_configure(codec_info);
+  start_and_decode_one(p_itf);
+  p_itf->decoder_suspend();
+  start_and_decode_one(p_itf);
+  EXPECT_EQ(fake_lhdcv3_start_calls, 4);
+  EXPECT_EQ(fake_lhdcv3_suspend_calls, 1);
+  EXPECT_FALSE(a2dp_lhdcv3_sink_cb.warm_start);
+  p_itf->decoder_cleanup();
+}
+
+TEST_F(A2dpLhdcV3SinkTest, spans_export_as_chrome_trace_events) {
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  const tA2DP_DECODER_INTERFACE* p_itf =
+      A2DP_VendorGetDecoderInterfaceLhdcV3(codec_info);
+  ASSERT_NE(p_itf, nullptr);
+
+  pcm_bytes = 0;
+  fake_lhdcv3_frames_per_packet = 256;
+  ASSERT_TRUE(p_itf->decoder_init(count_pcm));
+  p_itf->decoder_configure(codec_info);
+  p_itf->decoder_start();
+  alignas(BT_HDR) uint8_t raw[BT_HDR_SIZE + 600] = {};
+  BT_HDR* p_buf = (BT_HDR*)raw;
+  p_buf->len = 500;
+  for (int i = 0; i < 4; i++) {
+    p_buf->layer_specific = i;
+    EXPECT_TRUE(p_itf->decode_packet(p_buf));
+  }
+  EXPECT_TRUE(WaitFor([] { return pcm_bytes >= 4 * 256 * 2 * 3; }));
+  p_itf->decoder_cleanup();
+
+  std::string path = A2DP_LHDCV3_SINK_TRACE_DIR "/lhdcv3_sink_spans.json";
+  ASSERT_TRUE(A2DP_VendorExportSpansLhdcV3Sink(path.c_str()));
+  std::ifstream in(path);
+  std::stringstream json;
+  json << in.rdbuf();
+  unlink(path.c_str());
+
+  EXPECT_EQ(json.str().rfind("{\"traceEvents\":[", 0), 0u);
+  for (const char* name : {"receive", "enqueue", "decode", "pcm_handoff"}) {
+    std::string event = std::string("{\"name\":\"") + name + "\"";
+    EXPECT_NE(json.str().find(event), std::string::npos) << name;
+  }
+}
+
+TEST_F(A2dpLhdcV3SinkTest, spans_export_while_a_thread_records) {
+  // The writer laps its ring many times over while the export copies it
+  std::atomic<bool> stop(false);
+  std::thread writer([&stop] {
+    for (uint32_t i = 1; !stop.load(); i++) {
+      a2dp_lhdcv3_sink_span_record("lapping", i, i);
+    }
+  });
+
+  std::string path = A2DP_LHDCV3_SINK_TRACE_DIR "/lhdcv3_sink_lapping.json";
+  size_t checked = 0;
+  for (int round = 0; round < 20; round++) {
+    ASSERT_TRUE(A2DP_VendorExportSpansLhdcV3Sink(path.c_str()));
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line)) {
+      if (line.find("\"lapping\"") == std::string::npos) continue;
+      size_t ts = line.find("\"ts\":");
+      size_t arg = line.find("\"arg\":");
+      ASSERT_NE(ts, std::string::npos);
+      ASSERT_NE(arg, std::string::npos);
+      EXPECT_EQ(std::stoull(line.substr(ts + 5)),
+                std::stoull(line.substr(arg + 6)))
+          << line;
+      checked++;
+    }
+  }
+  stop.store(true);
+  writer.join();
+  unlink(path.c_str());
+  EXPECT_GT(checked, 0u);
+}
+
+static std::vector<uint32_t> period_lens;
+static void collect_period_lens(UNUSED_ATTR uint8_t* buf, uint32_t len) {
+  period_lens.push_back(len);
+  pcm_bytes += len;
+}
+
+TEST_F(A2dpLhdcV3SinkTest, batched_packets_are_handed_on_in_hal_periods) {
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  const tA2DP_DECODER_INTERFACE* p_itf =
+      A2DP_VendorGetDecoderInterfaceLhdcV3(codec_info);
+  ASSERT_NE(p_itf, nullptr);
+
+  pcm_bytes = 0;
+  period_lens.clear();
+  fake_lhdcv3_frames_per_packet = 256;
+  ASSERT_TRUE(p_itf->decoder_init(collect_period_lens));
+  A2DP_VendorSetOutputPeriodLhdcV3Sink(480);
+  p_itf->decoder_configure(codec_info);
+  p_itf->decoder_start();
+
+  const int kPackets = 8;
+  std::vector<std::vector<uint8_t>> raw(kPackets);
+  BT_HDR* p_bufs[kPackets];
+  for (int i = 0; i < kPackets; i++) {
+    raw[i].resize(BT_HDR_SIZE + 500);
+    p_bufs[i] = (BT_HDR*)raw[i].data();
+    p_bufs[i]->len = 500;
+    p_bufs[i]->layer_specific = i;
+  }
+  EXPECT_EQ(A2DP_VendorDecodePacketsLhdcV3Sink(p_bufs, kPackets),
+            (size_t)kPackets);
+  EXPECT_TRUE(WaitFor([] {
+    return a2dp_lhdcv3_sink_cb.stats.packets_decoded.load() == kPackets;
+  }));
+
+  // The remainder of a period goes out at suspend
+  p_itf->decoder_suspend();
+  const uint32_t expected = kPackets * 256 * 2 * 3;
+  EXPECT_TRUE(WaitFor([&] { return pcm_bytes >= expected; })) << pcm_bytes;
+  EXPECT_LT(a2dp_lhdcv3_sink_cb.stats.wakeups.load(), (uint32_t)kPackets);
+  p_itf->decoder_cleanup();
+  A2DP_VendorSetOutputPeriodLhdcV3Sink(0);
+
+  EXPECT_EQ(pcm_bytes, expected);
+  ASSERT_EQ(period_lens.size(), 5u);
+  for (size_t i = 0; i + 1 < period_lens.size(); i++) {
+    EXPECT_EQ(period_lens[i], 480u * 2 * 3) << i;
+  }
+  EXPECT_EQ(period_lens.back(), (kPackets * 256 - 4 * 480) * 2 * 3);
+}
+
+// Requantizes a 24-bit sweep to 16 bits at half gain with |p_kernels| and
+// checks the result against the exact scaled value.
+static void check_requantize24(const tA2DP_LHDCV3_SINK_PCM_KERNELS* p_kernels) {
+  const size_t kSamples = 1 << 16;
+  std::vector<int32_t> x(kSamples);
+  std::vector<uint8_t> in(3 * kSamples);
+  for (size_t i = 0; i < kSamples; i++) {
+    x[i] = (int32_t)(i * 251 % (1 << 24)) - (1 << 23);
+    in[3 * i] = (uint8_t)x[i];
+    in[3 * i + 1] = (uint8_t)(x[i] >> 8);
+    in[3 * i + 2] = (uint8_t)(x[i] >> 16);
+  }
+  std::vector<uint8_t> out(2 * kSamples);
+  uint32_t dither[A2DP_LHDCV3_SINK_DITHER_LANES];
+  for (int i = 0; i < A2DP_LHDCV3_SINK_DITHER_LANES; i++) dither[i] = i + 1;
+  p_kernels->requantize16(in.data(), out.data(), kSamples, 0.5f, dither);
+
+  double sum = 0, sum_sq = 0, worst = 0;
+  for (size_t i = 0; i < kSamples; i++) {
+    int16_t y = (int16_t)(out[2 * i] | out[2 * i + 1] << 8);
+    double error = y - x[i] * 0.5 / 256;
+    sum += error;
+    sum_sq += error * error;
+    worst = std::max(worst, fabs(error));
+  }
+  EXPECT_LT(fabs(sum / kSamples), 0.05) << p_kernels->name;
+  EXPECT_LT(sqrt(sum_sq / kSamples), 0.7) << p_kernels->name;
+  EXPECT_LE(worst, 1.5) << p_kernels->name;
+}
+
+TEST_F(A2dpLhdcV3SinkTest, requantize_dithers_without_bias) {
+#if !defined(__ARM_NEON)
+  check_requantize24(&a2dp_lhdcv3_sink_pcm_kernels_c[1]);
+#endif
+  check_requantize24(a2dp_lhdcv3_sink_select_pcm_kernels(24));
+}
+
+TEST_F(A2dpLhdcV3SinkTest, output_bits_are_read_once_per_init) {
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  osi_property_set("persist.bluetooth.lhdcv3_sink.output_bits", "16");
+  a2dp_lhdcv3_sink_read_output_bits();
+  EXPECT_EQ(A2DP_VendorGetTrackBitsPerSampleLhdcV3Sink(codec_info), 16);
+
+  // Changing the property takes effect at the next codec init only
+  osi_property_set("persist.bluetooth.lhdcv3_sink.output_bits", "0");
+  EXPECT_EQ(A2DP_VendorGetTrackBitsPerSampleLhdcV3Sink(codec_info), 16);
+
+  const tA2DP_DECODER_INTERFACE* p_itf =
+      A2DP_VendorGetDecoderInterfaceLhdcV3(codec_info);
+  ASSERT_NE(p_itf, nullptr);
+  alignas(BT_HDR) uint8_t raw[BT_HDR_SIZE + 100] = {};
+  BT_HDR* p_buf = (BT_HDR*)raw;
+  p_buf->len = 80;
+  pcm_bytes = 0;
+  fake_lhdcv3_frames_per_packet = 64;
+  ASSERT_TRUE(p_itf->decoder_init(count_pcm));
+  p_itf->decoder_configure(codec_info);
+  p_itf->decoder_start();
+  EXPECT_TRUE(p_itf->decode_packet(p_buf));
+  // 24-bit stereo from the library, 16-bit stereo to the audio track
+  EXPECT_TRUE(WaitFor([] { return pcm_bytes != 0; }));
+  EXPECT_EQ(pcm_bytes, 64u * 2 * 2);
+  p_itf->decoder_cleanup();
+
+  a2dp_lhdcv3_sink_read_output_bits();
+  EXPECT_EQ(A2DP_VendorGetTrackBitsPerSampleLhdcV3Sink(codec_info), 24);
+}
+
+TEST_F(A2dpLhdcV3SinkTest, packets_beyond_the_mtu_are_counted_as_heap_fallbacks) {
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  const tA2DP_DECODER_INTERFACE* p_itf =
+      A2DP_VendorGetDecoderInterfaceLhdcV3(codec_info);
+  ASSERT_NE(p_itf, nullptr);
+  ASSERT_TRUE(p_itf->decoder_init(count_pcm));
+  p_itf->decoder_configure(codec_info);
+  p_itf->decoder_start();
+
+  // A full L2CAP SDU fits a slot
+  std::vector<uint8_t> raw(BT_HDR_SIZE + L2CAP_MTU_SIZE + 100);
+  BT_HDR* p_buf = (BT_HDR*)raw.data();
+  p_buf->len = L2CAP_MTU_SIZE;
+  BT_HDR* p_bufs[] = {p_buf};
+  EXPECT_EQ(A2DP_VendorDecodePacketsLhdcV3Sink(p_bufs, 1), 1u);
+  tA2DP_LHDCV3_SINK_STATS_SNAPSHOT snapshot;
+  A2DP_VendorGetStreamStatsLhdcV3Sink(&snapshot);
+  EXPECT_EQ(snapshot.heap_fallbacks, 0u);
+
+  // Anything larger is still decoded, from the heap
+  p_buf->len = L2CAP_MTU_SIZE + 100;
+  EXPECT_EQ(A2DP_VendorDecodePacketsLhdcV3Sink(p_bufs, 1), 1u);
+  EXPECT_TRUE(WaitFor([] {
+    return a2dp_lhdcv3_sink_cb.stats.packets_decoded.load() == 2;
+  }));
+  A2DP_VendorGetStreamStatsLhdcV3Sink(&snapshot);
+  EXPECT_EQ(snapshot.heap_fallbacks, 1u);
+  p_itf->decoder_cleanup();
+}
+
+static std::thread::id pcm_thread;
+static void record_pcm_thread(UNUSED_ATTR uint8_t* buf, uint32_t len) {
+  pcm_thread = std::this_thread::get_id();
+  pcm_bytes += len;
+}
+
+TEST_F(A2dpLhdcV3SinkTest, pcm_is_handed_back_on_the_caller_thread_without_loss) {
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  const tA2DP_DECODER_INTERFACE* p_itf =
+      A2DP_VendorGetDecoderInterfaceLhdcV3(codec_info);
+  ASSERT_NE(p_itf, nullptr);
+
+  // Four packets of whole 24 bit stereo frames fill the hand-back
+  const uint32_t kChunk = A2DP_LHDCV3_SINK_HANDBACK_BYTES / 4 / 6 * 6;
+  std::vector<uint8_t> pcm(kChunk);
+  fake_lhdcv3_decode_hook = [&](UNUSED_ATTR BT_HDR* p_buf) {
+    fake_lhdcv3_emit(pcm.data(), kChunk);
+    return true;
+  };
+  pcm_bytes = 0;
+  pcm_thread = std::thread::id();
+  ASSERT_TRUE(p_itf->decoder_init(record_pcm_thread));
+  p_itf->decoder_configure(codec_info);
+  p_itf->decoder_start();
+
+  const int kPackets = 12;
+  alignas(BT_HDR) uint8_t raw[BT_HDR_SIZE + 600] = {};
+  BT_HDR* p_buf = (BT_HDR*)raw;
+  p_buf->len = 500;
+  BT_HDR* p_bufs[kPackets];
+  for (int i = 0; i < kPackets; i++) p_bufs[i] = p_buf;
+  EXPECT_EQ(A2DP_VendorDecodePacketsLhdcV3Sink(p_bufs, kPackets), (size_t)kPackets);
+
+  // Nothing is handed back until the stack calls in again, and the decode
+  // thread waits for it once the hand-back is full
+  for (int i = 0; i < 1000 && a2dp_lhdcv3_sink_cb.stats.handback_waits.load() == 0; i++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  EXPECT_EQ(pcm_bytes, 0u);
+  EXPECT_GT(a2dp_lhdcv3_sink_cb.stats.handback_waits.load(), 0u);
+
+  const uint32_t expected = kPackets * kChunk;
+  EXPECT_TRUE(WaitFor([&] { return pcm_bytes >= expected; })) << pcm_bytes;
+  EXPECT_EQ(pcm_bytes, expected);
+  EXPECT_EQ(pcm_thread, std::this_thread::get_id());
+  p_itf->decoder_cleanup();
+}
+
+TEST_F(A2dpLhdcV3SinkTest, cleanup_releases_a_decode_thread_waiting_for_room) {
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  const tA2DP_DECODER_INTERFACE* p_itf =
+      A2DP_VendorGetDecoderInterfaceLhdcV3(codec_info);
+  ASSERT_NE(p_itf, nullptr);
+
+  const uint32_t kChunk = A2DP_LHDCV3_SINK_HANDBACK_BYTES / 2 / 6 * 6;
+  std::vector<uint8_t> pcm(kChunk);
+  fake_lhdcv3_decode_hook = [&](UNUSED_ATTR BT_HDR* p_buf) {
+    fake_lhdcv3_emit(pcm.data(), kChunk);
+    return true;
+  };
+  ASSERT_TRUE(p_itf->decoder_init(count_pcm));
+  p_itf->decoder_configure(codec_info);
+  p_itf->decoder_start();
+
+  alignas(BT_HDR) uint8_t raw[BT_HDR_SIZE + 600] = {};
+  BT_HDR* p_buf = (BT_HDR*)raw;
+  p_buf->len = 500;
+  BT_HDR* p_bufs[] = {p_buf, p_buf, p_buf, p_buf};
+  EXPECT_EQ(A2DP_VendorDecodePacketsLhdcV3Sink(p_bufs, 4), 4u);
+  for (int i = 0; i < 1000 && a2dp_lhdcv3_sink_cb.stats.handback_waits.load() == 0; i++)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  EXPECT_GT(a2dp_lhdcv3_sink_cb.stats.handback_waits.load(), 0u);
+
+  // Returns rather than hang on the waiting decode thread
+  p_itf->decoder_cleanup();
+  EXPECT_FALSE(a2dp_lhdcv3_sink_cb.decode_thread.joinable());
+}
+
+// Puts a version 2 RTP header with |seq| and |timestamp| in front of the
+// payload of |p_buf|.
+static void put_rtp_header(BT_HDR* p_buf, uint16_t seq, uint32_t timestamp) {
+  p_buf->offset = AVDT_MEDIA_HDR_SIZE;
+  p_buf->layer_specific = seq;
+  uint8_t* p = (uint8_t*)(p_buf + 1);
+  memset(p, 0, AVDT_MEDIA_HDR_SIZE);
+  p[0] = 0x80;
+  p[1] = 0x60;
+  p[2] = seq >> 8;
+  p[3] = seq & 0xFF;
+  p[4] = timestamp >> 24;
+  p[5] = (timestamp >> 16) & 0xFF;
+  p[6] = (timestamp >> 8) & 0xFF;
+  p[7] = timestamp & 0xFF;
+}
+
+TEST_F(A2dpLhdcV3SinkTest, rtp_timestamp_is_read_only_from_a_real_header) {
+  alignas(BT_HDR) uint8_t raw[BT_HDR_SIZE + 600] = {};
+  BT_HDR* p_buf = (BT_HDR*)raw;
+  p_buf->len = 500;
+  uint32_t timestamp = 0;
+
+  // As btif hands packets on: the header is gone, the payload is at 0
+  memset(p_buf + 1, 0x80, 16);
+  p_buf->layer_specific = 7;
+  EXPECT_FALSE(a2dp_lhdcv3_sink_rtp_timestamp(p_buf, &timestamp));
+
+  put_rtp_header(p_buf, 7, 0x12345678);
+  EXPECT_TRUE(a2dp_lhdcv3_sink_rtp_timestamp(p_buf, &timestamp));
+  EXPECT_EQ(timestamp, 0x12345678u);
+
+  // Another sequence number than AVDTP saw, CSRCs or an extension
+  p_buf->layer_specific = 8;
+  EXPECT_FALSE(a2dp_lhdcv3_sink_rtp_timestamp(p_buf, &timestamp));
+  put_rtp_header(p_buf, 7, 0);
+  ((uint8_t*)(p_buf + 1))[0] = 0x81;
+  EXPECT_FALSE(a2dp_lhdcv3_sink_rtp_timestamp(p_buf, &timestamp));
+  ((uint8_t*)(p_buf + 1))[0] = 0x90;
+  EXPECT_FALSE(a2dp_lhdcv3_sink_rtp_timestamp(p_buf, &timestamp));
+}
+
+TEST_F(A2dpLhdcV3SinkTest, drift_estimator_runs_with_or_without_the_rtp_header) {
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  const tA2DP_DECODER_INTERFACE* p_itf =
+      A2DP_VendorGetDecoderInterfaceLhdcV3(codec_info);
+  ASSERT_NE(p_itf, nullptr);
+
+  alignas(BT_HDR) uint8_t raw[BT_HDR_SIZE + 600] = {};
+  BT_HDR* p_buf = (BT_HDR*)raw;
+  p_buf->len = 500;
+  BT_HDR* p_bufs[] = {p_buf};
+  for (bool with_header : {false, true}) {
+    ASSERT_TRUE(p_itf->decoder_init(count_pcm));
+    p_itf->decoder_configure(codec_info);
+    p_itf->decoder_start();
+    for (uint16_t seq = 0; seq < 4; seq++) {
+      if (with_header) {
+        put_rtp_header(p_buf, seq, seq * 480u);
+      } else {
+        p_buf->offset = 0;
+        p_buf->layer_specific = seq;
+        memset(p_buf + 1, 0x80, 16);
+      }
+      EXPECT_EQ(A2DP_VendorDecodePacketsLhdcV3Sink(p_bufs, 1), 1u);
+    }
+    EXPECT_TRUE(WaitFor([] {
+      return a2dp_lhdcv3_sink_cb.stats.packets_decoded.load() == 4;
+    }));
+    p_itf->decoder_cleanup();
+
+    // Media time is the RTP timestamps, or else the audio decoded so far
+    EXPECT_TRUE(a2dp_lhdcv3_sink_cb.drift.have_anchor);
+    EXPECT_EQ(a2dp_lhdcv3_sink_cb.drift.rtp, with_header);
+    // The converter stays off unless asked for
+    EXPECT_FALSE(a2dp_lhdcv3_sink_cb.asrc.enabled);
+  }
+}
+
+TEST_F(A2dpLhdcV3SinkTest, drift_follows_decoded_audio_without_the_rtp_header) {
+  std::unique_ptr<tA2DP_LHDCV3_SINK_CB> p_cb(new tA2DP_LHDCV3_SINK_CB());
+  p_cb->sample_rate = 96000;
+  p_cb->drift = {};
+  p_cb->drift.sample_rate = 96000;
+  p_cb->plc.packet_frames = 256;
+  alignas(BT_HDR) uint8_t raw[BT_HDR_SIZE + 600] = {};
+  BT_HDR* p_buf = (BT_HDR*)raw;
+  p_buf->len = 500;
+
+  // The source clock runs 100 ppm slow. Packets take up to 5 ms over the air,
+  // and the stack hands them on from a 20 ms media timer. Every tenth packet
+  // is lost on the way. Tick-fine offsets take a few minutes to settle.
+  uint32_t random = 1;
+  uint64_t arrival_us = 0;
+  uint32_t lost = 0;
+  for (uint32_t i = 0; i < 75000; i++) {
+    if (i % 10 == 9) {
+      lost++;
+      continue;
+    }
+    random = random * 1103515245 + 12345;
+    uint64_t sent_us = (uint64_t)i * 256 * 1000100 / 96000 + (random >> 16) % 5000;
+    arrival_us = std::max(arrival_us, (sent_us / 20000 + 1) * 20000);
+    a2dp_lhdcv3_sink_drift_on_packet(p_cb.get(), p_buf, lost, arrival_us);
+    p_cb->drift.decoded_frames += 256;
+    lost = 0;
+  }
+  EXPECT_FALSE(p_cb->drift.rtp);
+  EXPECT_NEAR(p_cb->drift.drift_ppm, -100.0, 10.0);
+}
+
+TEST_F(A2dpLhdcV3SinkTest, losses_come_from_sequence_number_gaps) {
+  std::unique_ptr<tA2DP_LHDCV3_SINK_CB> p_cb(new tA2DP_LHDCV3_SINK_CB());
+  p_cb->sample_rate = 96000;
+  a2dp_lhdcv3_sink_plc_reset(p_cb.get());
+  alignas(BT_HDR) uint8_t raw[BT_HDR_SIZE + 600] = {};
+  BT_HDR* p_buf = (BT_HDR*)raw;
+  p_buf->len = 500;
+
+  // Without the RTP header, a lost packet is as long as decoded ones were
+  for (uint16_t seq : {0xFFFE, 0xFFFF, 0x0000}) {
+    p_buf->layer_specific = seq;
+    EXPECT_EQ(a2dp_lhdcv3_sink_plc_on_packet(p_cb.get(), p_buf), 0u);
+    p_cb->plc.decoded_frames = 256;
+    a2dp_lhdcv3_sink_plc_on_packet_decoded(p_cb.get());
+  }
+  p_buf->layer_specific = 3;
+  EXPECT_EQ(a2dp_lhdcv3_sink_plc_on_packet(p_cb.get(), p_buf), 2u);
+  EXPECT_EQ(a2dp_lhdcv3_sink_plc_frames(p_cb.get(), 2), 512u);
+
+  // Duplicates, late packets and discontinuities are no loss
+  EXPECT_EQ(a2dp_lhdcv3_sink_plc_on_packet(p_cb.get(), p_buf), 0u);
+  p_buf->layer_specific = 1;
+  EXPECT_EQ(a2dp_lhdcv3_sink_plc_on_packet(p_cb.get(), p_buf), 0u);
+  p_buf->layer_specific = 3 + A2DP_LHDCV3_SINK_PLC_MAX_SEQ_GAP;
+  EXPECT_EQ(a2dp_lhdcv3_sink_plc_on_packet(p_cb.get(), p_buf), 0u);
+
+  // With it, the timestamps give the packet length, also across a gap
+  a2dp_lhdcv3_sink_plc_reset(p_cb.get());
+  put_rtp_header(p_buf, 10, 9600);
+  EXPECT_EQ(a2dp_lhdcv3_sink_plc_on_packet(p_cb.get(), p_buf), 0u);
+  put_rtp_header(p_buf, 13, 9600 + 3 * 960);
+  EXPECT_EQ(a2dp_lhdcv3_sink_plc_on_packet(p_cb.get(), p_buf), 2u);
+  p_cb->plc.decoded_frames = 256;
+  a2dp_lhdcv3_sink_plc_on_packet_decoded(p_cb.get());
+  EXPECT_EQ(a2dp_lhdcv3_sink_plc_frames(p_cb.get(), 2), 1920u);
+}
+
+TEST_F(A2dpLhdcV3SinkTest, stream_conceals_sequence_number_gaps) {
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  const tA2DP_DECODER_INTERFACE* p_itf =
+      A2DP_VendorGetDecoderInterfaceLhdcV3(codec_info);
+  ASSERT_NE(p_itf, nullptr);
+  fake_lhdcv3_frames_per_packet = 256;
+  ASSERT_TRUE(p_itf->decoder_init(count_pcm));
+  p_itf->decoder_configure(codec_info);
+  p_itf->decoder_start();
+
+  // As btif hands them on: no RTP header, the sequence number aside
+  alignas(BT_HDR) uint8_t raw[BT_HDR_SIZE + 600] = {};
+  BT_HDR* p_buf = (BT_HDR*)raw;
+  p_buf->len = 500;
+  for (uint16_t seq : {0, 1, 2, 3, 6, 7}) {
+    p_buf->layer_specific = seq;
+    EXPECT_TRUE(p_itf->decode_packet(p_buf));
+  }
+  EXPECT_TRUE(WaitFor([] {
+    return a2dp_lhdcv3_sink_cb.stats.packets_decoded.load() == 6;
+  }));
+  p_itf->decoder_cleanup();
+
+  tA2DP_LHDCV3_SINK_STATS_SNAPSHOT snapshot;
+  A2DP_VendorGetStreamStatsLhdcV3Sink(&snapshot);
+  EXPECT_EQ(snapshot.packets_lost, 2u);
+  EXPECT_EQ(snapshot.concealed_frames, 512u);
+}
+
+TEST_F(A2dpLhdcV3SinkTest, held_depth_is_sampled_as_packets_are_released) {
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  const tA2DP_DECODER_INTERFACE* p_itf =
+      A2DP_VendorGetDecoderInterfaceLhdcV3(codec_info);
+  ASSERT_NE(p_itf, nullptr);
+  fake_lhdcv3_frames_per_packet = 960;  // 10 ms at 96 kHz
+  ASSERT_TRUE(p_itf->decoder_init(count_pcm));
+  p_itf->decoder_configure(codec_info);
+  p_itf->decoder_start();
+
+  // One media timer tick worth of packets, held back by the prefill
+  const int kPackets = 10;
+  alignas(BT_HDR) uint8_t raw[kPackets][BT_HDR_SIZE + 600] = {};
+  BT_HDR* p_bufs[kPackets];
+  for (int i = 0; i < kPackets; i++) {
+    p_bufs[i] = (BT_HDR*)raw[i];
+    p_bufs[i]->len = 500;
+    p_bufs[i]->layer_specific = i;
+  }
+  EXPECT_EQ(A2DP_VendorDecodePacketsLhdcV3Sink(p_bufs, kPackets), (size_t)kPackets);
+  EXPECT_TRUE(WaitFor([] {
+    return a2dp_lhdcv3_sink_cb.stats.packets_decoded.load() == kPackets;
+  }));
+  p_itf->decoder_cleanup();
+
+  // Once the first packet told the packet length, the nine behind the
+  // second one are held, plus at most the first packet's PCM
+  tA2DP_LHDCV3_SINK_STATS_SNAPSHOT snapshot;
+  A2DP_VendorGetStreamStatsLhdcV3Sink(&snapshot);
+  EXPECT_GE(snapshot.held_us.max, 90000u);
+  EXPECT_LE(snapshot.held_us.max, 100000u);
+}
+
+// Delay reports as a source would receive them
+static std::vector<uint16_t> delay_reports;
+static std::thread::id delay_report_thread;
+static void record_delay_report(uint16_t delay_1_10_ms) {
+  delay_reports.push_back(delay_1_10_ms);
+  delay_report_thread = std::this_thread::get_id();
+}
+
+TEST_F(A2dpLhdcV3SinkTest, delay_reports_follow_the_queued_depth) {
+  uint8_t codec_info[AVDT_CODEC_SIZE] = {};
+  A2DP_InitDefaultCodecLhdcV3Sink(codec_info);
+  const tA2DP_DECODER_INTERFACE* p_itf =
+      A2DP_VendorGetDecoderInterfaceLhdcV3(codec_info);
+  ASSERT_NE(p_itf, nullptr);
+  fake_lhdcv3_frames_per_packet = 480;  // 5 ms at 96 kHz
+  delay_reports.clear();
+  delay_report_thread = std::thread::id();
+  A2DP_VendorSetDelayReportCallbackLhdcV3Sink(record_delay_report);
+  ASSERT_TRUE(p_itf->decoder_init(count_pcm));
+  A2DP_VendorSetOutputLatencyLhdcV3Sink(40000);
+  p_itf->decoder_configure(codec_info);
+  p_itf->decoder_start();
+
+  // Source stand-in: 20 ms of audio per media timer tick, for 1.2 s
+  alignas(BT_HDR) uint8_t raw[BT_HDR_SIZE + 600] = {};
+  BT_HDR* p_buf = (BT_HDR*)raw;
+  p_buf->len = 500;
+  uint16_t seq = 0;
+  auto next_tick = std::chrono::steady_clock::now();
+  for (int tick = 0; tick < 60; tick++) {
+    next_tick += std::chrono::milliseconds(20);
+    std::this_thread::sleep_until(next_tick);
+    for (int i = 0; i < 4; i++) {
+      p_buf->layer_specific = seq++;
+      EXPECT_TRUE(p_itf->decode_packet(p_buf));
+    }
+  }
+  uint32_t delay_us = 0;
+  EXPECT_TRUE(A2DP_VendorGetDelayLhdcV3Sink(&delay_us));
+  p_itf->decoder_cleanup();
+  A2DP_VendorSetDelayReportCallbackLhdcV3Sink(NULL);
+
+  // The decoded PCM waits up to a tick for the stack, on top of the output
+  ASSERT_FALSE(delay_reports.empty());
+  EXPECT_EQ(delay_report_thread, std::this_thread::get_id());
+  EXPECT_GE(delay_reports.back(), 400u);
+  EXPECT_LE(delay_reports.back(), 400u + 250u);
+  EXPECT_GE(delay_us, 40000u);
+  EXPECT_LE(delay_us, 40000u + 25000u);
+}
+
+TEST_F(A2dpLhdcV3SinkTest, tws_split_is_only_offered_and_accepted_by_an_earbud) {
+  tA2DP_LHDCV3_SINK_CIE tws_config = a2dp_lhdcv3_sink_default_config;
+  tws_config.channelSplitMode = A2DP_LHDC_CH_SPLIT_TWS;
+  uint8_t tws_info[AVDT_CODEC_SIZE] = {};
+  ASSERT_EQ(A2DP_BuildInfoLhdcV3Sink(AVDT_MEDIA_TYPE_AUDIO, &tws_config, tws_info),
+            A2DP_SUCCESS);
+  tA2DP_LHDCV3_SINK_CIE source_caps = a2dp_lhdcv3_sink_earbud_caps;
+  btav_a2dp_codec_config_t user_config = {};
+  tA2DP_LHDCV3_SINK_BUDGET budget = {};
+  tA2DP_LHDCV3_SINK_CIE result;
+
+  for (bool earbud : {false, true}) {
+    budget.tws = earbud;
+    A2DP_VendorSetBudgetLhdcV3Sink(&budget);
+    const tA2DP_LHDCV3_SINK_CIE& local = A2DP_LocalCapsLhdcV3Sink(earbud);
+
+    AvdtpSepConfig sep = {};
+    A2DP_VendorInitCodecConfigLhdcV3Sink(&sep);
+    tA2DP_LHDCV3_SINK_CIE advertised = {};
+    ASSERT_EQ(A2DP_ParseInfoLhdcV3Sink(&advertised, sep.codec_info, true),
+              A2DP_SUCCESS);
+    EXPECT_EQ((advertised.channelSplitMode & A2DP_LHDC_CH_SPLIT_TWS) != 0, earbud);
+    EXPECT_EQ(A2DP_IsVendorSinkCodecSupportedLhdcV3(tws_info), earbud);
+
+    // A source offering both splits gets the TWS one from an earbud only
+    ASSERT_TRUE(A2DP_SelectConfigLhdcV3Sink(local, source_caps, true, user_config,
+                                            budget, &result));
+    EXPECT_EQ(result.channelSplitMode,
+              earbud ? A2DP_LHDC_CH_SPLIT_TWS : A2DP_LHDC_CH_SPLIT_NONE);
+
+    // A source that picks the TWS split itself is refused otherwise
+    EXPECT_EQ(A2DP_SelectConfigLhdcV3Sink(local, tws_config, false, user_config,
+                                          budget, &result),
+              earbud);
+  }
+}
+
+TEST_F(A2dpLhdcV3SinkTest, budget_is_read_once_unless_supplied) {
+  osi_property_set("persist.bluetooth.lhdcv3_sink.max_bitrate_kbps", "500");
+  osi_property_set("persist.bluetooth.lhdcv3_sink.low_latency", "true");
+  tA2DP_LHDCV3_SINK_BUDGET budget = A2DP_GetBudgetLhdcV3Sink();
+  EXPECT_EQ(budget.max_bitrate_bps, 500000u);
+  EXPECT_TRUE(budget.low_latency);
+
+  // Later property changes do not reach the negotiation
+  osi_property_set("persist.bluetooth.lhdcv3_sink.max_bitrate_kbps", "400");
+  EXPECT_EQ(A2DP_GetBudgetLhdcV3Sink().max_bitrate_bps, 500000u);
+
+  // A budget from the caller does
+  budget = {};
+  budget.max_bitrate_bps = 400000;
+  A2DP_VendorSetBudgetLhdcV3Sink(&budget);
+  budget = A2DP_GetBudgetLhdcV3Sink();
+  EXPECT_EQ(budget.max_bitrate_bps, 400000u);
+  EXPECT_FALSE(budget.low_latency);
+}
@@ -0,0 +1,77 @@
+/*
+ * Host fake for the LHDC V3 decoder library. Every packet decodes into
+ * fake_lhdcv3_frames_per_packet frames of stereo PCM whose bytes depend on
+ * the packet length, so tests can tell packets apart.
+ */
+
+#include "fake_lhdcv3_decoder.h"
+
+#include <string.h>
+
+#include "a2dp_vendor_lhdcv3_decoder.h"
+
+int fake_lhdcv3_frames_per_packet = 480;
+int fake_lhdcv3_bytes_per_sample = 3;
+bool fake_lhdcv3_load_result = true;
+std::atomic<int> fake_lhdcv3_load_calls{0};
+int fake_lhdcv3_decode_calls = 0;
+int fake_lhdcv3_start_calls = 0;
+int fake_lhdcv3_suspend_calls = 0;
+std::function<bool(BT_HDR* p_buf)> fake_lhdcv3_decode_hook;
+uint8_t fake_lhdcv3_saved_info[12];
+
+static decoded_data_callback_t fake_callback;
+
+void fake_lhdcv3_emit(uint8_t* buf, uint32_t len) {
+  if (fake_callback != nullptr) fake_callback(buf, len);
+}
+
+void fake_lhdcv3_reset(void) {
+  fake_lhdcv3_frames_per_packet = 480;
+  fake_lhdcv3_bytes_per_sample = 3;
+  fake_lhdcv3_load_result = true;
+  fake_lhdcv3_decode_calls = 0;
+  fake_lhdcv3_start_calls = 0;
+  fake_lhdcv3_suspend_calls = 0;
+  fake_lhdcv3_decode_hook = nullptr;
+  memset(fake_lhdcv3_saved_info, 0, sizeof(fake_lhdcv3_saved_info));
+}
+
+bool A2DP_VendorLoadDecoderLhdcV3(void) {
+  fake_lhdcv3_load_calls++;
+  return fake_lhdcv3_load_result;
+}
+
+void A2DP_VendorUnloadDecoderLhdcV3(void) {}
+
+bool a2dp_vendor_lhdcv3_decoder_init(decoded_data_callback_t decode_callback) {
+  fake_callback = decode_callback;
+  return true;
+}
+
+void a2dp_vendor_lhdcv3_decoder_cleanup(void) { fake_callback = nullptr; }
+
+bool a2dp_vendor_lhdcv3_decoder_decode_packet(BT_HDR* p_buf) {
+  fake_lhdcv3_decode_calls++;
+  if (fake_lhdcv3_decode_hook) return fake_lhdcv3_decode_hook(p_buf);
+
+  static uint8_t pcm[2048 * 2 * 4];
+  uint32_t len = fake_lhdcv3_frames_per_packet * 2 *
+                 fake_lhdcv3_bytes_per_sample;
+  if (len > sizeof(pcm)) len = sizeof(pcm);
+  for (uint32_t i = 0; i < len; i++) {
+    pcm[i] = (uint8_t)(i * 7 + p_buf->len);
+  }
+  fake_lhdcv3_emit(pcm, len);
+  return true;
+}
+
+void a2dp_vendor_lhdcv3_decoder_start(void) { fake_lhdcv3_start_calls++; }
+
+void a2dp_vendor_lhdcv3_decoder_suspend(void) { fake_lhdcv3_suspend_calls++; }
+
+void a2dp_vendor_lhdcv3_decoder_configure(const uint8_t* p_codec_info) {}
+
+void save_codec_info(const uint8_t* p_codec_info) {
+  memcpy(fake_lhdcv3_saved_info, p_codec_info, sizeof(fake_lhdcv3_saved_info));
+}
@@ -0,0 +1,35 @@
+/*
+ * Knobs of the host fake for the LHDC V3 decoder library.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+
+#include "a2dp_vendor.h"
+
+// Frames of interleaved stereo PCM produced per decoded packet.
+extern int fake_lhdcv3_frames_per_packet;
+// Bytes per sample produced: 2 for 16 bit, 3 for packed 24 bit.
+extern int fake_lhdcv3_bytes_per_sample;
+// Result of the next A2DP_VendorLoadDecoderLhdcV3() calls.
+extern bool fake_lhdcv3_load_result;
+// Number of A2DP_VendorLoadDecoderLhdcV3() calls so far.
+extern std::atomic<int> fake_lhdcv3_load_calls;
+// Number of a2dp_vendor_lhdcv3_decoder_decode_packet() calls so far.
+extern int fake_lhdcv3_decode_calls;
+// Number of decoder_start and decoder_suspend calls so far.
+extern int fake_lhdcv3_start_calls;
+extern int fake_lhdcv3_suspend_calls;
+// When set, replaces the default PCM generation for each packet.
+extern std::function<bool(BT_HDR* p_buf)> fake_lhdcv3_decode_hook;
+// Codec info passed to save_codec_info(), 12 bytes.
+extern uint8_t fake_lhdcv3_saved_info[12];
+
+// Hands |len| bytes of PCM to the callback registered by decoder_init.
+void fake_lhdcv3_emit(uint8_t* buf, uint32_t len);
+
+// Restores every knob to its default.
+void fake_lhdcv3_reset(void);
@@ -0,0 +1,141 @@
+/*
+ * Host stand-in for the parts of the A2DP codec framework the LHDC V3 sink
+ * codec builds against: a2dp_codec_api.h, a2dp_api.h, avdt_api.h, bt_types.h
+ * and the bluetooth/hardware A2DP codec types.
+ */
+#pragma once
+
+#include <stdint.h>
+
+#include <mutex>
+#include <sstream>
+#include <string>
+
+typedef uint8_t tA2DP_STATUS;
+typedef uint8_t tA2DP_CODEC_TYPE;
+
+#define A2DP_SUCCESS 0
+#define A2DP_FAIL 0x0A
+#define A2DP_INVALID_PARAMS 0x09
+#define A2DP_WRONG_CODEC 0xC1
+#define A2DP_BAD_SAMP_FREQ 0xC2
+#define A2DP_NS_SAMP_FREQ 0xC3
+#define A2DP_BAD_CH_MODE 0xC4
+#define A2DP_NS_CH_MODE 0xC5
+#define A2DP_NS_BIT_RATE 0xCB
+#define A2DP_MEDIA_CT_NON_A2DP 0xFF
+
+#define A2DP_SET_ONE_BIT 1
+#define A2DP_SET_ZERO_BIT 0
+#define A2DP_SET_MULTL_BIT 2
+uint8_t A2DP_BitsSet(uint64_t num);
+
+#define AVDT_MEDIA_TYPE_AUDIO 0
+#define AVDT_CODEC_SIZE 20
+#define AVDT_MEDIA_HDR_SIZE 12
+
+typedef struct {
+  uint16_t event;
+  uint16_t len;
+  uint16_t offset;
+  uint16_t layer_specific;
+  uint8_t data[];
+} BT_HDR;
+#define BT_HDR_SIZE (sizeof(BT_HDR))
+
+typedef enum {
+  BTAV_A2DP_CODEC_INDEX_SINK_LHDCV3 = 20,
+} btav_a2dp_codec_index_t;
+
+typedef enum {
+  BTAV_A2DP_CODEC_PRIORITY_DISABLED = -1,
+  BTAV_A2DP_CODEC_PRIORITY_DEFAULT = 0,
+} btav_a2dp_codec_priority_t;
+
+typedef enum {
+  BTAV_A2DP_CODEC_SAMPLE_RATE_NONE = 0x0,
+  BTAV_A2DP_CODEC_SAMPLE_RATE_44100 = 0x1 << 0,
+  BTAV_A2DP_CODEC_SAMPLE_RATE_48000 = 0x1 << 1,
+  BTAV_A2DP_CODEC_SAMPLE_RATE_88200 = 0x1 << 2,
+  BTAV_A2DP_CODEC_SAMPLE_RATE_96000 = 0x1 << 3,
+} btav_a2dp_codec_sample_rate_t;
+
+typedef enum {
+  BTAV_A2DP_CODEC_BITS_PER_SAMPLE_NONE = 0x0,
+  BTAV_A2DP_CODEC_BITS_PER_SAMPLE_16 = 0x1 << 0,
+  BTAV_A2DP_CODEC_BITS_PER_SAMPLE_24 = 0x1 << 1,
+  BTAV_A2DP_CODEC_BITS_PER_SAMPLE_32 = 0x1 << 2,
+} btav_a2dp_codec_bits_per_sample_t;
+
+constexpr btav_a2dp_codec_bits_per_sample_t operator|(
+    btav_a2dp_codec_bits_per_sample_t a, btav_a2dp_codec_bits_per_sample_t b) {
+  return static_cast<btav_a2dp_codec_bits_per_sample_t>(static_cast<int>(a) |
+                                                        static_cast<int>(b));
+}
+inline btav_a2dp_codec_bits_per_sample_t& operator|=(
+    btav_a2dp_codec_bits_per_sample_t& a, btav_a2dp_codec_bits_per_sample_t b) {
+  a = a | b;
+  return a;
+}
+
+typedef enum {
+  BTAV_A2DP_CODEC_CHANNEL_MODE_NONE = 0x0,
+  BTAV_A2DP_CODEC_CHANNEL_MODE_MONO = 0x1 << 0,
+  BTAV_A2DP_CODEC_CHANNEL_MODE_STEREO = 0x1 << 1,
+} btav_a2dp_codec_channel_mode_t;
+
+typedef struct {
+  btav_a2dp_codec_index_t codec_type;
+  btav_a2dp_codec_priority_t codec_priority;
+  int sample_rate;
+  int bits_per_sample;
+  int channel_mode;
+  int64_t codec_specific_1;
+  int64_t codec_specific_2;
+  int64_t codec_specific_3;
+  int64_t codec_specific_4;
+} btav_a2dp_codec_config_t;
+
+typedef struct {
+  uint8_t codec_info[AVDT_CODEC_SIZE];
+} AvdtpSepConfig;
+
+typedef void (*decoded_data_callback_t)(uint8_t* buf, uint32_t len);
+
+typedef struct {
+  bool (*decoder_init)(decoded_data_callback_t decode_callback);
+  void (*decoder_cleanup)(void);
+  bool (*decode_packet)(BT_HDR* p_buf);
+  void (*decoder_start)(void);
+  void (*decoder_suspend)(void);
+  void (*decoder_configure)(const uint8_t* p_codec_info);
+} tA2DP_DECODER_INTERFACE;
+
+typedef struct tA2DP_ENCODER_INIT_PEER_PARAMS tA2DP_ENCODER_INIT_PEER_PARAMS;
+
+std::string loghex(uint32_t x);
+bool AppendField(std::string* p_result, bool append, const std::string& name);
+
+class A2dpCodecConfig {
+ public:
+  virtual ~A2dpCodecConfig() {}
+  bool isValid() const;
+  const std::string& name() const { return name_; }
+
+ protected:
+  A2dpCodecConfig(btav_a2dp_codec_index_t codec_index, const std::string& name,
+                  btav_a2dp_codec_priority_t codec_priority);
+
+  std::recursive_mutex codec_mutex_;
+  const btav_a2dp_codec_index_t codec_index_;
+  const std::string name_;
+  btav_a2dp_codec_config_t codec_config_;
+  btav_a2dp_codec_config_t codec_capability_;
+  btav_a2dp_codec_config_t codec_local_capability_;
+  btav_a2dp_codec_config_t codec_selectable_capability_;
+  btav_a2dp_codec_config_t codec_user_config_;
+  btav_a2dp_codec_config_t codec_audio_config_;
+  uint8_t ota_codec_config_[AVDT_CODEC_SIZE];
+  uint8_t ota_codec_peer_capability_[AVDT_CODEC_SIZE];
+  uint8_t ota_codec_peer_config_[AVDT_CODEC_SIZE];
+};
@@ -0,0 +1,113 @@
+/*
+ * Host stand-in for the vendor a2dp_vendor_lhdcv3_dec.h: the LHDC V3
+ * Codec Information Element constants, the sink codec class and the
+ * A2DP_*LhdcV3* entry points the stack calls.
+ */
+#pragma once
+
+#include "a2dp_vendor.h"
+
+#define A2DP_LHDC_VENDOR_ID 0x0000053A
+#define A2DP_LHDCV3_CODEC_ID 0x4C33
+#define A2DP_LHDCV3_CODEC_LEN 11
+
+#define A2DP_LHDC_SAMPLING_FREQ_MASK 0x0F
+#define A2DP_LHDC_SAMPLING_FREQ_44100 0x08
+#define A2DP_LHDC_SAMPLING_FREQ_48000 0x04
+#define A2DP_LHDC_SAMPLING_FREQ_88200 0x02
+#define A2DP_LHDC_SAMPLING_FREQ_96000 0x01
+
+#define A2DP_LHDC_BIT_FMT_MASK 0x30
+#define A2DP_LHDC_BIT_FMT_24 0x10
+#define A2DP_LHDC_BIT_FMT_16 0x20
+
+#define A2DP_LHDC_FEATURE_AR 0x80
+#define A2DP_LHDC_FEATURE_JAS 0x40
+
+#define A2DP_LHDC_VERSION_MASK 0x0F
+#define A2DP_LHDC_VER3 0x01
+
+#define A2DP_LHDC_MAX_BIT_RATE_MASK 0x30
+#define A2DP_LHDC_MAX_BIT_RATE_900K 0x00
+#define A2DP_LHDC_MAX_BIT_RATE_500K 0x10
+#define A2DP_LHDC_MAX_BIT_RATE_400K 0x20
+
+#define A2DP_LHDC_LL_MASK 0x40
+#define A2DP_LHDC_LL_NONE 0x00
+#define A2DP_LHDC_LL_SUPPORTED 0x40
+
+#define A2DP_LHDC_FEATURE_LLAC 0x80
+
+#define A2DP_LHDC_CH_SPLIT_MSK 0x0F
+#define A2DP_LHDC_CH_SPLIT_NONE 0x01
+#define A2DP_LHDC_CH_SPLIT_TWS 0x04
+
+#define A2DP_LHDC_FEATURE_META 0x10
+#define A2DP_LHDC_FEATURE_MIN_BR 0x20
+#define A2DP_LHDC_FEATURE_LARC 0x40
+#define A2DP_LHDC_FEATURE_LHDCV4 0x80
+
+#define A2DP_LHDC_CHANNEL_MODE_MONO 0x08
+#define A2DP_LHDC_CHANNEL_MODE_DUAL 0x04
+#define A2DP_LHDC_CHANNEL_MODE_STEREO 0x01
+
+class A2dpCodecConfigLhdcV3Base : public A2dpCodecConfig {
+ protected:
+  A2dpCodecConfigLhdcV3Base(btav_a2dp_codec_index_t codec_index,
+                            const std::string& name,
+                            btav_a2dp_codec_priority_t codec_priority,
+                            bool is_source)
+      : A2dpCodecConfig(codec_index, name, codec_priority),
+        is_source_(is_source) {}
+  bool setCodecConfig(const uint8_t* p_peer_codec_info, bool is_capability,
+                      uint8_t* p_result_codec_config);
+  bool setPeerCodecCapabilities(const uint8_t* p_peer_codec_capabilities);
+
+ private:
+  bool is_source_;  // True if local is Source
+};
+
+class A2dpCodecConfigLhdcV3Sink : public A2dpCodecConfigLhdcV3Base {
+ public:
+  A2dpCodecConfigLhdcV3Sink(btav_a2dp_codec_priority_t codec_priority);
+  virtual ~A2dpCodecConfigLhdcV3Sink();
+
+  bool init();
+  uint64_t encoderIntervalMs() const;
+  int getEffectiveMtu() const;
+
+  // Host only: the base class keeps these protected.
+  using A2dpCodecConfigLhdcV3Base::setCodecConfig;
+  using A2dpCodecConfigLhdcV3Base::setPeerCodecCapabilities;
+
+ private:
+  bool useRtpHeaderMarkerBit() const;
+  bool updateEncoderUserConfig(
+      const tA2DP_ENCODER_INIT_PEER_PARAMS* p_peer_params,
+      bool* p_restart_input, bool* p_restart_output, bool* p_config_updated);
+};
+
+const char* A2DP_VendorCodecNameLhdcV3Sink(const uint8_t* p_codec_info);
+bool A2DP_IsVendorSinkCodecValidLhdcV3(const uint8_t* p_codec_info);
+bool A2DP_IsVendorPeerSourceCodecValidLhdcV3(const uint8_t* p_codec_info);
+bool A2DP_IsVendorSinkCodecSupportedLhdcV3(const uint8_t* p_codec_info);
+bool A2DP_IsPeerSourceCodecSupportedLhdcV3(const uint8_t* p_codec_info);
+void A2DP_InitDefaultCodecLhdcV3Sink(uint8_t* p_codec_info);
+bool A2DP_VendorCodecTypeEqualsLhdcV3Sink(const uint8_t* p_codec_info_a,
+                                          const uint8_t* p_codec_info_b);
+bool A2DP_VendorCodecEqualsLhdcV3Sink(const uint8_t* p_codec_info_a,
+                                      const uint8_t* p_codec_info_b);
+int A2DP_VendorGetTrackSampleRateLhdcV3Sink(const uint8_t* p_codec_info);
+int A2DP_VendorGetSinkTrackChannelTypeLhdcV3(const uint8_t* p_codec_info);
+int A2DP_VendorGetChannelModeCodeLhdcV3Sink(const uint8_t* p_codec_info);
+bool A2DP_VendorGetPacketTimestampLhdcV3Sink(const uint8_t* p_codec_info,
+                                             const uint8_t* p_data,
+                                             uint32_t* p_timestamp);
+std::string A2DP_VendorCodecInfoStringLhdcV3Sink(const uint8_t* p_codec_info);
+const tA2DP_DECODER_INTERFACE* A2DP_VendorGetDecoderInterfaceLhdcV3(
+    const uint8_t* p_codec_info);
+bool A2DP_VendorAdjustCodecLhdcV3Sink(uint8_t* p_codec_info);
+btav_a2dp_codec_index_t A2DP_VendorSinkCodecIndexLhdcV3(
+    const uint8_t* p_codec_info);
+const char* A2DP_VendorCodecIndexStrLhdcV3Sink(void);
+bool A2DP_VendorInitCodecConfigLhdcV3Sink(AvdtpSepConfig* p_cfg);
@@ -0,0 +1,17 @@
+/*
+ * Host stand-in for the vendor a2dp_vendor_lhdcv3_decoder.h. The harness
+ * links test/stubs/fake_lhdcv3_decoder.cc behind these symbols.
+ */
+#pragma once
+
+#include "a2dp_vendor.h"
+
+bool A2DP_VendorLoadDecoderLhdcV3(void);
+void A2DP_VendorUnloadDecoderLhdcV3(void);
+bool a2dp_vendor_lhdcv3_decoder_init(decoded_data_callback_t decode_callback);
+void a2dp_vendor_lhdcv3_decoder_cleanup(void);
+bool a2dp_vendor_lhdcv3_decoder_decode_packet(BT_HDR* p_buf);
+void a2dp_vendor_lhdcv3_decoder_start(void);
+void a2dp_vendor_lhdcv3_decoder_suspend(void);
+void a2dp_vendor_lhdcv3_decoder_configure(const uint8_t* p_codec_info);
+void save_codec_info(const uint8_t* p_codec_info);
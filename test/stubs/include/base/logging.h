@@ -0,0 +1,11 @@
+/*
+ * Host stand-in for libchrome's base/logging.h.
+ */
+#pragma once
+
+#include <stdlib.h>
+
+#define CHECK(condition)       \
+  do {                         \
+    if (!(condition)) abort(); \
+  } while (0)
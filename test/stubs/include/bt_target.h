@@ -0,0 +1,13 @@
+/*
+ * Host stand-in for the stack build configuration. Only what the LHDC V3
+ * sink codec uses is defined here.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef L2CAP_MTU_SIZE
+#define L2CAP_MTU_SIZE 1691
+#endif
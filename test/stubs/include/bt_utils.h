@@ -0,0 +1,12 @@
+/*
+ * Host stand-in for bt_utils.h.
+ */
+#pragma once
+
+typedef enum {
+  TASK_HIGH_MEDIA = 0,
+  TASK_UIPC_READ,
+  TASK_HIGH_MAX
+} tHIGH_PRIORITY_TASK;
+
+void raise_priority_a2dp(tHIGH_PRIORITY_TASK high_task);
@@ -0,0 +1,9 @@
+/*
+ * Host stand-in for osi/include/allocator.h.
+ */
+#pragma once
+
+#include <stddef.h>
+
+void* osi_malloc(size_t size);
+void osi_free(void* ptr);
@@ -0,0 +1,24 @@
+/*
+ * Host stand-in for osi/include/log.h. Lines go to stderr; debug and verbose
+ * lines only when LHDCV3_SINK_HOST_VERBOSE is set in the environment.
+ */
+#pragma once
+
+#include <stdio.h>
+
+bool osi_log_verbose(void);
+
+#define LOG_LINE(level, fmt, ...) \
+  fprintf(stderr, level " " LOG_TAG ": " fmt "\n", ##__VA_ARGS__)
+
+#define LOG_VERBOSE(fmt, ...)                                 \
+  do {                                                        \
+    if (osi_log_verbose()) LOG_LINE("V", fmt, ##__VA_ARGS__); \
+  } while (0)
+#define LOG_DEBUG(fmt, ...)                                   \
+  do {                                                        \
+    if (osi_log_verbose()) LOG_LINE("D", fmt, ##__VA_ARGS__); \
+  } while (0)
+#define LOG_INFO(fmt, ...) LOG_LINE("I", fmt, ##__VA_ARGS__)
+#define LOG_WARN(fmt, ...) LOG_LINE("W", fmt, ##__VA_ARGS__)
+#define LOG_ERROR(fmt, ...) LOG_LINE("E", fmt, ##__VA_ARGS__)
@@ -0,0 +1,6 @@
+/*
+ * Host stand-in for osi/include/osi.h.
+ */
+#pragma once
+
+#define UNUSED_ATTR __attribute__((unused))
@@ -0,0 +1,17 @@
+/*
+ * Host stand-in for osi/include/properties.h. Properties live in a process
+ * local table that tests fill with osi_property_set().
+ */
+#pragma once
+
+#include <stdint.h>
+
+#define PROPERTY_VALUE_MAX 92
+
+int osi_property_get(const char* key, char* value, const char* default_value);
+int osi_property_set(const char* key, const char* value);
+int32_t osi_property_get_int32(const char* key, int32_t default_value);
+bool osi_property_get_bool(const char* key, bool default_value);
+
+// Host only: forgets every property set so far.
+void osi_property_clear(void);
@@ -0,0 +1,14 @@
+/*
+ * Host stand-in for osi/include/semaphore.h.
+ */
+#pragma once
+
+#include <stdbool.h>
+
+typedef struct semaphore_t semaphore_t;
+
+semaphore_t* semaphore_new(unsigned int value);
+void semaphore_free(semaphore_t* semaphore);
+void semaphore_wait(semaphore_t* semaphore);
+bool semaphore_try_wait(semaphore_t* semaphore);
+void semaphore_post(semaphore_t* semaphore);
@@ -0,0 +1,11 @@
+/*
+ * Host stand-in for osi/include/time.h.
+ */
+#pragma once
+
+#include <stdint.h>
+
+typedef uint64_t period_ms_t;
+
+uint64_t time_get_os_boottime_us(void);
+period_ms_t time_get_os_boottime_ms(void);
@@ -0,0 +1,159 @@
+/*
+ * Host implementations of the stack services the LHDC V3 sink codec links
+ * against: properties, semaphores, the boottime clock, the allocator and
+ * the small A2DP helpers from a2dp_codec_config.cc.
+ */
+
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <map>
+#include <mutex>
+#include <string>
+
+#include "a2dp_vendor.h"
+#include "bt_utils.h"
+#include "osi/include/allocator.h"
+#include "base/logging.h"
+#include "osi/include/log.h"
+#include "osi/include/osi.h"
+#include "osi/include/properties.h"
+#include "osi/include/semaphore.h"
+#include "osi/include/time.h"
+
+static std::mutex property_mutex;
+static std::map<std::string, std::string> properties;
+
+int osi_property_get(const char* key, char* value, const char* default_value) {
+  std::lock_guard<std::mutex> lock(property_mutex);
+  auto it = properties.find(key);
+  const char* src = (it != properties.end()) ? it->second.c_str()
+                                             : default_value;
+  if (src == nullptr) {
+    value[0] = '\0';
+    return 0;
+  }
+  snprintf(value, PROPERTY_VALUE_MAX, "%s", src);
+  return strlen(value);
+}
+
+int osi_property_set(const char* key, const char* value) {
+  std::lock_guard<std::mutex> lock(property_mutex);
+  properties[key] = value;
+  return 0;
+}
+
+int32_t osi_property_get_int32(const char* key, int32_t default_value) {
+  char value[PROPERTY_VALUE_MAX];
+  if (osi_property_get(key, value, nullptr) == 0) return default_value;
+  char* end = nullptr;
+  long result = strtol(value, &end, 0);
+  return (*end == '\0') ? (int32_t)result : default_value;
+}
+
+bool osi_property_get_bool(const char* key, bool default_value) {
+  char value[PROPERTY_VALUE_MAX];
+  if (osi_property_get(key, value, nullptr) == 0) return default_value;
+  if (!strcmp(value, "1") || !strcmp(value, "true")) return true;
+  if (!strcmp(value, "0") || !strcmp(value, "false")) return false;
+  return default_value;
+}
+
+void osi_property_clear(void) {
+  std::lock_guard<std::mutex> lock(property_mutex);
+  properties.clear();
+}
+
+bool osi_log_verbose(void) {
+  static const bool verbose = getenv("LHDCV3_SINK_HOST_VERBOSE") != nullptr;
+  return verbose;
+}
+
+void* osi_malloc(size_t size) {
+  void* ptr = malloc(size);
+  if (ptr == nullptr) abort();
+  return ptr;
+}
+
+void osi_free(void* ptr) { free(ptr); }
+
+struct semaphore_t {
+  sem_t sem;
+};
+
+semaphore_t* semaphore_new(unsigned int value) {
+  semaphore_t* semaphore = new semaphore_t;
+  sem_init(&semaphore->sem, 0, value);
+  return semaphore;
+}
+
+void semaphore_free(semaphore_t* semaphore) {
+  if (semaphore == nullptr) return;
+  sem_destroy(&semaphore->sem);
+  delete semaphore;
+}
+
+void semaphore_wait(semaphore_t* semaphore) {
+  while (sem_wait(&semaphore->sem) != 0) {
+  }
+}
+
+bool semaphore_try_wait(semaphore_t* semaphore) {
+  return sem_trywait(&semaphore->sem) == 0;
+}
+
+void semaphore_post(semaphore_t* semaphore) { sem_post(&semaphore->sem); }
+
+uint64_t time_get_os_boottime_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_BOOTTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+period_ms_t time_get_os_boottime_ms(void) {
+  return time_get_os_boottime_us() / 1000;
+}
+
+void raise_priority_a2dp(UNUSED_ATTR tHIGH_PRIORITY_TASK high_task) {}
+
+uint8_t A2DP_BitsSet(uint64_t num) {
+  if (num == 0) return A2DP_SET_ZERO_BIT;
+  return (num & (num - 1)) ? A2DP_SET_MULTL_BIT : A2DP_SET_ONE_BIT;
+}
+
+std::string loghex(uint32_t x) {
+  char buf[16];
+  snprintf(buf, sizeof(buf), "0x%x", x);
+  return buf;
+}
+
+bool AppendField(std::string* p_result, bool append, const std::string& name) {
+  CHECK(p_result != nullptr);
+  if (!append) return false;
+  if (!p_result->empty()) *p_result += "|";
+  *p_result += name;
+  return true;
+}
+
+A2dpCodecConfig::A2dpCodecConfig(btav_a2dp_codec_index_t codec_index,
+                                 const std::string& name,
+                                 btav_a2dp_codec_priority_t codec_priority)
+    : codec_index_(codec_index), name_(name) {
+  memset(&codec_config_, 0, sizeof(codec_config_));
+  codec_config_.codec_type = codec_index;
+  codec_config_.codec_priority = codec_priority;
+  memset(&codec_capability_, 0, sizeof(codec_capability_));
+  memset(&codec_local_capability_, 0, sizeof(codec_local_capability_));
+  memset(&codec_selectable_capability_, 0,
+         sizeof(codec_selectable_capability_));
+  memset(&codec_user_config_, 0, sizeof(codec_user_config_));
+  memset(&codec_audio_config_, 0, sizeof(codec_audio_config_));
+  memset(ota_codec_config_, 0, sizeof(ota_codec_config_));
+  memset(ota_codec_peer_capability_, 0, sizeof(ota_codec_peer_capability_));
+  memset(ota_codec_peer_config_, 0, sizeof(ota_codec_peer_config_));
+}
+
+bool A2dpCodecConfig::isValid() const { return true; }